@@ -0,0 +1,337 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements what the benchmarks share: generating synthetic
+ * knowledge bases, and timing operations.
+ *
+ * A generated knowledge base is described by a BenchSpec. Every entity,
+ * response and choice of facts is derived from the seed and the entity's
+ * index alone, so a benchmark can regenerate any fact (e.g. to look it up)
+ * without keeping the knowledge base in memory, and the same spec always
+ * gives the same file.
+ *
+ * bench_measure() runs an operation twice over: once untimed, for
+ * throughput, then timing each call, for latency percentiles. The latencies
+ * include the cost of reading the clock, some tens of nanoseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+#include "chat1002.h"
+
+/* the sections of a generated knowledge base, in the order written */
+const char *bench_intents[BENCH_INTENTS] = {"what", "where", "who"};
+
+// syllables from which entity names and responses are made
+static const char *syllables[] = {
+    "ka", "lo", "min", "ta", "ser", "vo", "ric", "del", "an", "tum", "pe", "shi",
+    "gra", "nor", "ex", "ul", "bi", "zan", "co", "ret", "mu", "fi", "dax", "en"
+};
+#define NSYLLABLES (sizeof syllables / sizeof syllables[0])
+
+
+/*
+ * Set a spec to the defaults: 10000 entities, responses of 20 to 120
+ * characters, every entity has a WHAT fact, 40% have a WHERE fact and 20%
+ * have a WHO fact.
+ */
+void bench_spec_default(BenchSpec *spec) {
+    spec->entities = 10000;
+    spec->minlen = 20;
+    spec->maxlen = 120;
+    spec->mix[0] = 100;
+    spec->mix[1] = 40;
+    spec->mix[2] = 20;
+    spec->seed = 1002;
+}
+
+
+/*
+ * Apply a command-line option that describes the knowledge base.
+ *
+ * Input:
+ *   spec - the spec to change
+ *   opt  - the option character, as returned by getopt()
+ *   arg  - the option's argument
+ *
+ * Returns: 1 if the option was applied, 0 if it does not describe the
+ *   knowledge base, -1 if its argument is invalid
+ */
+int bench_spec_option(BenchSpec *spec, int opt, const char *arg) {
+    char *end;
+    switch (opt) {
+    case 'n':
+        spec->entities = strtoul(arg, &end, 10);
+        return *end == '\0' && spec->entities > 0 ? 1 : -1;
+    case 'l':
+        if (sscanf(arg, "%zu-%zu", &spec->minlen, &spec->maxlen) != 2) {
+            spec->maxlen = spec->minlen = strtoul(arg, &end, 10);
+        }
+        return spec->minlen > 0 && spec->minlen <= spec->maxlen && spec->maxlen < MAX_RESPONSE ? 1 : -1;
+    case 'm':
+        if (sscanf(arg, "%d,%d,%d", &spec->mix[0], &spec->mix[1], &spec->mix[2]) != BENCH_INTENTS) {
+            return -1;
+        }
+        for (int j = 0; j < BENCH_INTENTS; j++) {
+            if (spec->mix[j] < 0 || spec->mix[j] > 100) {
+                return -1;
+            }
+        }
+        return 1;
+    case 's':
+        spec->seed = strtoul(arg, &end, 10);
+        return *end == '\0' ? 1 : -1;
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Describe the options accepted by bench_spec_option().
+ */
+void bench_spec_usage(FILE *f) {
+    fprintf(f, "  -n ENTITIES         the number of entities (default 10000)\n");
+    fprintf(f, "  -l MIN-MAX          the length of responses (default 20-120, at most %d)\n", MAX_RESPONSE - 1);
+    fprintf(f, "  -m WHAT,WHERE,WHO   the percentage of entities with a fact for each intent (default 100,40,20)\n");
+    fprintf(f, "  -s SEED             the seed for the generated names and responses (default 1002)\n");
+}
+
+
+/*
+ * Derive a pseudo-random number from a seed, an index and a salt
+ * (splitmix64).
+ */
+unsigned long bench_random(unsigned long seed, size_t i, unsigned long salt) {
+    unsigned long long x = seed + (unsigned long long) i * 0x9e3779b97f4a7c15ULL + salt * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (unsigned long) (x ^ (x >> 31));
+}
+
+
+/*
+ * Determine whether an entity has a fact for an intent.
+ *
+ * Input:
+ *   spec   - the knowledge base
+ *   i      - the index of the entity
+ *   intent - the index of the intent in bench_intents
+ */
+int bench_has_fact(const BenchSpec *spec, size_t i, int intent) {
+    return (int) (bench_random(spec->seed, i, 1 + intent) % 100) < spec->mix[intent];
+}
+
+
+/*
+ * Generate the name of an entity: two or three capitalised made-up words,
+ * followed by the entity's index so that every name is different.
+ *
+ * Input:
+ *   spec - the knowledge base
+ *   i    - the index of the entity
+ *   buf  - a buffer to receive the name
+ *   n    - the size of buf
+ */
+void bench_entity(const BenchSpec *spec, size_t i, char *buf, size_t n) {
+    unsigned long r = bench_random(spec->seed, i, 0);
+    int nwords = 2 + (int) (r % 2);
+    char name[MAX_ENTITY] = "";
+    size_t len = 0;
+    r /= 2;
+    for (int w = 0; w < nwords; w++) {
+        int nsyl = 1 + (int) (r % 3);
+        r /= 3;
+        for (int s = 0; s < nsyl; s++) {
+            const char *syl = syllables[r % NSYLLABLES];
+            r /= NSYLLABLES;
+            // a word starts with a capital letter
+            name[len++] = (char) (s == 0 ? syl[0] - ('a' - 'A') : syl[0]);
+            for (size_t c = 1; syl[c] != '\0'; c++) {
+                name[len++] = syl[c];
+            }
+        }
+        name[len++] = ' ';
+    }
+    name[len] = '\0';
+    snprintf(buf, n, "%s%zu", name, i);
+}
+
+
+/*
+ * Generate a response: made-up words ending with a full stop.
+ *
+ * Input:
+ *   spec   - the knowledge base
+ *   i      - the index of the entity
+ *   intent - the index of the intent in bench_intents
+ *   buf    - a buffer to receive the response
+ *   n      - the size of buf
+ */
+void bench_response(const BenchSpec *spec, size_t i, int intent, char *buf, size_t n) {
+    size_t target = spec->minlen + bench_random(spec->seed, i, 10 + intent) % (spec->maxlen - spec->minlen + 1);
+    if (target >= n) {
+        target = n - 1;
+    }
+    size_t len = 0;
+    for (size_t k = 0; len < target; k++) {
+        const char *syl = syllables[bench_random(spec->seed, i, 100 + k * BENCH_INTENTS + intent) % NSYLLABLES];
+        for (size_t s = 0; syl[s] != '\0' && len < target; s++) {
+            buf[len++] = syl[s];
+        }
+        // three syllables to a word
+        if (k % 3 == 2 && len < target) {
+            buf[len++] = ' ';
+        }
+    }
+    buf[0] -= 'a' - 'A';
+    if (target > 1 && buf[target - 2] == ' ') {
+        buf[target - 2] = 'a';
+    }
+    buf[target - 1] = '.';
+    buf[target] = '\0';
+}
+
+
+/*
+ * Write a generated knowledge base in INI format.
+ *
+ * Input:
+ *   spec - the knowledge base
+ *   f    - the file to write to
+ *
+ * Returns: the number of entity/response pairs written
+ */
+size_t bench_write_ini(const BenchSpec *spec, FILE *f) {
+    char entity[MAX_ENTITY];
+    char response[MAX_RESPONSE];
+    size_t count = 0;
+    for (int j = 0; j < BENCH_INTENTS; j++) {
+        fprintf(f, "%s[%s]\n", j == 0 ? "" : "\n", bench_intents[j]);
+        for (size_t i = 0; i < spec->entities; i++) {
+            if (bench_has_fact(spec, i, j)) {
+                bench_entity(spec, i, entity, sizeof entity);
+                bench_response(spec, i, j, response, sizeof response);
+                fprintf(f, "%s=%s\n", entity, response);
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+
+/*
+ * Get the time in nanoseconds.
+ */
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * Format a time in the most readable unit.
+ *
+ * Input:
+ *   ns  - the time in nanoseconds
+ *   buf - a buffer to receive the text
+ *   n   - the size of buf
+ *
+ * Returns: buf
+ */
+const char *bench_time(double ns, char *buf, size_t n) {
+    if (ns < 1e3) {
+        snprintf(buf, n, "%.0fns", ns);
+    }
+    else if (ns < 1e6) {
+        snprintf(buf, n, "%.1fus", ns / 1e3);
+    }
+    else if (ns < 1e9) {
+        snprintf(buf, n, "%.1fms", ns / 1e6);
+    }
+    else {
+        snprintf(buf, n, "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+
+static int bench_order(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Sort times into ascending order, so that percentiles can be read off.
+ */
+void bench_sort(double *samples, size_t n) {
+    qsort(samples, n, sizeof(double), bench_order);
+}
+
+
+/*
+ * Print the column headings for bench_measure().
+ */
+void bench_header() {
+    printf("%-24s %9s %12s %9s %9s %9s %9s %9s\n",
+           "benchmark", "ops", "ops/s", "MB/s", "p50", "p90", "p99", "max");
+}
+
+
+/*
+ * Measure an operation and print its throughput and latency percentiles.
+ *
+ * Input:
+ *   name  - the name to report the results under
+ *   setup - called before each run of operations, or NULL
+ *   op    - the operation
+ *   ctx   - passed to setup and op
+ *   n     - the number of operations in a run
+ *   bytes - the number of bytes each operation processes, or 0 to omit MB/s
+ */
+void bench_measure(const char *name, BenchSetup setup, BenchOp op, void *ctx, size_t n, size_t bytes) {
+    double *samples = malloc(n * sizeof(double));
+    if (samples == NULL) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        return;
+    }
+
+    if (setup != NULL) {
+        setup(ctx);
+    }
+    double start = bench_now();
+    for (size_t i = 0; i < n; i++) {
+        op(ctx, i);
+    }
+    double total = bench_now() - start;
+
+    if (setup != NULL) {
+        setup(ctx);
+    }
+    for (size_t i = 0; i < n; i++) {
+        double before = bench_now();
+        op(ctx, i);
+        samples[i] = bench_now() - before;
+    }
+    bench_sort(samples, n);
+
+    char mbs[16] = "-";
+    if (bytes > 0) {
+        snprintf(mbs, sizeof mbs, "%.1f", (double) bytes * n / total * 1e9 / (1 << 20));
+    }
+    char p50[16], p90[16], p99[16], max[16];
+    printf("%-24s %9zu %12.0f %9s %9s %9s %9s %9s\n", name, n, n / total * 1e9, mbs,
+           bench_time(samples[n / 2], p50, sizeof p50),
+           bench_time(samples[(size_t) (n * 0.90)], p90, sizeof p90),
+           bench_time(samples[(size_t) (n * 0.99)], p99, sizeof p99),
+           bench_time(samples[n - 1], max, sizeof max));
+    fflush(stdout);
+    free(samples);
+}
@@ -0,0 +1,48 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file contains the definitions and function prototypes shared by the
+ * benchmarks and the knowledge base generator.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* the intents a generated knowledge base has facts for */
+#define BENCH_INTENTS 3
+
+/* the shape of a generated knowledge base */
+typedef struct {
+    size_t entities;            /* the number of entities */
+    size_t minlen;              /* the length of the shortest response */
+    size_t maxlen;              /* the length of the longest response */
+    int mix[BENCH_INTENTS];     /* the percentage of entities with a fact for each intent */
+    unsigned long seed;         /* the same seed always gives the same knowledge base */
+} BenchSpec;
+
+/* a function that carries out the i-th operation being measured */
+typedef void (*BenchOp)(void *ctx, size_t i);
+
+/* a function that prepares for a run of operations, or NULL */
+typedef void (*BenchSetup)(void *ctx);
+
+/* functions defined in bench.c */
+extern const char *bench_intents[BENCH_INTENTS];
+void bench_spec_default(BenchSpec *spec);
+int bench_spec_option(BenchSpec *spec, int opt, const char *arg);
+void bench_spec_usage(FILE *f);
+unsigned long bench_random(unsigned long seed, size_t i, unsigned long salt);
+int bench_has_fact(const BenchSpec *spec, size_t i, int intent);
+void bench_entity(const BenchSpec *spec, size_t i, char *buf, size_t n);
+void bench_response(const BenchSpec *spec, size_t i, int intent, char *buf, size_t n);
+size_t bench_write_ini(const BenchSpec *spec, FILE *f);
+double bench_now();
+const char *bench_time(double ns, char *buf, size_t n);
+void bench_sort(double *samples, size_t n);
+void bench_header();
+void bench_measure(const char *name, BenchSetup setup, BenchOp op, void *ctx, size_t n, size_t bytes);
+
+#endif
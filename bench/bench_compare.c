@@ -0,0 +1,229 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file benchmarks case-insensitive comparison of words.
+ *
+ * compare_token() and compare_token_n() from token.c are timed against the
+ * original one-character-at-a-time compare_token(), kept here as the
+ * baseline, on the kinds of words the chatbot compares: short intents, words
+ * that differ only in case, and long entities. Before timing, every version is
+ * checked to order every pair the same way as the baseline.
+ *
+ * Usage: bench_compare [ROUNDS]
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "chat1002.h"
+
+/* the number of word pairs in each set */
+#define BENCH_PAIRS 1024
+
+/* a set of word pairs to compare */
+typedef struct {
+    const char *name;
+    char *a[BENCH_PAIRS];
+    char *b[BENCH_PAIRS];
+    size_t alen[BENCH_PAIRS];
+    size_t blen[BENCH_PAIRS];
+} BenchSet;
+
+// keeps the compiler from discarding the comparisons
+static volatile int sink;
+
+
+/*
+ * The original compare_token(), from main.c.
+ */
+static int baseline_compare_token(const char *token1, const char *token2) {
+    int i = 0;
+    while (token1[i] != '\0' && token2[i] != '\0') {
+        if (toupper(token1[i]) < toupper(token2[i]))
+            return -1;
+        else if (toupper(token1[i]) > toupper(token2[i]))
+            return 1;
+        i++;
+    }
+    if (token1[i] == '\0' && token2[i] == '\0')
+        return 0;
+    else if (token1[i] == '\0')
+        return -1;
+    else
+        return 1;
+}
+
+
+/*
+ * Make a random word.
+ *
+ * Input:
+ *   len - the number of characters
+ *
+ * Returns: the word, which must be freed by the caller
+ */
+static char *bench_word(size_t len) {
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_";
+    char *word = malloc(len + 1);
+    for (size_t i = 0; i < len; i++) {
+        word[i] = letters[rand() % (sizeof letters - 1)];
+    }
+    word[len] = '\0';
+    return word;
+}
+
+
+/*
+ * Copy a word, flipping the case of some of its letters and, sometimes,
+ * changing one character near the end.
+ */
+static char *bench_variant(const char *word, int differ) {
+    size_t len = strlen(word);
+    char *copy = malloc(len + 1);
+    for (size_t i = 0; i <= len; i++) {
+        char c = word[i];
+        copy[i] = (rand() & 1) ? (char) (isupper((unsigned char) c) ? tolower((unsigned char) c) : toupper((unsigned char) c)) : c;
+    }
+    if (differ && len > 0) {
+        copy[len - 1 - (rand() % (len < 4 ? len : 4))] ^= 0x01;
+    }
+    return copy;
+}
+
+
+/*
+ * Fill a set with pairs of words.
+ *
+ * Input:
+ *   set    - the set
+ *   name   - the name to report it under
+ *   minlen - the length of the shortest word
+ *   maxlen - the length of the longest word
+ *   differ - the percentage of pairs that differ other than by case
+ */
+static void bench_fill(BenchSet *set, const char *name, size_t minlen, size_t maxlen, int differ) {
+    set->name = name;
+    for (int i = 0; i < BENCH_PAIRS; i++) {
+        set->a[i] = bench_word(minlen + rand() % (maxlen - minlen + 1));
+        set->b[i] = bench_variant(set->a[i], rand() % 100 < differ);
+        set->alen[i] = strlen(set->a[i]);
+        set->blen[i] = strlen(set->b[i]);
+    }
+}
+
+
+/*
+ * Fill a set with the words the chatbot compares with its intents.
+ */
+static void bench_fill_intents(BenchSet *set) {
+    static const char *words[] = {
+        "what", "WHAT", "Where", "who", "is", "are", "IS", "from", "as", "to",
+        "you", "YOU", "hello", "Goodbye", "what's", "whatever", "wh", "w"
+    };
+    size_t nwords = sizeof words / sizeof words[0];
+    set->name = "intents";
+    for (int i = 0; i < BENCH_PAIRS; i++) {
+        set->a[i] = strdup(words[rand() % nwords]);
+        set->b[i] = strdup(words[rand() % nwords]);
+        set->alen[i] = strlen(set->a[i]);
+        set->blen[i] = strlen(set->b[i]);
+    }
+}
+
+
+/*
+ * Reduce a comparison to its sign.
+ */
+static int bench_sign(int order) {
+    return order < 0 ? -1 : order > 0;
+}
+
+
+/*
+ * Check that compare_token() and compare_token_n() agree with the baseline.
+ *
+ * Returns: the number of pairs on which they disagree
+ */
+static int bench_check(const BenchSet *set) {
+    int wrong = 0;
+    for (int i = 0; i < BENCH_PAIRS; i++) {
+        int expected = bench_sign(baseline_compare_token(set->a[i], set->b[i]));
+        if (bench_sign(compare_token(set->a[i], set->b[i])) != expected
+                || bench_sign(compare_token_n(set->a[i], set->alen[i], set->b[i], set->blen[i])) != expected
+                || token_equal(set->a[i], set->alen[i], set->b[i], set->blen[i]) != (expected == 0)) {
+            fprintf(stderr, "%s: mismatch on \"%s\" and \"%s\"\n", set->name, set->a[i], set->b[i]);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+
+/*
+ * Time each version on a set and print the results.
+ */
+static void bench_run(const BenchSet *set, int rounds) {
+    double start, base, fast, sized;
+    int sum = 0;
+
+    start = bench_now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < BENCH_PAIRS; i++) {
+            sum += baseline_compare_token(set->a[i], set->b[i]);
+        }
+    }
+    base = bench_now() - start;
+
+    start = bench_now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < BENCH_PAIRS; i++) {
+            sum += compare_token(set->a[i], set->b[i]);
+        }
+    }
+    fast = bench_now() - start;
+
+    start = bench_now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < BENCH_PAIRS; i++) {
+            sum += compare_token_n(set->a[i], set->alen[i], set->b[i], set->blen[i]);
+        }
+    }
+    sized = bench_now() - start;
+    sink = sum;
+
+    double ops = (double) rounds * BENCH_PAIRS;
+    printf("%-10s %10.2f %10.2f %10.2f %8.2fx %8.2fx\n", set->name,
+           base / ops, fast / ops, sized / ops, base / fast, base / sized);
+}
+
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    if (rounds <= 0) {
+        fprintf(stderr, "Usage: %s [ROUNDS]\n", argv[0]);
+        return 1;
+    }
+
+    static BenchSet sets[4];
+    srand(1002);
+    bench_fill_intents(&sets[0]);
+    bench_fill(&sets[1], "short", 2, 12, 50);
+    bench_fill(&sets[2], "entity", 16, 40, 20);
+    bench_fill(&sets[3], "long", 64, 64, 20);
+
+    int wrong = 0;
+    for (int i = 0; i < 4; i++) {
+        wrong += bench_check(&sets[i]);
+    }
+    if (wrong > 0) {
+        return 1;
+    }
+
+    printf("%-10s %10s %10s %10s %9s %9s\n", "set", "base ns", "token ns", "token_n ns", "speedup", "n speedup");
+    for (int i = 0; i < 4; i++) {
+        bench_run(&sets[i], rounds);
+    }
+    return 0;
+}
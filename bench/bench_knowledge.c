@@ -0,0 +1,347 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file benchmarks the knowledge base and the tokenizer on a generated
+ * knowledge base (see bench.c), reporting the throughput and latency
+ * percentiles of each operation:
+ *
+ *   knowledge_read        - loading the knowledge base, as RELOAD does
+ *   knowledge_read_files  - loading it from shards, one thread for each
+ *   knowledge_get         - WHAT/WHERE/WHO lookups of random entities, some
+ *                           of which miss
+ *   knowledge_get_many    - the same lookups, BENCH_MANY to an operation
+ *   knowledge_search      - SEARCH for the first two words of a random
+ *                           entity's response
+ *   knowledge_get_near    - WHAT lookups of random entities with one
+ *                           character left out, as a typo would
+ *   knowledge_write       - saving the knowledge base in INI format
+ *   knowledge_write_shards - saving it in shards, one thread for each
+ *   knowledge_put         - teaching every entity to an empty knowledge base
+ *   compare_token         - comparing entity names, half of them equal
+ *   token_split           - splitting questions and responses into words
+ *
+ * Usage: bench_knowledge [-n ENTITIES] [-l MIN-MAX] [-m WHAT,WHERE,WHO] [-s SEED]
+ *                        [-q QUERIES] [-r RUNS] [-w SHARDS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+#include "chat1002.h"
+
+/* the number of distinct lines used by the compare and split benchmarks */
+#define BENCH_POOL 4096
+
+/* the number of lookups in each knowledge_get_many() */
+#define BENCH_MANY 64
+
+/* the state shared by the benchmarks */
+typedef struct {
+    BenchSpec spec;
+    char *names;                /* every entity's name, MAX_ENTITY characters apart */
+    char **responses;           /* every entity's WHAT response */
+    char **folded;              /* a pool of names in lower case */
+    char **lines;               /* a pool of lines to split */
+    size_t *lens;               /* the length of each line */
+    FILE *ini;                  /* the generated knowledge base */
+    FILE *snapshot;             /* the same knowledge base as a snapshot */
+    FILE *out;                  /* scratch file for knowledge_write() */
+    char dir[32];               /* a directory for the shards */
+    char **shards;              /* the name of each shard */
+    FILE **shardfiles;          /* the shards, for knowledge_write_shards() */
+    int nshards;
+    KBQuery many[BENCH_MANY];   /* the lookups for knowledge_get_many() */
+    char manyresponses[BENCH_MANY][MAX_RESPONSE];
+    size_t hits;                /* the number of successful lookups */
+    int sink;                   /* keeps results from being discarded */
+} BenchState;
+
+
+/*
+ * Get the name of an entity.
+ */
+static const char *bench_name(const BenchState *state, size_t i) {
+    return state->names + i * MAX_ENTITY;
+}
+
+
+/*
+ * Load the knowledge base from a file the way RELOAD does, replacing the
+ * current one.
+ */
+static void bench_reload(FILE *f) {
+    if (knowledge_begin() != KB_OK) {
+        return;
+    }
+    rewind(f);
+    int count = knowledge_read(f);
+    knowledge_end(count >= 0);
+}
+
+static void bench_read_ini(void *ctx, size_t i) {
+    bench_reload(((BenchState *) ctx)->ini);
+}
+
+static void bench_read_snapshot(void *ctx, size_t i) {
+    bench_reload(((BenchState *) ctx)->snapshot);
+}
+
+static void bench_read_shards(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    if (knowledge_begin() != KB_OK) {
+        return;
+    }
+    int failed;
+    int count = knowledge_read_files(state->shards, state->nshards, state->nshards, &failed);
+    knowledge_end(count >= 0);
+}
+
+
+static void bench_get(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    char response[MAX_RESPONSE];
+    size_t e = bench_random(state->spec.seed, i, 1000) % state->spec.entities;
+    const char *intent = bench_intents[bench_random(state->spec.seed, i, 1001) % BENCH_INTENTS];
+    if (knowledge_get(intent, bench_name(state, e), response, MAX_RESPONSE) == KB_OK) {
+        state->hits++;
+    }
+}
+
+
+static void bench_get_many(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    for (size_t j = 0; j < BENCH_MANY; j++) {
+        size_t k = i * BENCH_MANY + j;
+        size_t e = bench_random(state->spec.seed, k, 1000) % state->spec.entities;
+        state->many[j].intent = bench_intents[bench_random(state->spec.seed, k, 1001) % BENCH_INTENTS];
+        state->many[j].entity = bench_name(state, e);
+        state->many[j].response = state->manyresponses[j];
+        state->many[j].n = MAX_RESPONSE;
+    }
+    state->sink += (int) knowledge_get_many(state->many, BENCH_MANY);
+}
+
+
+static void bench_search(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    KBHit hits[5];
+    char query[MAX_RESPONSE];
+    size_t e = bench_random(state->spec.seed, i, 1003) % state->spec.entities;
+    snprintf(query, sizeof query, "%s", state->responses[e]);
+    // the first two words
+    char *space = strchr(query, ' ');
+    if (space != NULL && (space = strchr(space + 1, ' ')) != NULL) {
+        *space = '\0';
+    }
+    state->sink += knowledge_search(query, hits, 5);
+}
+
+
+static void bench_get_near(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    char entity[MAX_ENTITY], nearest[MAX_ENTITY], response[MAX_RESPONSE];
+    size_t e = bench_random(state->spec.seed, i, 1004) % state->spec.entities;
+    snprintf(entity, sizeof entity, "%s", bench_name(state, e));
+    size_t len = strlen(entity);
+    size_t drop = bench_random(state->spec.seed, i, 1005) % len;
+    memmove(entity + drop, entity + drop + 1, len - drop);
+    state->sink += knowledge_get_near("what", entity, nearest, response, MAX_RESPONSE);
+}
+
+
+static void bench_write_ini_op(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    rewind(state->out);
+    knowledge_write(state->out);
+    fflush(state->out);
+}
+
+static void bench_write_snapshot_op(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    rewind(state->out);
+    knowledge_write_snapshot(state->out);
+    fflush(state->out);
+}
+
+static void bench_write_shards_op(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    for (int j = 0; j < state->nshards; j++) {
+        rewind(state->shardfiles[j]);
+    }
+    knowledge_write_shards(state->shardfiles, state->nshards);
+    for (int j = 0; j < state->nshards; j++) {
+        fflush(state->shardfiles[j]);
+    }
+}
+
+
+static void bench_put_setup(void *ctx) {
+    knowledge_reset();
+}
+
+static void bench_put(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    knowledge_put("what", bench_name(state, i), state->responses[i]);
+}
+
+
+static void bench_compare(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    size_t a = i % BENCH_POOL;
+    size_t b = bench_random(state->spec.seed, i, 1002) % 2 ? a : (a + 1) % BENCH_POOL;
+    state->sink += compare_token(bench_name(state, a % state->spec.entities), state->folded[b]);
+}
+
+
+static void bench_split(void *ctx, size_t i) {
+    BenchState *state = ctx;
+    Token words[32];
+    size_t j = i % (2 * BENCH_POOL);
+    state->sink += (int) token_split(state->lines[j], state->lens[j], words, 32);
+}
+
+
+/*
+ * Get the size of a file.
+ */
+static size_t bench_size(FILE *f) {
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    return size < 0 ? 0 : (size_t) size;
+}
+
+
+static void bench_usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    bench_spec_usage(stderr);
+    fprintf(stderr, "  -q QUERIES          the number of lookups, comparisons and splits (default 1000000)\n");
+    fprintf(stderr, "  -r RUNS             the number of times to read and write the knowledge base (default 20)\n");
+    fprintf(stderr, "  -w SHARDS           the number of shards, and threads, to read and write (default one per CPU)\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    static BenchState state;
+    size_t queries = 1000000;
+    size_t runs = 20;
+    int opt;
+
+    bench_spec_default(&state.spec);
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    state.nshards = online > 1 ? (int) online : 2;
+    while ((opt = getopt(argc, argv, "n:l:m:s:q:r:w:h")) != -1) {
+        int applied = bench_spec_option(&state.spec, opt, optarg);
+        if (applied > 0) {
+            continue;
+        }
+        if (applied == 0 && opt == 'w' && atoi(optarg) > 0) {
+            state.nshards = atoi(optarg);
+            continue;
+        }
+        if (applied == 0 && (opt == 'q' || opt == 'r')) {
+            size_t value = strtoul(optarg, NULL, 10);
+            if (value > 0) {
+                *(opt == 'q' ? &queries : &runs) = value;
+                continue;
+            }
+            applied = -1;
+        }
+        if (applied < 0) {
+            fprintf(stderr, "%s: invalid argument to -%c: %s\n", argv[0], opt, optarg);
+        }
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    // generate the knowledge base and everything the benchmarks look up
+    size_t n = state.spec.entities;
+    state.names = malloc(n * MAX_ENTITY);
+    state.responses = malloc(n * sizeof(char *));
+    state.folded = malloc(BENCH_POOL * sizeof(char *));
+    state.lines = malloc(2 * BENCH_POOL * sizeof(char *));
+    state.lens = malloc(2 * BENCH_POOL * sizeof(size_t));
+    state.ini = tmpfile();
+    state.snapshot = tmpfile();
+    state.out = tmpfile();
+    if (state.names == NULL || state.responses == NULL || state.folded == NULL || state.lines == NULL
+            || state.lens == NULL || state.ini == NULL || state.snapshot == NULL || state.out == NULL) {
+        fprintf(stderr, "%s: cannot set up the benchmark\n", argv[0]);
+        return 1;
+    }
+    char response[MAX_RESPONSE];
+    for (size_t i = 0; i < n; i++) {
+        bench_entity(&state.spec, i, state.names + i * MAX_ENTITY, MAX_ENTITY);
+        bench_response(&state.spec, i, 0, response, sizeof response);
+        state.responses[i] = strdup(response);
+    }
+    for (size_t i = 0; i < BENCH_POOL; i++) {
+        const char *name = bench_name(&state, i % n);
+        char line[MAX_ENTITY + MAX_RESPONSE];
+        state.folded[i] = strdup(name);
+        for (char *c = state.folded[i]; *c != '\0'; c++) {
+            *c = (char) (*c >= 'A' && *c <= 'Z' ? *c + ('a' - 'A') : *c);
+        }
+        snprintf(line, sizeof line, "%s is %s?", bench_intents[i % BENCH_INTENTS], name);
+        state.lines[2 * i] = strdup(line);
+        state.lines[2 * i + 1] = strdup(state.responses[i % n]);
+    }
+    size_t linebytes = 0;
+    for (size_t i = 0; i < 2 * BENCH_POOL; i++) {
+        state.lens[i] = strlen(state.lines[i]);
+        linebytes += state.lens[i];
+    }
+    size_t facts = bench_write_ini(&state.spec, state.ini);
+    size_t inibytes = bench_size(state.ini);
+    bench_reload(state.ini);
+    knowledge_write_snapshot(state.snapshot);
+    size_t snapbytes = bench_size(state.snapshot);
+    // the shards are read by name, so they live in a directory of their own
+    snprintf(state.dir, sizeof state.dir, "/tmp/bench_kb.XXXXXX");
+    state.shards = calloc(state.nshards, sizeof(char *));
+    state.shardfiles = calloc(state.nshards, sizeof(FILE *));
+    if (mkdtemp(state.dir) == NULL || state.shards == NULL || state.shardfiles == NULL) {
+        fprintf(stderr, "%s: cannot set up the benchmark\n", argv[0]);
+        return 1;
+    }
+    for (int j = 0; j < state.nshards; j++) {
+        char name[64];
+        snprintf(name, sizeof name, "%s/shard-%03d.ini", state.dir, j);
+        state.shards[j] = strdup(name);
+        state.shardfiles[j] = fopen(name, "w+");
+        if (state.shards[j] == NULL || state.shardfiles[j] == NULL) {
+            fprintf(stderr, "%s: cannot set up the benchmark\n", argv[0]);
+            return 1;
+        }
+    }
+    bench_write_shards_op(&state, 0);
+    chatbot_set_interactive(0);
+
+    printf("%zu entities, %zu responses, %zu bytes INI, %zu bytes snapshot, %d shards\n\n", n, facts, inibytes,
+           snapbytes, state.nshards);
+    bench_header();
+    bench_measure("knowledge_read (ini)", NULL, bench_read_ini, &state, runs, inibytes);
+    bench_measure("knowledge_read (snap)", NULL, bench_read_snapshot, &state, runs, snapbytes);
+    bench_measure("knowledge_read_files", NULL, bench_read_shards, &state, runs, inibytes);
+    bench_measure("knowledge_get", NULL, bench_get, &state, queries, 0);
+    bench_measure("knowledge_search", NULL, bench_search, &state, queries / 100 + 1, 0);
+    bench_measure("knowledge_get_near", NULL, bench_get_near, &state, queries / 10 + 1, 0);
+    bench_measure("knowledge_get_many", NULL, bench_get_many, &state, (queries + BENCH_MANY - 1) / BENCH_MANY, 0);
+    bench_measure("knowledge_write (ini)", NULL, bench_write_ini_op, &state, runs, inibytes);
+    bench_measure("knowledge_write (snap)", NULL, bench_write_snapshot_op, &state, runs, snapbytes);
+    bench_measure("knowledge_write_shards", NULL, bench_write_shards_op, &state, runs, inibytes);
+    bench_measure("knowledge_put", bench_put_setup, bench_put, &state, n, 0);
+    bench_measure("compare_token", NULL, bench_compare, &state, queries, 0);
+    bench_measure("token_split", NULL, bench_split, &state, queries, linebytes / (2 * BENCH_POOL));
+    printf("\n%.1f%% of lookups found a response\n", 100.0 * state.hits / (2.0 * queries));
+
+    knowledge_reset();
+    for (int j = 0; j < state.nshards; j++) {
+        fclose(state.shardfiles[j]);
+        remove(state.shards[j]);
+    }
+    rmdir(state.dir);
+    return 0;
+}
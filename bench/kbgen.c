@@ -0,0 +1,61 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements kbgen, which writes a synthetic knowledge base in INI
+ * format, for benchmarking and load testing.
+ *
+ * Usage: kbgen [-n ENTITIES] [-l MIN-MAX] [-m WHAT,WHERE,WHO] [-s SEED] [-o FILE]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+
+
+static void kbgen_usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    bench_spec_usage(stderr);
+    fprintf(stderr, "  -o FILE             the file to write (default standard output)\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    BenchSpec spec;
+    const char *output = NULL;
+    int opt;
+
+    bench_spec_default(&spec);
+    while ((opt = getopt(argc, argv, "n:l:m:s:o:h")) != -1) {
+        int applied = bench_spec_option(&spec, opt, optarg);
+        if (applied > 0) {
+            continue;
+        }
+        if (applied == 0 && opt == 'o') {
+            output = optarg;
+            continue;
+        }
+        if (applied < 0) {
+            fprintf(stderr, "%s: invalid argument to -%c: %s\n", argv[0], opt, optarg);
+        }
+        kbgen_usage(argv[0]);
+        return 1;
+    }
+    if (optind < argc) {
+        kbgen_usage(argv[0]);
+        return 1;
+    }
+
+    FILE *f = output == NULL ? stdout : fopen(output, "w");
+    if (f == NULL) {
+        perror(output);
+        return 1;
+    }
+    size_t count = bench_write_ini(&spec, f);
+    if (fclose(f) != 0) {
+        perror(output == NULL ? "stdout" : output);
+        return 1;
+    }
+    fprintf(stderr, "%zu entities, %zu responses\n", spec.entities, count);
+    return 0;
+}
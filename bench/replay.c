@@ -0,0 +1,409 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements replay, which plays recorded transcripts (see
+ * transcript.c; record one with ICT1002_Chatbot --record FILE) back through
+ * chatbot_session() and reports the throughput and the latency of each
+ * intent.
+ *
+ * Each recorded session is replayed with a ChatSession of its own, in the
+ * order the records were written. Answers to the chatbot's questions are
+ * handled the way the servers handle them: an answer ('+') is given only if
+ * the session is waiting for one, and is otherwise skipped (e.g. the chatbot
+ * asked to overwrite a file, which sessions never do). If a session is
+ * waiting for an answer that the transcript does not give, because the
+ * knowledge base no longer matches the recording, the question is dismissed
+ * with an empty answer and counted as a desync. Replies that differ from the
+ * recorded ones are counted too.
+ *
+ * With a target rate, inputs are started on a fixed schedule however long
+ * earlier ones took, and the "scheduled" row reports the time from when each
+ * input should have started to when it was answered, which includes any
+ * time spent waiting behind slow inputs.
+ *
+ * Commands in the transcript really run: SAVE writes files relative to the
+ * current directory.
+ *
+ * Usage: replay [-r RATE] [-n REPEAT] [-k FILE] TRANSCRIPT...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+#include "chat1002.h"
+
+/* the width of the longest bar in a histogram */
+#define REPLAY_BAR 40
+
+/* the number of histogram buckets; bucket b counts times from 2^b ns */
+#define REPLAY_BUCKETS 40
+
+/* a record read from a transcript */
+typedef struct {
+    size_t session;             /* the index of the session in sessions */
+    char kind;                  /* '>', '+' or '<' */
+    char *text;
+} ReplayRecord;
+
+/* a session being replayed */
+typedef struct {
+    ChatSession chat;
+    char response[MAX_RESPONSE];    /* the reply to the session's last input */
+    int pending;                /* 1 if response is yet to be compared with the transcript */
+} ReplaySession;
+
+/* the latencies of one intent */
+typedef struct {
+    char name[MAX_INTENT + 2];
+    double *samples;
+    size_t count;
+    size_t size;
+} ReplayIntent;
+
+// the transcripts
+static ReplayRecord *records;
+static size_t nrecords;
+static ReplaySession *sessions;
+static size_t nsessions;
+
+// the latencies, by intent
+static ReplayIntent *intents;
+static size_t nintents;
+
+
+/*
+ * Add a latency to an intent's samples.
+ */
+static void replay_sample(ReplayIntent *intent, double ns) {
+    if (intent->count == intent->size) {
+        intent->size = intent->size == 0 ? 1024 : intent->size * 2;
+        intent->samples = realloc(intent->samples, intent->size * sizeof(double));
+        if (intent->samples == NULL) {
+            fprintf(stderr, "replay: out of memory\n");
+            exit(1);
+        }
+    }
+    intent->samples[intent->count++] = ns;
+}
+
+
+/*
+ * Find the samples for an intent, adding them if there are none yet.
+ */
+static ReplayIntent *replay_intent(const char *name) {
+    for (size_t i = 0; i < nintents; i++) {
+        if (strcmp(intents[i].name, name) == 0) {
+            return &intents[i];
+        }
+    }
+    intents = realloc(intents, (nintents + 1) * sizeof(ReplayIntent));
+    if (intents == NULL) {
+        fprintf(stderr, "replay: out of memory\n");
+        exit(1);
+    }
+    ReplayIntent *intent = &intents[nintents++];
+    memset(intent, 0, sizeof *intent);
+    snprintf(intent->name, sizeof intent->name, "%s", name);
+    return intent;
+}
+
+
+/*
+ * Classify an input by the intent its first word selects.
+ *
+ * Returns: the intent's word, "(unknown)", or NULL if the input has no words
+ */
+static const char *replay_classify(const char *text) {
+    Token word;
+    char first[MAX_INTENT];
+    if (token_split(text, strlen(text), &word, 1) == 0) {
+        return NULL;
+    }
+    if (word.len >= MAX_INTENT) {
+        return "(unknown)";
+    }
+    memcpy(first, word.start, word.len);
+    first[word.len] = '\0';
+    const Intent *intent = intent_find(first);
+    return intent == NULL ? "(unknown)" : intent->word;
+}
+
+
+/*
+ * Read a transcript, appending its records to those already read.
+ *
+ * Input:
+ *   filename - the transcript
+ *
+ * Returns: 0 on success, -1 if the file could not be read
+ */
+static int replay_load(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+
+    // map the transcript's session numbers to indexes in sessions
+    unsigned long *ids = NULL;
+    size_t nids = 0;
+    size_t first = nsessions;
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    long lineno = 0;
+    while ((len = getline(&line, &size, f)) != -1) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        unsigned long id;
+        char kind;
+        int offset;
+        if (sscanf(line, "%lu %c%n", &id, &kind, &offset) != 2 || (kind != '>' && kind != '+' && kind != '<')) {
+            fprintf(stderr, "%s:%ld: not a transcript record\n", filename, lineno);
+            continue;
+        }
+        const char *text = line + offset + (line[offset] == ' ');
+
+        size_t s;
+        for (s = 0; s < nids && ids[s] != id; s++);
+        if (s == nids) {
+            ids = realloc(ids, (nids + 1) * sizeof(unsigned long));
+            sessions = realloc(sessions, (first + nids + 1) * sizeof(ReplaySession));
+            if (ids == NULL || sessions == NULL) {
+                fprintf(stderr, "replay: out of memory\n");
+                exit(1);
+            }
+            ids[nids++] = id;
+            nsessions++;
+        }
+
+        if ((nrecords & (nrecords - 1)) == 0) {
+            records = realloc(records, (nrecords == 0 ? 1 : nrecords * 2) * sizeof(ReplayRecord));
+        }
+        char *copy = strdup(text);
+        if (records == NULL || copy == NULL) {
+            fprintf(stderr, "replay: out of memory\n");
+            exit(1);
+        }
+        records[nrecords].session = first + s;
+        records[nrecords].kind = kind;
+        records[nrecords].text = copy;
+        nrecords++;
+    }
+    free(line);
+    free(ids);
+    fclose(f);
+    return 0;
+}
+
+
+/*
+ * Print a histogram of sorted latencies, one row for each power of two.
+ */
+static void replay_histogram(const ReplayIntent *intent) {
+    size_t counts[REPLAY_BUCKETS] = {0};
+    int lo = REPLAY_BUCKETS, hi = 0;
+    size_t most = 0;
+    for (size_t i = 0; i < intent->count; i++) {
+        int b = 0;
+        while (b < REPLAY_BUCKETS - 1 && intent->samples[i] >= (double) (2ULL << b)) {
+            b++;
+        }
+        counts[b]++;
+        lo = b < lo ? b : lo;
+        hi = b > hi ? b : hi;
+        most = counts[b] > most ? counts[b] : most;
+    }
+    printf("\n%s\n", intent->name);
+    for (int b = lo; b <= hi; b++) {
+        char from[16], to[16];
+        int width = (int) ((counts[b] * REPLAY_BAR + most - 1) / most);
+        printf("  %8s - %-8s %9zu |%.*s\n", bench_time(b == 0 ? 0 : (double) (1ULL << b), from, sizeof from),
+               bench_time((double) (2ULL << b), to, sizeof to), counts[b], width,
+               "########################################");
+    }
+}
+
+
+/*
+ * Print a row of latency percentiles.
+ */
+static void replay_row(ReplayIntent *intent) {
+    char p50[16], p90[16], p99[16], max[16];
+    if (intent->count == 0) {
+        return;
+    }
+    bench_sort(intent->samples, intent->count);
+    printf("%-16s %9zu %9s %9s %9s %9s\n", intent->name, intent->count,
+           bench_time(intent->samples[intent->count / 2], p50, sizeof p50),
+           bench_time(intent->samples[(size_t) (intent->count * 0.90)], p90, sizeof p90),
+           bench_time(intent->samples[(size_t) (intent->count * 0.99)], p99, sizeof p99),
+           bench_time(intent->samples[intent->count - 1], max, sizeof max));
+}
+
+
+static void replay_usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-r RATE] [-n REPEAT] [-k FILE] TRANSCRIPT...\n", argv0);
+    fprintf(stderr, "  -r RATE     start inputs at this many per second (default as fast as possible)\n");
+    fprintf(stderr, "  -n REPEAT   play the transcripts this many times (default 1)\n");
+    fprintf(stderr, "  -k FILE     load this knowledge base first\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    double rate = 0;
+    long repeat = 1;
+    const char *kbfile = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:k:h")) != -1) {
+        if (opt == 'r' && (rate = atof(optarg)) > 0) {
+            continue;
+        }
+        if (opt == 'n' && (repeat = atol(optarg)) > 0) {
+            continue;
+        }
+        if (opt == 'k') {
+            kbfile = optarg;
+            continue;
+        }
+        replay_usage(argv[0]);
+        return 1;
+    }
+    if (optind == argc) {
+        replay_usage(argv[0]);
+        return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (replay_load(argv[i]) != 0) {
+            return 1;
+        }
+    }
+
+    // start the way the chatbot does, but never prompt
+    char *inv[] = {"reset", NULL};
+    char output[MAX_RESPONSE];
+    chatbot_do_reset(1, inv, output, MAX_RESPONSE);
+    chatbot_set_interactive(0);
+    if (kbfile != NULL) {
+        FILE *f = fopen(kbfile, "r");
+        if (f == NULL) {
+            perror(kbfile);
+            return 1;
+        }
+        knowledge_read(f);
+        fclose(f);
+    }
+
+    // the totals come first; intents are added as they are seen
+    size_t totals = 1;
+    replay_intent("all");
+    if (rate > 0) {
+        replay_intent("scheduled");
+        totals++;
+    }
+    char *line = malloc(1);
+    size_t linesize = 1;
+    size_t inputs = 0, skipped = 0, desyncs = 0, mismatches = 0;
+    double start = bench_now();
+
+    for (long rep = 0; rep < repeat; rep++) {
+        memset(sessions, 0, nsessions * sizeof(ReplaySession));
+        for (size_t r = 0; r < nrecords; r++) {
+            ReplayRecord *record = &records[r];
+            ReplaySession *s = &sessions[record->session];
+            const char *name;
+
+            if (record->kind == '<') {
+                if (s->pending) {
+                    mismatches += strcmp(s->response, record->text) != 0;
+                    s->pending = 0;
+                }
+                continue;
+            }
+            if (record->kind == '+') {
+                if (!s->chat.teaching) {
+                    skipped++;
+                    continue;
+                }
+                name = "(answer)";
+            }
+            else {
+                name = replay_classify(record->text);
+                if (name == NULL) {
+                    continue;
+                }
+                if (s->chat.teaching) {
+                    char none[] = "";
+                    chatbot_session(&s->chat, none, s->response, MAX_RESPONSE);
+                    desyncs++;
+                }
+            }
+
+            size_t len = strlen(record->text);
+            if (len + 1 > linesize) {
+                linesize = len + 1;
+                line = realloc(line, linesize);
+                if (line == NULL) {
+                    fprintf(stderr, "replay: out of memory\n");
+                    return 1;
+                }
+            }
+            memcpy(line, record->text, len + 1);
+
+            // wait until this input is due
+            double due = rate > 0 ? start + inputs / rate * 1e9 : 0;
+            if (rate > 0) {
+                double wait = due - bench_now();
+                if (wait > 0) {
+                    struct timespec ts = {(time_t) (wait / 1e9), (long) ((long long) wait % 1000000000)};
+                    nanosleep(&ts, NULL);
+                }
+            }
+
+            double before = bench_now();
+            int done = chatbot_session(&s->chat, line, s->response, MAX_RESPONSE);
+            double after = bench_now();
+
+            replay_sample(replay_intent(name), after - before);
+            replay_sample(&intents[0], after - before);
+            if (rate > 0) {
+                replay_sample(&intents[1], after - due);
+            }
+            s->pending = 1;
+            inputs++;
+            if (done) {
+                memset(&s->chat, 0, sizeof s->chat);
+            }
+        }
+    }
+    double elapsed = bench_now() - start;
+    chatbot_bgsave_poll(1);
+    free(line);
+
+    printf("replayed %zu inputs from %zu sessions in %.3fs: %.0f inputs/s", inputs, nsessions * repeat,
+           elapsed / 1e9, inputs / elapsed * 1e9);
+    if (rate > 0) {
+        printf(" (target %.0f/s)", rate);
+    }
+    printf("\n%zu answers skipped, %zu desyncs, %zu replies differ from the transcript\n\n",
+           skipped, desyncs, mismatches);
+    // the intents in the order first seen, then the totals
+    printf("%-16s %9s %9s %9s %9s %9s\n", "intent", "count", "p50", "p90", "p99", "max");
+    for (size_t i = totals; i < nintents + totals; i++) {
+        replay_row(&intents[i % nintents]);
+    }
+    for (size_t i = totals; i < nintents + totals; i++) {
+        if (intents[i % nintents].count > 0) {
+            replay_histogram(&intents[i % nintents]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements a bump allocator used to store the knowledge base.
+ *
+ * arena_alloc() hands out memory from the current chunk, starting a new one
+ * when it is full. Individual allocations are never freed; arena_reset()
+ * releases everything at once, so throwing away a whole knowledge base costs
+ * one free() per chunk rather than one per entity.
+ */
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+/* the size of the first chunk, later chunks double up to ARENA_MAX_CHUNK */
+#define ARENA_MIN_CHUNK (64 * 1024)
+#define ARENA_MAX_CHUNK (4 * 1024 * 1024)
+
+
+/*
+ * Start a new chunk able to hold at least size bytes.
+ *
+ * Input:
+ *   arena - the arena
+ *   size  - the number of bytes needed
+ *
+ * Returns: the new chunk, or NULL if there was a memory allocation failure
+ */
+static ArenaChunk *arena_grow(Arena *arena, size_t size) {
+    size_t want = arena->chunk == NULL ? ARENA_MIN_CHUNK : arena->chunk->size * 2;
+    if (want > ARENA_MAX_CHUNK) {
+        want = ARENA_MAX_CHUNK;
+    }
+    if (want < size) {
+        want = size;
+    }
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + want);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->size = want;
+    chunk->used = 0;
+    chunk->next = arena->chunk;
+    arena->chunk = chunk;
+    arena->reserved += want;
+    return chunk;
+}
+
+
+/*
+ * Allocate memory from an arena. The memory is suitably aligned for any type
+ * and stays valid until the next arena_reset().
+ *
+ * Input:
+ *   arena - the arena
+ *   size  - the number of bytes to allocate
+ *
+ * Returns: the memory, or NULL if there was a memory allocation failure
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    const size_t align = alignof(max_align_t);
+    ArenaChunk *chunk = arena->chunk;
+    size_t offset = 0;
+    if (chunk != NULL) {
+        offset = (chunk->used + align - 1) & ~(align - 1);
+    }
+    if (chunk == NULL || offset + size > chunk->size) {
+        chunk = arena_grow(arena, size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        offset = 0;
+    }
+    chunk->used = offset + size;
+    return chunk->data + offset;
+}
+
+
+/*
+ * Copy a string into an arena.
+ *
+ * Input:
+ *   arena - the arena
+ *   s     - the string, which need not be null-terminated
+ *   len   - the number of characters to copy from s
+ *
+ * Returns: the null-terminated copy, or NULL if there was a memory allocation failure
+ */
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+    // strings need no alignment, so pack them tightly
+    ArenaChunk *chunk = arena->chunk;
+    if (chunk == NULL || chunk->used + len + 1 > chunk->size) {
+        chunk = arena_grow(arena, len + 1);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    chunk->used += len + 1;
+    return copy;
+}
+
+
+/*
+ * Release everything allocated from an arena. The most recent chunk is kept
+ * for reuse, all others are freed.
+ *
+ * Input:
+ *   arena - the arena
+ */
+void arena_reset(Arena *arena) {
+    ArenaChunk *chunk = arena->chunk;
+    if (chunk == NULL) {
+        return;
+    }
+    ArenaChunk *current = chunk->next;
+    while (current != NULL) {
+        ArenaChunk *next = current->next;
+        free(current);
+        current = next;
+    }
+    chunk->next = NULL;
+    chunk->used = 0;
+    arena->reserved = chunk->size;
+}
+
+
+/*
+ * Release everything allocated from an arena, including the last chunk.
+ *
+ * Input:
+ *   arena - the arena
+ */
+void arena_free(Arena *arena) {
+    arena_reset(arena);
+    free(arena->chunk);
+    arena->chunk = NULL;
+    arena->reserved = 0;
+}
+
+
+/*
+ * Move everything allocated from one arena into another, so that it stays
+ * valid until the other arena is reset. Allocation carries on in the
+ * receiving arena's current chunk.
+ *
+ * Input:
+ *   arena - the arena to receive the chunks
+ *   other - the arena to take them from, which is left empty
+ */
+void arena_adopt(Arena *arena, Arena *other) {
+    ArenaChunk *last = other->chunk;
+    if (last == NULL) {
+        return;
+    }
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    if (arena->chunk == NULL) {
+        arena->chunk = other->chunk;
+    }
+    else {
+        // keep filling the current chunk, the adopted ones are full enough
+        last->next = arena->chunk->next;
+        arena->chunk->next = other->chunk;
+    }
+    arena->reserved += other->reserved;
+    other->chunk = NULL;
+    other->reserved = 0;
+}
+
+
+/*
+ * Get the number of bytes an arena is holding on to.
+ *
+ * Input:
+ *   arena - the arena
+ *
+ * Returns: the total size of all chunks
+ */
+size_t arena_reserved(const Arena *arena) {
+    return arena->reserved;
+}
@@ -8,6 +8,8 @@
 #ifndef _CHAT1002_H
 #define _CHAT1002_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /* the maximum number of characters we expect in a line of input (including the terminating null)  */
@@ -29,28 +31,121 @@
 #define KB_NOMEM    -3
 #define F_INVALID   -4
 
+/* a block of memory handed out by an Arena */
+typedef struct arena_chunk {
+    struct arena_chunk *next;   /* the previously filled chunk */
+    size_t size;                /* the number of usable bytes in data */
+    size_t used;                /* the number of bytes handed out from data */
+    char data[];
+} ArenaChunk;
+
+/* a bump allocator whose allocations are all released together */
+typedef struct arena {
+    ArenaChunk *chunk;          /* the chunk currently being filled */
+    size_t reserved;            /* the total number of bytes held by all chunks */
+} Arena;
+
+/* strings are variable-length and live in the knowledge base's arena; the
+   responses are kept apart, in one table for each question word */
 typedef struct node {
-    char entity[MAX_ENTITY];
-    char what[MAX_RESPONSE];
-    char who[MAX_RESPONSE];
-    char where[MAX_RESPONSE];
-    struct node *next;
+    const char *entity;         /* the entity, as it was first taught */
+    const char *key;            /* the entity folded to lower case */
+    unsigned long hash;         /* hash of key */
+    size_t keylen;              /* the length of key */
+    uint32_t id;                /* numbers the entities in the order they were added, from 0 */
+    struct node *chain;         /* next node in the same hash bucket */
 } EntityNode;
 
+/* the state of one conversation served by server.c or event.c */
+typedef struct session {
+    int teaching;               /* 1 if the next line answers the question below, 2 if a near
+                                   entity was suggested too, which a blank line accepts */
+    char intent[MAX_INTENT];    /* the question the chatbot could not answer */
+    char entity[MAX_ENTITY];
+    unsigned long id;           /* the session's number in a transcript, or 0 if not yet numbered */
+} ChatSession;
 
-/* functions defined in main.c */
-int compare_token(const char *token1, const char *token2);
-void prompt_user(char *buf, int n, const char *format, ...);
+/* a knowledge base, whose contents are private to knowledge.c (see knowledge_create()) */
+typedef struct kb_context KBContext;
+
+/* a question for knowledge_get_many() */
+typedef struct {
+    const char *intent;         /* the question word */
+    const char *entity;         /* the entity */
+    char *response;             /* a buffer to receive the response */
+    int n;                      /* the size of the response buffer */
+    int result;                 /* receives the result, as knowledge_get() returns it */
+} KBQuery;
+
+/* an entity found by knowledge_search() */
+typedef struct {
+    char entity[MAX_ENTITY];    /* the entity's name */
+    double score;               /* how well its responses match, higher is better */
+} KBHit;
+
+/* a function that carries out an intent, see chatbot.c */
+typedef int (*IntentHandler)(int inc, char *inv[], char *response, int n);
+
+/* kinds of intent */
+#define INTENT_COMMAND   0
+#define INTENT_QUESTION  1
+#define INTENT_SMALLTALK 2
+
+/* an intent recognised by chatbot_main() */
+typedef struct intent {
+    const char *word;           /* the first word of input that selects it */
+    IntentHandler handler;
+    int kind;                   /* one of INTENT_* */
+    int id;                     /* numbers the registered intents from 0, set by intent_register() */
+} Intent;
+
+/* counters kept by metrics.c */
+#define METRIC_HITS      0      /* knowledge_get() found a response */
+#define METRIC_MISSES    1      /* knowledge_get() found none */
+#define METRIC_COUNTERS  2
+
+/* timers kept by metrics.c */
+#define METRIC_READ      0      /* knowledge_read() */
+#define METRIC_WRITE     1      /* knowledge_write() and knowledge_write_snapshot() */
+#define METRIC_UNKNOWN   2      /* input that selects no intent */
+#define METRIC_OTHER     3      /* intents registered after every timer was taken */
+#define METRIC_INTENT    4      /* the first intent; an intent's timer is METRIC_INTENT + its id */
+#define METRIC_TIMERS    (METRIC_INTENT + 48)
+
+/* a word of input: a span of a line, which is not null-terminated */
+typedef struct token {
+    const char *start;
+    size_t len;
+} Token;
+
+
+/* functions defined in arena.c */
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *s, size_t len);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+void arena_adopt(Arena *arena, Arena *other);
+size_t arena_reserved(const Arena *arena);
 
 /* functions defined in chatbot.c */
 const char *chatbot_botname();
 const char *chatbot_username();
+void prompt_user(char *buf, int n, const char *format, ...);
+void chatbot_set_interactive(int on);
+void chatbot_set_default_answer(const char *answer);
+void chatbot_set_workers(int n);
+const Intent *chatbot_intents(size_t *count);
+int chatbot_session(ChatSession *s, char *line, char *response, int n);
 int chatbot_main(int inc, char *inv[], char *response, int n);
+int chatbot_main_ctx(KBContext *ctx, int inc, char *inv[], char *response, int n);
 int chatbot_is_exit(const char *intent);
 int chatbot_do_exit(int inc, char *inv[], char *response, int n);
 int chatbot_is_load(const char *intent);
 int chatbot_do_load(int inc, char *inv[], char *response, int n);
+int chatbot_is_reload(const char *intent);
+int chatbot_do_reload(int inc, char *inv[], char *response, int n);
 int chatbot_is_question(const char *intent);
+int chatbot_add_question(const char *intent);
 int chatbot_do_question(int inc, char *inv[], char *response, int n);
 int chatbot_is_reset(const char *intent);
 int chatbot_do_reset(int inc, char *inv[], char *response, int n);
@@ -58,12 +153,106 @@ int chatbot_is_save(const char *intent);
 int chatbot_do_save(int inc, char *inv[], char *response, int n);
 int chatbot_is_smalltalk(const char *intent);
 int chatbot_do_smalltalk(int inc, char *inv[], char *resonse, int n);
+int chatbot_is_bgsave(const char *intent);
+int chatbot_do_bgsave(int inc, char *inv[], char *response, int n);
+int chatbot_bgsave_poll(int wait);
+int chatbot_is_compact(const char *intent);
+int chatbot_do_compact(int inc, char *inv[], char *response, int n);
+int chatbot_is_stats(const char *intent);
+int chatbot_do_stats(int inc, char *inv[], char *response, int n);
+int chatbot_is_search(const char *intent);
+int chatbot_do_search(int inc, char *inv[], char *response, int n);
+
+/* functions defined in epoch.c */
+int epoch_enter();
+void epoch_exit();
+unsigned long epoch_advance();
+int epoch_safe(unsigned long epoch);
+
+/* functions defined in intent.c */
+int intent_register(const char *word, IntentHandler handler, int kind);
+const Intent *intent_find(const char *word);
+const Intent *intent_get(int id);
+
+/* functions defined in transcript.c */
+int transcript_open(const char *filename);
+void transcript_close();
+int transcript_recording();
+unsigned long transcript_session();
+void transcript_record(unsigned long session, char kind, const char *text);
+
+/* functions defined in token.c */
+int compare_token(const char *token1, const char *token2);
+int compare_token_n(const char *token1, size_t len1, const char *token2, size_t len2);
+int token_equal(const char *token1, size_t len1, const char *token2, size_t len2);
+int split_words(char *input, char *inv[], int max);
+int token_next(const char **cursor, const char *end, Token *word);
+size_t token_split(const char *line, size_t len, Token *words, size_t max);
+
+/* functions defined in journal.c */
+void journal_enable(int on);
+int journal_base(char *buf, int n);
+int journal_attach(const char *filename);
+int journal_append(const char *intent, const char *entity, const char *response);
+int journal_commit();
+int journal_sync();
+long journal_mark();
+int journal_truncate(long mark);
+void journal_close();
+
+/* functions defined in metrics.c */
+uint64_t metrics_now();
+void metrics_count(int counter);
+void metrics_time(int timer, uint64_t ns);
+int metrics_format(const char *name, char *buf, int n);
+int metrics_dump_start(const char *filename, int seconds);
+void metrics_dump_stop();
+
+/* functions defined in trace.c */
+int trace_open(const char *filename);
+void trace_close();
+uint64_t trace_start();
+void trace_span(const char *name, const char *detail, uint64_t start);
+
+/* functions defined in server.c */
+int server_listen(const char *path);
+int server_run(const char *path);
+
+/* functions defined in event.c */
+int event_run(const char *path);
 
 /* functions defined in knowledge.c */
+KBContext *knowledge_create();
+void knowledge_destroy(KBContext *ctx);
+KBContext *knowledge_default();
 int knowledge_get(const char *intent, const char *entity, char *response, int n);
+int knowledge_get_ctx(KBContext *ctx, const char *intent, const char *entity, char *response, int n);
+int knowledge_is_question_ctx(KBContext *ctx, const char *intent);
+size_t knowledge_get_many(KBQuery *queries, size_t count);
+size_t knowledge_get_many_ctx(KBContext *ctx, KBQuery *queries, size_t count);
+int knowledge_get_near(const char *intent, const char *entity, char *nearest, char *response, int n);
+int knowledge_get_near_ctx(KBContext *ctx, const char *intent, const char *entity, char *nearest, char *response, int n);
+int knowledge_search(const char *query, KBHit *hits, int k);
+int knowledge_search_ctx(KBContext *ctx, const char *query, KBHit *hits, int k);
 int knowledge_put(const char *intent, const char *entity, const char *response);
+int knowledge_put_ctx(KBContext *ctx, const char *intent, const char *entity, const char *response);
 void knowledge_reset();
+void knowledge_reset_ctx(KBContext *ctx);
+int knowledge_begin();
+int knowledge_begin_ctx(KBContext *ctx);
+void knowledge_end(int publish);
+void knowledge_end_ctx(KBContext *ctx, int publish);
 int knowledge_read(FILE *f);
+int knowledge_read_ctx(KBContext *ctx, FILE *f);
+int knowledge_read_files(char *const filenames[], int nfiles, int nthreads, int *failed);
+int knowledge_read_files_ctx(KBContext *ctx, char *const filenames[], int nfiles, int nthreads, int *failed);
 void knowledge_write(FILE *f);
+void knowledge_write_ctx(KBContext *ctx, FILE *f);
+void knowledge_write_shards(FILE *files[], int nshards);
+void knowledge_write_shards_ctx(KBContext *ctx, FILE *files[], int nshards);
+int knowledge_write_snapshot(FILE *f);
+int knowledge_write_snapshot_ctx(KBContext *ctx, FILE *f);
+void knowledge_stats(size_t *entities, size_t *bytes);
+void knowledge_stats_ctx(KBContext *ctx, size_t *entities, size_t *bytes);
 
-#endif
\ No newline at end of file
+#endif
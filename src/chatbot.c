@@ -3,8 +3,10 @@
  *
  * This file implements the behaviour of the chatbot. The main entry point to
  * this module is the chatbot_main() function, which identifies the intent
- * using the chatbot_is_*() functions then invokes the matching chatbot_do_*()
- * function to carry out the intent.
+ * by looking up the first word in the intent table (see intent.c) then
+ * invokes the matching chatbot_do_*() function to carry out the intent.
+ * The chatbot's own intents are listed in intents[] at the end of this file;
+ * more can be added with intent_register().
  *
  * chatbot_main() and chatbot_do_*() have the same method signature, which
  * works as described here.
@@ -21,8 +23,9 @@
  *
  * If the second word may be a part of speech that makes sense for the intent.
  *    - for WHAT, WHERE and WHO, it may be "is" or "are".
- *    - for SAVE, it may be "as" or "to".
- *    - for LOAD, it may be "from".
+ *    - for SAVE and BGSAVE, it may be "as" or "to".
+ *    - for LOAD and RELOAD, it may be "from".
+ *    - for SEARCH, it may be "for".
  * The word is otherwise ignored and may be omitted.
  *
  * The remainder of the input (including the second word, if it is not one of the
@@ -40,12 +43,46 @@
  * returned by these functions at the start of each line.
  */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "chat1002.h"
 
+// the number of entities SEARCH lists
+#define SEARCH_RESULTS 5
+
+// when 0, the chatbot never prompts the user (see chatbot_set_interactive())
+static int interactive = 1;
+static const char *default_answer = "I don't know.";
+
+// the number of threads that load or save several files at once, or 0 for
+// one per CPU (see chatbot_set_workers())
+static int workers;
+
+// the conversation being answered on this thread, if any (see chatbot_session())
+static _Thread_local ChatSession *session;
+
+// the knowledge base being answered from on this thread, if not the
+// chatbot's own (see chatbot_main_ctx())
+static _Thread_local KBContext *context;
+
+static void chatbot_learn(const char *intent, const char *entity, const char *answer, int suggested, char *response, int n);
+static int chatbot_is_snapshot(const char *filename);
+static KBContext *chatbot_kb();
+
+// the background save started by BGSAVE, if any
+static pthread_mutex_t bgsave_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t bgsave_pid;
+static int bgsave_ok;
+static char bgsave_name[MAX_INPUT];
+
 
 /*
  * Get the name of the chatbot.
@@ -67,6 +104,144 @@ const char *chatbot_username() {
 }
 
 
+/*
+ * Prompt the user.
+ *
+ * Input:
+ *   buf    - a buffer into which to store the answer
+ *   n      - the maximum number of characters to write to the buffer
+ *   format - format string, as printf
+ *   ...    - as printf
+ */
+void prompt_user(char *buf, int n, const char *format, ...) {
+
+    /* print the prompt */
+    va_list args;
+    va_start(args, format);
+    if (transcript_recording()) {
+        char prompt[MAX_RESPONSE];
+        va_list copy;
+        va_copy(copy, args);
+        vsnprintf(prompt, sizeof prompt, format, copy);
+        va_end(copy);
+        transcript_record(0, '<', prompt);
+    }
+    printf("%s: ", chatbot_botname());
+    vprintf(format, args);
+    printf(" ");
+    va_end(args);
+    printf("\n%s: ", chatbot_username());
+
+    /* get the response from the user */
+    if (fgets(buf, n, stdin) == NULL) {
+        buf[0] = '\0';
+    }
+    transcript_record(0, '+', buf);
+    char *nl = strchr(buf, '\n');
+    if (nl != NULL){
+        *nl = '\0';
+        return;
+    }
+    // flush stdin to prevent input from overflowing
+    int ch;
+    while ((ch = getchar()) != EOF && ch != '\n');/* do nothing*/
+}
+
+
+/*
+ * Choose whether the chatbot may prompt the user for more input.
+ *
+ * When not interactive, questions the chatbot cannot answer get the default
+ * answer rather than asking to be taught, and SAVE overwrites existing files
+ * without asking.
+ *
+ * Input:
+ *   on - 1 to allow prompting (the default), 0 not to
+ */
+void chatbot_set_interactive(int on) {
+    interactive = on;
+}
+
+
+/*
+ * Set the answer given to unknown questions when not interactive.
+ *
+ * Input:
+ *   answer - the answer; the string must remain valid
+ */
+void chatbot_set_default_answer(const char *answer) {
+    default_answer = answer;
+}
+
+
+/*
+ * Set the number of threads that LOAD and RELOAD read a directory with, and
+ * the number of files SAVE writes to a directory.
+ *
+ * Input:
+ *   n - the number of threads, or 0 for one per CPU (the default)
+ */
+void chatbot_set_workers(int n) {
+    workers = n;
+}
+
+
+/*
+ * Get the number of threads set by chatbot_set_workers().
+ */
+static int chatbot_workers() {
+    if (workers > 0) {
+        return workers;
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (int) online : 1;
+}
+
+
+/*
+ * Get a response to a line of input from one conversation of many.
+ *
+ * Instead of prompting, a question the chatbot cannot answer is asked back and
+ * the session remembers it; the session's next line is taken as the answer.
+ * This lets a server interleave any number of conversations without blocking
+ * on any of them. Both the line and the response are recorded in the
+ * transcript, if there is one.
+ *
+ * Input:
+ *   s        - the state of the conversation
+ *   line     - the line of input; its contents are modified
+ *   response - a buffer to receive the response
+ *   n        - the size of the response buffer
+ *
+ * Returns:
+ *   0, if the chatbot should continue chatting
+ *   1, if the chatbot should stop (i.e. it detected the EXIT intent)
+ */
+int chatbot_session(ChatSession *s, char *line, char *response, int n) {
+    char *inv[MAX_INPUT];
+    int done = 0;
+
+    if (s->id == 0 && transcript_recording()) {
+        s->id = transcript_session();
+    }
+    transcript_record(s->id, s->teaching ? '+' : '>', line);
+    if (s->teaching) {
+        int suggested = s->teaching == 2;
+        s->teaching = 0;
+        line[strcspn(line, "\r\n")] = '\0';
+        chatbot_learn(s->intent, s->entity, line, suggested, response, n);
+    }
+    else {
+        session = s;
+        int inc = split_words(line, inv, MAX_INPUT);
+        done = chatbot_main(inc, inv, response, n);
+        session = NULL;
+    }
+    transcript_record(s->id, '<', response);
+    return done;
+}
+
+
 /*
  * Get a response to user input.
  *
@@ -80,30 +255,83 @@ const char *chatbot_username() {
 int chatbot_main(int inc, char *inv[], char *response, int n) {
     // force flush response buffer to prevent reset response from popping up
     *response = '\0';
+    // reap a finished background save
+    chatbot_bgsave_poll(0);
     /* check for empty input */
     if (inc < 1) {
         snprintf(response, n, "");
         return 0;
     }
 
-    /* look for an intent and invoke the corresponding do_* function */
-    if (chatbot_is_exit(inv[0]))
-        return chatbot_do_exit(inc, inv, response, n);
-    else if (chatbot_is_smalltalk(inv[0]))
-        return chatbot_do_smalltalk(inc, inv, response, n);
-    else if (chatbot_is_load(inv[0]))
-        return chatbot_do_load(inc, inv, response, n);
-    else if (chatbot_is_question(inv[0]))
-        return chatbot_do_question(inc, inv, response, n);
-    else if (chatbot_is_reset(inv[0]))
-        return chatbot_do_reset(inc, inv, response, n);
-    else if (chatbot_is_save(inv[0]))
-        return chatbot_do_save(inc, inv, response, n);
-    else {
+    /* look up the intent and invoke the corresponding do_* function */
+    uint64_t traced = trace_start();
+    uint64_t start = metrics_now();
+    const Intent *intent = intent_find(inv[0]);
+    trace_span("dispatch", inv[0], traced);
+    if (intent == NULL && knowledge_is_question_ctx(chatbot_kb(), inv[0])) {
+        // a question word of this knowledge base alone, from a section heading
+        int done = chatbot_do_question(inc, inv, response, n);
+        metrics_time(METRIC_OTHER, metrics_now() - start);
+        trace_span("chatbot_main", inv[0], traced);
+        return done;
+    }
+    if (intent == NULL) {
         snprintf(response, n, "I don't understand \"%s\".", inv[0]);
+        metrics_time(METRIC_UNKNOWN, metrics_now() - start);
+        trace_span("chatbot_main", inv[0], traced);
         return 0;
     }
+    int done = intent->handler(inc, inv, response, n);
+    metrics_time(METRIC_INTENT + intent->id, metrics_now() - start);
+    trace_span("chatbot_main", intent->word, traced);
+    return done;
+
+}
+
+
+/*
+ * Get a response to user input as chatbot_main(), answering from and
+ * teaching a knowledge base other than the chatbot's own. LOAD, SAVE and the
+ * rest work on that knowledge base too, though only the chatbot's own is
+ * journaled. Different threads may use different knowledge bases at once.
+ *
+ * Input:
+ *   ctx                   - the knowledge base, from knowledge_create()
+ *   inc, inv, response, n - as chatbot_main()
+ *
+ * Returns: as chatbot_main()
+ */
+int chatbot_main_ctx(KBContext *ctx, int inc, char *inv[], char *response, int n) {
+    KBContext *outer = context;
+    context = ctx;
+    int done = chatbot_main(inc, inv, response, n);
+    context = outer;
+    return done;
+}
 
+
+/*
+ * Get the knowledge base the intents being carried out on this thread use.
+ */
+static KBContext *chatbot_kb() {
+    return context != NULL ? context : knowledge_default();
+}
+
+
+/*
+ * Determine whether an intent is carried out by a handler.
+ *
+ * Input:
+ *  intent  - the intent
+ *  handler - the handler
+ *
+ * Returns:
+ *  1, if the intent is registered to the handler
+ *  0, otherwise
+ */
+static int chatbot_is(const char *intent, IntentHandler handler) {
+    const Intent *found = intent_find(intent);
+    return found != NULL && found->handler == handler;
 }
 
 
@@ -118,7 +346,7 @@ int chatbot_main(int inc, char *inv[], char *response, int n) {
  *  0, otherwise
  */
 int chatbot_is_exit(const char *intent) {
-    return compare_token(intent, "exit") == 0 || compare_token(intent, "quit") == 0;
+    return chatbot_is(intent, chatbot_do_exit);
 }
 
 
@@ -148,20 +376,80 @@ int chatbot_do_exit(int inc, char *inv[], char *response, int n) {
  *  0, otherwise
  */
 int chatbot_is_load(const char *intent) {
-    return compare_token(intent, "LOAD") == 0;
+    return chatbot_is(intent, chatbot_do_load);
+}
+
+
+/*
+ * Compare two file names for qsort(), byte by byte so the order is the same
+ * in every locale.
+ */
+static int chatbot_compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
 }
 
 
 /*
- * Load a chatbot's knowledge base from a file.
+ * Find the files named by LOAD or RELOAD when it names more than one: the
+ * INI files (*.ini) and snapshots (*.kb) in a directory, or the files
+ * matching a pattern such as the INI files under faq/. The names are sorted, so the files
+ * are always merged in the same order and a later file's answers win.
  *
- * See the comment at the top of the file for a description of how this
- * function is used.
+ * Input:
+ *  filename  - the name given to LOAD
+ *  directory - 1 if the name is a directory
+ *  found     - receives the file names, first, to be freed with globfree()
  *
  * Returns:
- *   0 (the chatbot always continues chatting after loading knowledge)
+ *  the number of files, if the name is a directory or a pattern
+ *  0, if the name is neither, and so is a single file
+ *  -1, if there are no files
  */
-int chatbot_do_load(int inc, char *inv[], char *response, int n) {
+static int chatbot_expand(const char *filename, int directory, glob_t *found) {
+    if (!directory && strpbrk(filename, "*?[") == NULL) {
+        return 0;
+    }
+    char pattern[MAX_INPUT + 2];
+    snprintf(pattern, sizeof pattern, directory ? "%s/*" : "%s", filename);
+    if (glob(pattern, GLOB_NOSORT, NULL, found) != 0) {
+        globfree(found);
+        // the name of a file that only looks like a pattern
+        return directory ? -1 : 0;
+    }
+    qsort(found->gl_pathv, found->gl_pathc, sizeof(char *), chatbot_compare_names);
+    // move the files to keep to the front, in order; globfree() still frees the rest
+    size_t kept = 0;
+    for (size_t i = 0; i < found->gl_pathc; i++) {
+        char *name = found->gl_pathv[i];
+        size_t len = strlen(name);
+        struct stat st;
+        if (stat(name, &st) != 0 || !S_ISREG(st.st_mode)
+                || (directory && !chatbot_is_snapshot(name)
+                    && !(len > 4 && token_equal(name + len - 4, 4, ".ini", 4)))) {
+            continue;
+        }
+        found->gl_pathv[i] = found->gl_pathv[kept];
+        found->gl_pathv[kept++] = name;
+    }
+    if (kept == 0) {
+        globfree(found);
+        return -1;
+    }
+    return (int) kept;
+}
+
+
+/*
+ * Load a file into the knowledge base, for LOAD and RELOAD.
+ *
+ * Input:
+ *   inc, inv, response, n - as chatbot_do_load()
+ *   replace - 1 to replace the knowledge base with the file, 0 to merge the
+ *             file into it
+ *
+ * Returns: 0
+ */
+static int chatbot_load(int inc, char *inv[], char *response, int n, int replace) {
     int start = 1;
     // if input is intent only
     if (inc == 1) {
@@ -179,48 +467,225 @@ int chatbot_do_load(int inc, char *inv[], char *response, int n) {
         start = 2;
     }
     // build filename
-    char *filename = strcpy(filename, inv[start]);
-    for (int i = start + 1; i < inc; i++) {
-        strcat(filename, " ");
-        strcat(filename, inv[i]);
+    char filename[MAX_INPUT];
+    int len = snprintf(filename, sizeof filename, "%s", inv[start]);
+    for (int i = start + 1; i < inc && len < (int) sizeof filename; i++) {
+        len += snprintf(filename + len, sizeof filename - len, " %s", inv[i]);
     }
 
-    FILE *f;
-    f = fopen(filename, "r");
+    // a directory or a pattern names several files, which are read at once
+    struct stat st;
+    int directory = stat(filename, &st) == 0 && S_ISDIR(st.st_mode);
+    glob_t found;
+    int nfiles = chatbot_expand(filename, directory, &found);
+    FILE *f = NULL;
+    if (nfiles == 0) {
+        f = fopen(filename, "r");
+    }
     // if unavailable to open file
-    if (f == NULL) {
+    if (nfiles < 0 || (nfiles == 0 && f == NULL)) {
         snprintf(response, n, "File Not Found!");
         return 0;
     }
-    int nresponses = knowledge_read(f);
-    if (nresponses == F_INVALID){
-        snprintf(response,n,"Invalid file supplied. Please check again.");
+    // when replacing, build the new knowledge base off to the side so
+    // questions are answered from the old one until it is complete
+    KBContext *kb = chatbot_kb();
+    int nresponses = replace ? knowledge_begin_ctx(kb) : KB_OK;
+    int staged = replace && nresponses == KB_OK;
+    int failed = -1;
+    if (nresponses == KB_OK && f != NULL) {
+        nresponses = knowledge_read_ctx(kb, f);
+    }
+    else if (nresponses == KB_OK) {
+        nresponses = knowledge_read_files_ctx(kb, found.gl_pathv, nfiles, chatbot_workers(), &failed);
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    if (nresponses < 0){
+        if (staged) {
+            knowledge_end_ctx(kb, 0);
+        }
+        if (nresponses == KB_NOMEM) {
+            snprintf(response, n, "Not enough memory to load %s.", filename);
+        }
+        else if (failed >= 0) {
+            snprintf(response, n, "Invalid file %s supplied. Please check again.", found.gl_pathv[failed]);
+        }
+        else {
+            snprintf(response,n,"Invalid file supplied. Please check again.");
+        }
+        if (nfiles > 0) {
+            globfree(&found);
+        }
+        return 0;
+    }
+    if (nfiles > 0) {
+        globfree(&found);
+    }
+    // replay and attach the file's journal, if journaling is enabled; a
+    // directory has one too, but the files matching a pattern have none,
+    // and only the chatbot's own knowledge base is journaled
+    int njournal = 0;
+    if (kb == knowledge_default() && (nfiles == 0 || directory)) {
+        njournal = journal_attach(filename);
+    }
+    else if (kb == knowledge_default()) {
+        journal_close();
+    }
+    if (staged) {
+        knowledge_end_ctx(kb, 1);
+    }
+    if (njournal < 0) {
+        snprintf(response, n, "Loaded %d responses from file %s, but its journal could not be opened.", nresponses, filename);
+        return 0;
+    }
+    else if (njournal > 0) {
+        snprintf(response, n, "Loaded %d responses from file %s and %d from its journal", nresponses, filename, njournal);
+        return 0;
+    }
+    else if (nfiles > 0) {
+        snprintf(response, n, "Loaded %d responses from %d file%s in %s", nresponses, nfiles,
+                 nfiles == 1 ? "" : "s", filename);
         return 0;
     }
-    fclose(f);
     snprintf(response, n, "Loaded %d responses from file %s", nresponses, filename);
     return 0;
 }
 
 
 /*
- * Determine whether an intent is a question.
+ * Load a chatbot's knowledge base from a file, merging it into what the
+ * chatbot already knows. The file may be a directory or a pattern, to load
+ * several files at once (see chatbot_expand()).
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after loading knowledge)
+ */
+int chatbot_do_load(int inc, char *inv[], char *response, int n) {
+    return chatbot_load(inc, inv, response, n, 0);
+}
+
+
+/*
+ * Determine whether an intent is RELOAD.
  *
  * Input:
  *  intent - the intent
  *
  * Returns:
- *  1, if the intent is "what", "where", or "who"
+ *  1, if the intent is "reload"
  *  0, otherwise
  */
+int chatbot_is_reload(const char *intent) {
+    return chatbot_is(intent, chatbot_do_reload);
+}
+
+
+/*
+ * Replace the chatbot's knowledge base with the contents of a file. Questions
+ * asked meanwhile (e.g. by other clients of a server) are answered from the
+ * old knowledge base until the new one is complete.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after loading knowledge)
+ */
+int chatbot_do_reload(int inc, char *inv[], char *response, int n) {
+    return chatbot_load(inc, inv, response, n, 1);
+}
+
+
+/*
+ * Determine whether an intent is a question.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "what", "where", "who", or another question word
+ *     added by chatbot_add_question()
+ *  0, otherwise (a section heading is a question only in the knowledge base
+ *     it was loaded into, see knowledge_is_question_ctx())
+ */
 int chatbot_is_question(const char *intent) {
-    char keywords[3][6] = {"what", "where", "who"};
-    for (int i = 0; i < 3; i++) {
-        if (compare_token(intent, keywords[i]) == 0) {
-            return 1;
+    const Intent *found = intent_find(intent);
+    return found != NULL && found->kind == INTENT_QUESTION;
+}
+
+
+/*
+ * Make a word a question in every knowledge base, so that it is answered
+ * like "what", "where" and "who". The word stays a question until the
+ * process exits; a section heading needs no such thing, as it is a question
+ * in the knowledge base it was loaded into for as long as it is there.
+ *
+ * Input:
+ *  intent - the question word
+ *
+ * Returns:
+ *  KB_OK, if the word is a question (whether or not it already was)
+ *  KB_INVALID, if the word is empty, too long, not a single word, or already
+ *              selects an intent that is not a question
+ *  KB_NOMEM, if there was a memory allocation failure
+ */
+int chatbot_add_question(const char *intent) {
+    const Intent *found = intent_find(intent);
+    if (found != NULL) {
+        return found->kind == INTENT_QUESTION ? KB_OK : KB_INVALID;
+    }
+    for (const char *c = intent; *c != '\0'; c++) {
+        if (isspace((unsigned char) *c)) {
+            return KB_INVALID;
         }
     }
-    return 0;
+    return intent_register(intent, chatbot_do_question, INTENT_QUESTION);
+}
+
+
+/*
+ * Rebuild a question from its words, to ask it back to the user.
+ *
+ * Input:
+ *   inc - the number of words in the question
+ *   inv - the words
+ *   buf - a buffer to receive the question, with a leading space
+ *   n   - the size of buf
+ */
+static void chatbot_question_text(int inc, char *inv[], char *buf, int n) {
+    int len = 0;
+    *buf = '\0';
+    for (int i = 0; i < inc && len < n; i++) {
+        len += snprintf(buf + len, n - len, " %s", inv[i]);
+    }
+}
+
+
+/*
+ * Store an answer the user has taught the chatbot.
+ *
+ * Input:
+ *   intent    - the question word
+ *   entity    - the entity
+ *   answer    - the answer the user gave
+ *   suggested - 1 if a near entity was suggested with the question, which a
+ *               blank answer accepts; 0 otherwise
+ *   response  - a buffer to receive the response
+ *   n         - the size of the response buffer
+ */
+static void chatbot_learn(const char *intent, const char *entity, const char *answer, int suggested,
+                          char *response, int n) {
+    if (isspace((unsigned char) answer[0]) || strlen(answer) == 0){
+        snprintf(response,n,suggested ? "OK." : ">:(");
+        return;
+    }
+    knowledge_put_ctx(chatbot_kb(),intent,entity,answer);
+    snprintf(response,n,"Thank you.");
 }
 
 
@@ -239,7 +704,7 @@ int chatbot_is_question(const char *intent) {
  */
 int chatbot_do_question(int inc, char *inv[], char *response, int n) {
     char answer[MAX_RESPONSE];
-    char entity[MAX_ENTITY];
+    char entity[MAX_ENTITY] = "";
     int entityStart;
 
     if (inc < 2) {
@@ -253,48 +718,61 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n) {
         entityStart = 1;
     }
 
-    // Building entity
-    for (entityStart; entityStart<inc; entityStart++) {
-        strcat(entity,inv[entityStart]);
-        strcat(entity," ");
+    // Building entity, lines may be of any length so stop at what the
+    // knowledge base would keep
+    int len = 0;
+    for (int i = entityStart; i < inc && len < MAX_ENTITY; i++) {
+        len += snprintf(entity + len, MAX_ENTITY - len, i > entityStart ? " %s" : "%s", inv[i]);
     }
     if (strlen(entity) == 0) {
         snprintf(response,n,"I do not understand your question.");
         return 0;
     }
-    *strrchr(entity, ' ') = '\0';
 
-    int isSuccess = knowledge_get(inv[0], entity, answer, n);
+    int isSuccess = knowledge_get_ctx(chatbot_kb(), inv[0], entity, answer, sizeof answer);
+
+    // a near miss, such as a typo, suggests the entity it most likely meant,
+    // though it may yet be a new one to be taught
+    char nearest[MAX_ENTITY];
+    char unknown[MAX_ENTITY + MAX_RESPONSE + 32] = "I don't know.";
+    int suggested = isSuccess == KB_NOTFOUND
+            && knowledge_get_near_ctx(chatbot_kb(), inv[0], entity, nearest, answer, sizeof answer) == KB_OK;
+    if (suggested) {
+        snprintf(unknown, sizeof unknown, "Did you mean %s? %s If not,", nearest, answer);
+    }
     if (isSuccess == KB_INVALID) {
         //question is not a question inv[0] is not what who where etc
         snprintf(response,n,"I do not understand your question.");
         return 0;
+    } else if (isSuccess == KB_NOTFOUND && session != NULL) {
+        // ask back without waiting, the session's next line is the answer
+        char qn[MAX_INPUT];
+        chatbot_question_text(inc, inv, qn, sizeof qn);
+        snprintf(session->intent, sizeof session->intent, "%s", inv[0]);
+        snprintf(session->entity, sizeof session->entity, "%s", entity);
+        session->teaching = suggested ? 2 : 1;
+        snprintf(response,n,"%s%s?",unknown,qn);
+        return 0;
+    } else if (isSuccess == KB_NOTFOUND && !interactive && suggested) {
+        snprintf(response,n,"Did you mean %s? %s",nearest,answer);
+        return 0;
+    } else if (isSuccess == KB_NOTFOUND && !interactive) {
+        snprintf(response,n,"%s",default_answer);
+        return 0;
     } else if (isSuccess == KB_NOTFOUND) {
         // insert new answer since not found
 
         // rebuild question to re-display
-        char *qn = calloc(1,MAX_INPUT);
-        if (qn == NULL){
-            snprintf(response,n,"failed to allocate memory for question.");
-            return 0;
-        }
-        char *holder = qn;
-        for (int i=0;i<inc;i++){
-            sprintf(holder," %s",inv[i]);
-            holder = holder + strlen(inv[i]) + 1;
-        }
-        prompt_user(answer,n,"I don't know.%s?",qn);
-
-        if (isspace(answer) || strlen(answer) == 0){
-            snprintf(response,n,">:(");
-            return 0;
-        }
-        knowledge_put(inv[0],entity,answer);
-        snprintf(response,n,"Thank you.");
+        char qn[MAX_INPUT];
+        chatbot_question_text(inc, inv, qn, sizeof qn);
+        prompt_user(answer,sizeof answer,"%s%s?",unknown,qn);
+        chatbot_learn(inv[0], entity, answer, suggested, response, n);
         return 0;
     }
     //final output = entity + is/are + response from knowledge_get
-    snprintf(response,n,answer);
+    uint64_t traced = trace_start();
+    snprintf(response,n,"%s",answer);
+    trace_span("format", entity, traced);
     return 0;
 }
 
@@ -310,7 +788,7 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n) {
  *  0, otherwise
  */
 int chatbot_is_reset(const char *intent) {
-    return compare_token(intent, "RESET") == 0;
+    return chatbot_is(intent, chatbot_do_reset);
 }
 
 /*
@@ -323,7 +801,11 @@ int chatbot_is_reset(const char *intent) {
  *   0 (the chatbot always continues chatting after beign reset)
  */
 int chatbot_do_reset(int inc, char *inv[], char *response, int n) {
-    knowledge_reset();
+    // the journal no longer describes what is in memory
+    if (chatbot_kb() == knowledge_default()) {
+        journal_close();
+    }
+    knowledge_reset_ctx(chatbot_kb());
     snprintf(response, n, "Reset Completed Successfully!");
     return 0;
 }
@@ -340,20 +822,153 @@ int chatbot_do_reset(int inc, char *inv[], char *response, int n) {
  *  0, otherwise
  */
 int chatbot_is_save(const char *intent) {
-    return compare_token(intent, "SAVE") == 0;
+    return chatbot_is(intent, chatbot_do_save);
 }
 
 
 /*
- * Save the chatbot's knowledge to a file.
+ * Determine whether a file should be saved as a binary snapshot.
  *
- * See the comment at the top of the file for a description of how this
- * function is used.
+ * Input:
+ *  filename - the name of the file
  *
  * Returns:
- *   0 (the chatbot always continues chatting after saving knowledge)
+ *  1, if the file name ends in ".kb"
+ *  0, otherwise
  */
-int chatbot_do_save(int inc, char *inv[], char *response, int n) {
+static int chatbot_is_snapshot(const char *filename) {
+    size_t len = strlen(filename);
+    return len > 3 && token_equal(filename + len - 3, 3, ".kb", 3);
+}
+
+
+/*
+ * Write the knowledge base to a directory as shards, shard-000.ini,
+ * shard-001.ini and so on, one for each worker (see chatbot_set_workers()),
+ * written at once by knowledge_write_shards(). Loading the directory reads
+ * them back in parallel. Shards left over from an earlier save with more of
+ * them are removed.
+ *
+ * Each shard is written to a temporary file and renamed into place, as in
+ * chatbot_write_file(), but the shards are renamed one at a time, so a
+ * failed save may leave some of them from the save before.
+ *
+ * Input:
+ *  dirname - the name of the directory
+ *
+ * Returns: as chatbot_write_file()
+ */
+static int chatbot_write_shards(const char *dirname) {
+    int nshards = chatbot_workers();
+    FILE **files = calloc(nshards, sizeof(FILE *));
+    if (files == NULL) {
+        return F_INVALID;
+    }
+    char name[MAX_INPUT + 32];
+    char tmpname[sizeof name + 4];
+    int result = KB_OK;
+    for (int i = 0; i < nshards && result == KB_OK; i++) {
+        // a name that does not fit could rename over the wrong file
+        if (snprintf(name, sizeof name, "%s/shard-%03d.ini", dirname, i) >= (int) sizeof name) {
+            result = KB_NOTFOUND;
+            break;
+        }
+        snprintf(tmpname, sizeof tmpname, "%s.tmp", name);
+        files[i] = fopen(tmpname, "w");
+        if (files[i] == NULL) {
+            result = KB_NOTFOUND;
+        }
+        else {
+            setvbuf(files[i], NULL, _IOFBF, 1 << 20);
+        }
+    }
+    if (result == KB_OK) {
+        knowledge_write_shards_ctx(chatbot_kb(), files, nshards);
+    }
+    for (int i = 0; i < nshards; i++) {
+        if (files[i] != NULL && fclose(files[i]) != 0 && result == KB_OK) {
+            result = F_INVALID;
+        }
+    }
+    for (int i = 0; i < nshards && files[i] != NULL; i++) {
+        snprintf(name, sizeof name, "%s/shard-%03d.ini", dirname, i);
+        snprintf(tmpname, sizeof tmpname, "%s.tmp", name);
+        if (result == KB_OK && rename(tmpname, name) != 0) {
+            result = F_INVALID;
+        }
+        if (result != KB_OK) {
+            remove(tmpname);
+        }
+    }
+    for (int i = nshards; result == KB_OK; i++) {
+        snprintf(name, sizeof name, "%s/shard-%03d.ini", dirname, i);
+        if (remove(name) != 0) {
+            break;
+        }
+    }
+    free(files);
+    return result;
+}
+
+
+/*
+ * Write the knowledge base to a file, in the format given by its name, or
+ * to shards in a directory (see chatbot_write_shards()).
+ *
+ * The knowledge base is written to a temporary file that is then renamed into
+ * place, so a failed save never leaves a half-written file and a loaded
+ * snapshot is never truncated while the knowledge base still points into it.
+ *
+ * Input:
+ *  filename - the name of the file
+ *
+ * Returns:
+ *  KB_OK, if the file was written
+ *  KB_NOTFOUND, if the file could not be created
+ *  F_INVALID, if the file could not be written
+ */
+static int chatbot_write_file(const char *filename) {
+    struct stat st;
+    if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+        return chatbot_write_shards(filename);
+    }
+    int snapshot = chatbot_is_snapshot(filename);
+    char tmpname[MAX_INPUT + 4];
+    snprintf(tmpname, sizeof tmpname, "%s.tmp", filename);
+    FILE *f = fopen(tmpname, snapshot ? "wb" : "w");
+    if (f == NULL) {
+        return KB_NOTFOUND;
+    }
+    // write in large blocks
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    int result = KB_OK;
+    if (snapshot) {
+        result = knowledge_write_snapshot_ctx(chatbot_kb(), f);
+    }
+    else {
+        knowledge_write_ctx(chatbot_kb(), f);
+    }
+    if (fclose(f) != 0 || result != KB_OK || rename(tmpname, filename) != 0) {
+        remove(tmpname);
+        return F_INVALID;
+    }
+    return KB_OK;
+}
+
+
+/*
+ * Work out the file named by a SAVE or BGSAVE command, and confirm with the
+ * user before overwriting an existing file.
+ *
+ * Input:
+ *  inc, inv, response, n - as chatbot_do_save()
+ *  filename              - a buffer of MAX_INPUT characters to receive the file name
+ *
+ * Returns:
+ *  1, if the knowledge base should be saved to filename
+ *  0, if not (the reason is in the response buffer)
+ */
+static int chatbot_save_target(int inc, char *inv[], char *response, int n, char *filename) {
     int start = 1;
     // if input is intent only
     if (inc == 1) {
@@ -371,99 +986,420 @@ int chatbot_do_save(int inc, char *inv[], char *response, int n) {
         start = 2;
     }
     // build filename
-    char *filename = strcpy(filename, inv[start]);
-    for (int i = start + 1; i < inc; i++) {
-        strcat(filename, " ");
-        strcat(filename, inv[i]);
+    int len = snprintf(filename, MAX_INPUT, "%s", inv[start]);
+    for (int i = start + 1; i < inc && len < MAX_INPUT; i++) {
+        len += snprintf(filename + len, MAX_INPUT - len, " %s", inv[i]);
     }
 
-    FILE *f;
-    if (fopen(filename, "r")){
-        char consent;
-        prompt_user(&consent,2,"File exists. Overwrite? [y/n]: ");
-        if (tolower(consent) != 'y'){
+    FILE *f = fopen(filename, "r");
+    if (f != NULL && !interactive){
+        fclose(f);
+    }
+    else if (f != NULL){
+        fclose(f);
+        char consent[2];
+        prompt_user(consent,2,"File exists. Overwrite? [y/n]: ");
+        if (tolower(consent[0]) != 'y'){
             snprintf(response,n,"Operation Aborted.");
             return 0;
         }
     }
-    f = fopen(filename, "w");
-    if (f == NULL) {
+    return 1;
+}
+
+
+/*
+ * Save the chatbot's knowledge to a file.
+ *
+ * Files named *.kb are written as binary snapshots, which load without any
+ * parsing; anything else is written in INI format. LOAD recognises either.
+ * An existing directory is written as INI shards instead (see
+ * chatbot_write_shards()).
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after saving knowledge)
+ */
+int chatbot_do_save(int inc, char *inv[], char *response, int n) {
+    char filename[MAX_INPUT];
+    if (!chatbot_save_target(inc, inv, response, n, filename)) {
+        return 0;
+    }
+    int result = chatbot_write_file(filename);
+    if (result == KB_NOTFOUND) {
         snprintf(response, n, "Error! Unable to get handle to file.");
         return 0;
     }
-    knowledge_write(f);
-    fclose(f);
+    else if (result != KB_OK) {
+        snprintf(response, n, "Error! Unable to write to file.");
+        return 0;
+    }
     snprintf(response, n, "Entries has been successfully saved to %s", filename);
     return 0;
 }
 
 
 /*
- * Determine which an intent is smalltalk.
+ * Check on the background save, as chatbot_bgsave_poll(), with bgsave_lock
+ * already held.
+ */
+static int chatbot_bgsave_reap(int wait) {
+    if (bgsave_pid <= 0) {
+        return 0;
+    }
+    int status;
+    pid_t pid = waitpid(bgsave_pid, &status, wait ? 0 : WNOHANG);
+    if (pid == 0) {
+        return 1;
+    }
+    bgsave_ok = pid == bgsave_pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    bgsave_pid = 0;
+    return 0;
+}
+
+
+/*
+ * Check on the background save, if there is one.
  *
+ * Input:
+ *  wait - 1 to wait for the save to finish, 0 to return immediately
+ *
+ * Returns:
+ *  1, if a background save is still running
+ *  0, otherwise
+ */
+int chatbot_bgsave_poll(int wait) {
+    pthread_mutex_lock(&bgsave_lock);
+    int running = chatbot_bgsave_reap(wait);
+    pthread_mutex_unlock(&bgsave_lock);
+    return running;
+}
+
+
+/*
+ * Determine whether an intent is BGSAVE.
  *
  * Input:
  *  intent - the intent
  *
  * Returns:
- *  1, if the intent is the first word of one of the smalltalk phrases
+ *  1, if the intent is "bgsave"
  *  0, otherwise
  */
-int chatbot_is_smalltalk(const char *intent) {
-    char keywords[7][10] = {"hello","hi","bye","goodbye","target","how","it's"};
-    for (int i=0; i<7; i++){
-        if (compare_token(intent, keywords[i]) == 0) {
-            return 1;
+int chatbot_is_bgsave(const char *intent) {
+    return chatbot_is(intent, chatbot_do_bgsave);
+}
+
+
+/*
+ * Save the chatbot's knowledge to a file in the background, or report on the
+ * last background save if no file is given.
+ *
+ * The save runs in a forked child, which works on a copy-on-write snapshot of
+ * the knowledge base, so the chatbot carries on answering while it writes.
+ * The file is renamed into place when complete, as for SAVE.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after saving knowledge)
+ */
+int chatbot_do_bgsave(int inc, char *inv[], char *response, int n) {
+    char filename[MAX_INPUT];
+    pthread_mutex_lock(&bgsave_lock);
+    if (chatbot_bgsave_reap(0)) {
+        snprintf(response, n, "A background save to %s is in progress.", bgsave_name);
+    }
+    else if (inc == 1) {
+        if (bgsave_name[0] == '\0') {
+            snprintf(response, n, "Filename cannot be empty!");
+        }
+        else {
+            snprintf(response, n, "The last background save to %s %s.", bgsave_name,
+                     bgsave_ok ? "succeeded" : "failed");
+        }
+    }
+    else if (chatbot_save_target(inc, inv, response, n, filename)) {
+        // flush so the child does not write out our buffered output again
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(chatbot_write_file(filename) == KB_OK ? 0 : 1);
+        }
+        else if (pid < 0) {
+            snprintf(response, n, "Error! Unable to start a background save.");
+        }
+        else {
+            bgsave_pid = pid;
+            snprintf(bgsave_name, sizeof bgsave_name, "%s", filename);
+            snprintf(response, n, "Saving entries to %s in the background.", filename);
         }
     }
+    pthread_mutex_unlock(&bgsave_lock);
     return 0;
 }
 
 
 /*
- * Respond to smalltalk.
+ * Determine whether an intent is COMPACT.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "compact"
+ *  0, otherwise
+ */
+int chatbot_is_compact(const char *intent) {
+    return chatbot_is(intent, chatbot_do_compact);
+}
+
+
+/*
+ * Fold the journal back into the file it belongs to, by rewriting the file
+ * from memory and emptying the journal.
  *
  * See the comment at the top of the file for a description of how this
  * function is used.
  *
  * Returns:
- *   0, if the chatbot should continue chatting
- *   1, if the chatbot should stop chatting (e.g. the smalltalk was "goodbye" etc.)
+ *   0 (the chatbot always continues chatting after compacting)
  */
-int chatbot_do_smalltalk(int inc, char *inv[], char *response, int n) {
-    if(compare_token(inv[0],"how") == 0){
-        if (compare_token(inv[inc-1],"you") == 0){
-            snprintf(response, n, "Not too bad, can't complain.");
-            return 0;
-        }
-        snprintf(response, n, "How what now?");
+int chatbot_do_compact(int inc, char *inv[], char *response, int n) {
+    char filename[MAX_INPUT];
+    if (chatbot_kb() != knowledge_default() || !journal_base(filename, sizeof filename)) {
+        snprintf(response, n, "There is no journal to compact.");
         return 0;
     }
-    else if (compare_token(inv[0],"it's") == 0){
-        char *output = calloc(1,MAX_RESPONSE);
-        if (output == NULL){
-            snprintf(response,n,"Failed to allocate memory for response!");
-            return 0;
-        }
-        char *holder = output;
-        for (int i=1;i<inc;i++){
-            sprintf(holder," %s",inv[i]);
-            holder = holder + strlen(inv[i]) + 1;
-        }
-        snprintf(response,n,"Indeed it's%s.",output);
+    // everything journaled before the mark is in memory, so will be in the
+    // file; a crash between these two steps only replays facts the file
+    // already has
+    long mark = journal_mark();
+    if (chatbot_write_file(filename) != KB_OK || journal_truncate(mark) != KB_OK) {
+        snprintf(response, n, "Error! Unable to compact the journal into %s", filename);
+        return 0;
+    }
+    snprintf(response, n, "Journal has been compacted into %s", filename);
+    return 0;
+}
+
+
+/*
+ * Determine whether an intent is STATS.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "stats"
+ *  0, otherwise
+ */
+int chatbot_is_stats(const char *intent) {
+    return chatbot_is(intent, chatbot_do_stats);
+}
+
+
+/*
+ * Report the chatbot's metrics (see metrics.c): an overview, or the times
+ * taken by one intent if the second word names one.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after reporting)
+ */
+int chatbot_do_stats(int inc, char *inv[], char *response, int n) {
+    const char *name = inc > 1 ? inv[1] : NULL;
+    int result = metrics_format(name, response, n);
+    if (result == KB_NOTFOUND) {
+        snprintf(response, n, "There are no statistics for \"%s\".", name);
+    }
+    else if (result != KB_OK) {
+        snprintf(response, n, "Unable to collect the statistics.");
+    }
+    return 0;
+}
+
+
+/*
+ * Determine whether an intent is SEARCH.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "search"
+ *  0, otherwise
+ */
+int chatbot_is_search(const char *intent) {
+    return chatbot_is(intent, chatbot_do_search);
+}
+
+
+/*
+ * Find the entities whose responses best match the rest of the input (see
+ * knowledge_search()), and list the best few.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after searching)
+ */
+int chatbot_do_search(int inc, char *inv[], char *response, int n) {
+    int first = inc > 2 && compare_token(inv[1], "for") == 0 ? 2 : 1;
+    if (inc <= first) {
+        snprintf(response, n, "What should I search for?");
         return 0;
     }
-    else if(compare_token(inv[0], "hello") == 0 || compare_token(inv[0], "hi") == 0) {
-        snprintf(response, n, "Hello!");
+    char query[MAX_INPUT];
+    chatbot_question_text(inc - first, inv + first, query, sizeof query);
+    KBHit hits[SEARCH_RESULTS];
+    int found = knowledge_search_ctx(chatbot_kb(), query, hits, SEARCH_RESULTS);
+    if (found < 0) {
+        snprintf(response, n, "Unable to search the knowledge base.");
         return 0;
     }
-    else if(compare_token(inv[0], "goodbye") == 0 || compare_token(inv[0],"bye") == 0) {
-        snprintf(response, n, "Goodbye");
-        return 1;
+    if (found == 0) {
+        snprintf(response, n, "Nothing mentions%s.", query);
+        return 0;
+    }
+    int len = snprintf(response, n, "Best matches for%s:", query);
+    for (int i = 0; i < found && len < n; i++) {
+        len += snprintf(response + len, n - len, "%s %s", i == 0 ? "" : ",", hits[i].entity);
     }
-    else if(compare_token(inv[0], "target") == 0){
-        snprintf(response, n, "Eliminated");
+    if (len < n) {
+        snprintf(response + len, n - len, ".");
+    }
+    return 0;
+}
+
+
+/*
+ * Determine which an intent is smalltalk.
+ *
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is the first word of one of the smalltalk phrases
+ *  0, otherwise
+ */
+int chatbot_is_smalltalk(const char *intent) {
+    const Intent *found = intent_find(intent);
+    return found != NULL && found->kind == INTENT_SMALLTALK;
+}
+
+
+/*
+ * Respond to smalltalk.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0, if the chatbot should continue chatting
+ *   1, if the chatbot should stop chatting (e.g. the smalltalk was "goodbye" etc.)
+ */
+int chatbot_do_smalltalk(int inc, char *inv[], char *response, int n) {
+    const Intent *found = intent_find(inv[0]);
+    if (found == NULL || found->kind != INTENT_SMALLTALK) {
+        return 0;
+    }
+    return found->handler(inc, inv, response, n);
+}
+
+
+/*
+ * Respond to "how ...".
+ */
+static int chatbot_smalltalk_how(int inc, char *inv[], char *response, int n) {
+    if (compare_token(inv[inc-1],"you") == 0){
+        snprintf(response, n, "Not too bad, can't complain.");
         return 0;
     }
+    snprintf(response, n, "How what now?");
+    return 0;
+}
+
+
+/*
+ * Respond to "it's ...".
+ */
+static int chatbot_smalltalk_its(int inc, char *inv[], char *response, int n) {
+    char output[MAX_INPUT];
+    chatbot_question_text(inc - 1, inv + 1, output, sizeof output);
+    snprintf(response,n,"Indeed it's%s.",output);
+    return 0;
+}
+
+
+/*
+ * Respond to "hello" and "hi".
+ */
+static int chatbot_smalltalk_hello(int inc, char *inv[], char *response, int n) {
+    snprintf(response, n, "Hello!");
     return 0;
 }
+
+
+/*
+ * Respond to "goodbye" and "bye".
+ */
+static int chatbot_smalltalk_goodbye(int inc, char *inv[], char *response, int n) {
+    snprintf(response, n, "Goodbye");
+    return 1;
+}
+
+
+/*
+ * Respond to "target".
+ */
+static int chatbot_smalltalk_target(int inc, char *inv[], char *response, int n) {
+    snprintf(response, n, "Eliminated");
+    return 0;
+}
+
+
+// the chatbot's own intents, registered when the intent table is first used
+static const Intent intents[] = {
+    {"exit", chatbot_do_exit, INTENT_COMMAND},
+    {"quit", chatbot_do_exit, INTENT_COMMAND},
+    {"load", chatbot_do_load, INTENT_COMMAND},
+    {"reload", chatbot_do_reload, INTENT_COMMAND},
+    {"reset", chatbot_do_reset, INTENT_COMMAND},
+    {"save", chatbot_do_save, INTENT_COMMAND},
+    {"bgsave", chatbot_do_bgsave, INTENT_COMMAND},
+    {"compact", chatbot_do_compact, INTENT_COMMAND},
+    {"stats", chatbot_do_stats, INTENT_COMMAND},
+    {"search", chatbot_do_search, INTENT_COMMAND},
+    {"what", chatbot_do_question, INTENT_QUESTION},
+    {"where", chatbot_do_question, INTENT_QUESTION},
+    {"who", chatbot_do_question, INTENT_QUESTION},
+    {"hello", chatbot_smalltalk_hello, INTENT_SMALLTALK},
+    {"hi", chatbot_smalltalk_hello, INTENT_SMALLTALK},
+    {"bye", chatbot_smalltalk_goodbye, INTENT_SMALLTALK},
+    {"goodbye", chatbot_smalltalk_goodbye, INTENT_SMALLTALK},
+    {"target", chatbot_smalltalk_target, INTENT_SMALLTALK},
+    {"how", chatbot_smalltalk_how, INTENT_SMALLTALK},
+    {"it's", chatbot_smalltalk_its, INTENT_SMALLTALK},
+};
+
+
+/*
+ * Get the chatbot's own intents.
+ *
+ * Input:
+ *   count - receives the number of intents
+ *
+ * Returns: the intents
+ */
+const Intent *chatbot_intents(size_t *count) {
+    *count = sizeof intents / sizeof intents[0];
+    return intents;
+}
@@ -0,0 +1,153 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements epoch-based reclamation of shared data.
+ *
+ * Readers bracket their use of shared data with epoch_enter() and
+ * epoch_exit(). A writer that unpublishes something (e.g. swaps in a new
+ * knowledge base) calls epoch_advance() and keeps the old data until
+ * epoch_safe() says that every reader who might still see it has finished.
+ * Readers never wait and never write to memory shared with other readers:
+ * each thread announces its epoch in a slot of its own.
+ *
+ * Slots are kept on a list for the life of the process and are reused once
+ * the thread that owned them exits, so the list only grows to the largest
+ * number of threads that have read at the same time.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "chat1002.h"
+
+/* a thread's announcement of the epoch it is reading in */
+typedef struct epoch_slot {
+    atomic_ulong epoch;         /* the epoch, or 0 when not reading */
+    atomic_int used;            /* 1 while owned by a thread */
+    struct epoch_slot *next;
+} EpochSlot;
+
+// the current epoch, starting at 1 since 0 means "not reading"
+static atomic_ulong global_epoch = 1;
+
+// every slot ever created
+static _Atomic(EpochSlot *) slots;
+
+// this thread's slot, released when the thread exits
+static _Thread_local EpochSlot *mine;
+
+// the number of epoch_enter() calls on this thread not yet matched by epoch_exit()
+static _Thread_local int nesting;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Release a thread's slot for reuse when the thread exits.
+ */
+static void epoch_release(void *arg) {
+    EpochSlot *slot = arg;
+    atomic_store(&slot->epoch, 0);
+    atomic_store(&slot->used, 0);
+}
+
+static void epoch_init() {
+    pthread_key_create(&slot_key, epoch_release);
+}
+
+
+/*
+ * Get this thread's slot, claiming a free one or creating one on first use.
+ *
+ * Returns: the slot, or NULL if there was a memory allocation failure
+ */
+static EpochSlot *epoch_slot() {
+    if (mine != NULL) {
+        return mine;
+    }
+    pthread_once(&slot_once, epoch_init);
+    EpochSlot *slot;
+    for (slot = atomic_load(&slots); slot != NULL; slot = slot->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&slot->used, &unused, 1)) {
+            break;
+        }
+    }
+    if (slot == NULL) {
+        slot = malloc(sizeof(EpochSlot));
+        if (slot == NULL) {
+            return NULL;
+        }
+        atomic_init(&slot->epoch, 0);
+        atomic_init(&slot->used, 1);
+        slot->next = atomic_load(&slots);
+        while (!atomic_compare_exchange_weak(&slots, &slot->next, slot));
+    }
+    pthread_setspecific(slot_key, slot);
+    mine = slot;
+    return slot;
+}
+
+
+/*
+ * Start reading shared data. Anything read after this call stays valid until
+ * epoch_exit(). Calls may be nested, e.g. an intent looked up while reading
+ * the knowledge base; only the outermost pair announces an epoch.
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+int epoch_enter() {
+    if (nesting > 0) {
+        nesting++;
+        return KB_OK;
+    }
+    EpochSlot *slot = epoch_slot();
+    if (slot == NULL) {
+        return KB_NOMEM;
+    }
+    // sequentially consistent, so the announcement is visible to writers
+    // before any shared pointer is loaded
+    atomic_store(&slot->epoch, atomic_load(&global_epoch));
+    nesting = 1;
+    return KB_OK;
+}
+
+
+/*
+ * Stop reading shared data.
+ */
+void epoch_exit() {
+    if (--nesting == 0) {
+        atomic_store_explicit(&mine->epoch, 0, memory_order_release);
+    }
+}
+
+
+/*
+ * Start a new epoch, after a writer has unpublished some data. Readers that
+ * entered before this call may still be using the data.
+ *
+ * Returns: the epoch to pass to epoch_safe() for that data
+ */
+unsigned long epoch_advance() {
+    return atomic_fetch_add(&global_epoch, 1);
+}
+
+
+/*
+ * Determine whether data unpublished in an epoch can be freed.
+ *
+ * Input:
+ *   epoch - a value returned by epoch_advance()
+ *
+ * Returns: 1 if no reader from that epoch or earlier is still reading, 0 otherwise
+ */
+int epoch_safe(unsigned long epoch) {
+    for (EpochSlot *slot = atomic_load(&slots); slot != NULL; slot = slot->next) {
+        unsigned long e = atomic_load(&slot->epoch);
+        if (e != 0 && e <= epoch) {
+            return 0;
+        }
+    }
+    return 1;
+}
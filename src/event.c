@@ -0,0 +1,487 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the event-driven query server.
+ *
+ * event_run() serves the same protocol as server_run(), but drives every
+ * client from one thread with epoll instead of giving each a thread of its
+ * own, so thousands of mostly idle clients cost little more than their
+ * sockets. Sockets are non-blocking and a client never holds up the others:
+ * teaching is a state machine kept in the client's ChatSession, so a
+ * question the chatbot cannot answer is asked back and the answer is simply
+ * the next line that client sends.
+ *
+ * An idle client holds no buffers. Input is read into one shared buffer and
+ * answered in place; only an unfinished line is copied into the client's own
+ * buffer. Answers are written straight to the socket, and only what the
+ * socket will not take yet is kept. While EVENT_MAX_OUTPUT bytes are waiting
+ * to be sent, the client's input is not read, so a client that does not read
+ * its answers cannot make the server buffer without limit.
+ *
+ * All clients share the knowledge base. The server runs until it receives
+ * SIGINT or SIGTERM.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+/* the number of events handled per epoll_wait() */
+#define EVENT_BATCH      256
+
+/* the size of the shared read buffer */
+#define EVENT_READ_SIZE  (64 * 1024)
+
+/* a client sending a longer line is disconnected */
+#define EVENT_MAX_LINE   (64 * 1024)
+
+/* input is not read while this many bytes of output are waiting */
+#define EVENT_MAX_OUTPUT (64 * 1024)
+
+/* a connected client */
+typedef struct client {
+    int fd;                     /* the client's socket */
+    ChatSession chat;           /* the state of the conversation */
+    char *in;                   /* input not yet answered, or NULL */
+    size_t inlen;               /* the number of bytes in in */
+    size_t incap;               /* the size of in */
+    char *out;                  /* output not yet sent, or NULL */
+    size_t outlen;              /* the number of bytes in out */
+    size_t outcap;              /* the size of out */
+    size_t outsent;             /* the number of bytes of out already sent */
+    uint32_t events;            /* the events the client is registered for */
+    int eof;                    /* 1 once the client has stopped sending */
+    int done;                   /* 1 once the session has ended */
+    int dead;                   /* 1 if the socket has failed */
+    struct client *prev;
+    struct client *next;
+} Client;
+
+// set by the signal handler to stop the loop
+static volatile sig_atomic_t stopping;
+
+// the epoll instance and the connected clients
+static int epfd = -1;
+static Client *clients;
+
+// input is read here and answered in place wherever possible
+static char readbuf[EVENT_READ_SIZE + 1];
+
+
+/*
+ * Signal handler for SIGINT and SIGTERM.
+ */
+static void event_stop(int sig) {
+    stopping = 1;
+}
+
+
+/*
+ * Make sure a buffer can hold a number of bytes.
+ *
+ * Input:
+ *   buf  - the buffer, which may be NULL
+ *   cap  - the size of the buffer
+ *   need - the number of bytes needed
+ *
+ * Returns: 0 on success, -1 if there was a memory allocation failure
+ */
+static int event_reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t size = *cap == 0 ? 256 : *cap;
+    while (size < need) {
+        size *= 2;
+    }
+    char *grown = realloc(*buf, size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buf = grown;
+    *cap = size;
+    return 0;
+}
+
+
+/*
+ * Send output to a client, keeping whatever the socket will not take yet.
+ *
+ * Input:
+ *   c   - the client
+ *   buf - the output
+ *   len - the number of bytes in buf
+ */
+static void event_send(Client *c, const char *buf, size_t len) {
+    if (c->outlen == c->outsent) {
+        // nothing is queued, so try the socket first
+        while (len > 0) {
+            ssize_t sent = write(c->fd, buf, len);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (sent <= 0) {
+                c->dead = 1;
+                return;
+            }
+            buf += sent;
+            len -= sent;
+        }
+        if (len == 0) {
+            return;
+        }
+        c->outlen = c->outsent = 0;
+    }
+    if (event_reserve(&c->out, &c->outcap, c->outlen + len) != 0) {
+        c->dead = 1;
+        return;
+    }
+    memcpy(c->out + c->outlen, buf, len);
+    c->outlen += len;
+}
+
+
+/*
+ * Send as much queued output as the socket will take. The output buffer is
+ * released once it is empty.
+ *
+ * Input:
+ *   c - the client
+ */
+static void event_flush(Client *c) {
+    while (c->outsent < c->outlen) {
+        ssize_t sent = write(c->fd, c->out + c->outsent, c->outlen - c->outsent);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (sent <= 0) {
+            c->dead = 1;
+            return;
+        }
+        c->outsent += sent;
+    }
+    free(c->out);
+    c->out = NULL;
+    c->outlen = c->outcap = c->outsent = 0;
+}
+
+
+/*
+ * Determine whether a client has too much output waiting to read more input.
+ */
+static int event_stalled(const Client *c) {
+    return c->outlen - c->outsent >= EVENT_MAX_OUTPUT;
+}
+
+
+/*
+ * Answer one line from a client.
+ *
+ * Input:
+ *   c    - the client
+ *   line - the line, null-terminated and without its newline
+ */
+static void event_answer(Client *c, char *line) {
+    char output[MAX_RESPONSE];  /* the chatbot's output, plus a newline */
+
+    c->done = chatbot_session(&c->chat, line, output, MAX_RESPONSE - 1);
+    size_t len = strlen(output);
+    output[len++] = '\n';
+    event_send(c, output, len);
+}
+
+
+/*
+ * Answer the complete lines at the start of a buffer, stopping early if the
+ * session ends or the client's output backs up.
+ *
+ * Input:
+ *   c   - the client
+ *   buf - the input
+ *   len - the number of bytes in buf
+ *
+ * Returns: the number of bytes answered
+ */
+static size_t event_serve(Client *c, char *buf, size_t len) {
+    size_t used = 0;
+    while (!c->done && !c->dead && !event_stalled(c)) {
+        char *nl = memchr(buf + used, '\n', len - used);
+        if (nl == NULL) {
+            break;
+        }
+        *nl = '\0';
+        event_answer(c, buf + used);
+        used = nl - buf + 1;
+    }
+    return used;
+}
+
+
+/*
+ * Keep input that has not been answered yet in the client's own buffer.
+ *
+ * Input:
+ *   c   - the client
+ *   buf - the input
+ *   len - the number of bytes in buf
+ */
+static void event_keep(Client *c, const char *buf, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    // one extra byte, so a last line without a newline can be terminated
+    if (event_reserve(&c->in, &c->incap, c->inlen + len + 1) != 0) {
+        c->dead = 1;
+        return;
+    }
+    memcpy(c->in + c->inlen, buf, len);
+    c->inlen += len;
+}
+
+
+/*
+ * Answer the lines waiting in the client's own buffer. At the end of the
+ * input, a last line without a newline is answered too and the session ends.
+ *
+ * Input:
+ *   c - the client
+ */
+static void event_process(Client *c) {
+    if (c->inlen > 0) {
+        size_t used = event_serve(c, c->in, c->inlen);
+        c->inlen -= used;
+        memmove(c->in, c->in + used, c->inlen);
+    }
+    if (c->eof && !c->done && !c->dead && !event_stalled(c)) {
+        if (c->inlen > 0) {
+            c->in[c->inlen] = '\0';
+            c->inlen = 0;
+            event_answer(c, c->in);
+        }
+        c->done = 1;
+    }
+    if (c->inlen == 0 && c->in != NULL) {
+        free(c->in);
+        c->in = NULL;
+        c->incap = 0;
+    }
+}
+
+
+/*
+ * Read and answer input from a client until the socket is drained, the
+ * session ends or the client's output backs up.
+ *
+ * Input:
+ *   c - the client
+ */
+static void event_read(Client *c) {
+    while (!c->eof && !c->done && !c->dead && !event_stalled(c)) {
+        ssize_t got = read(c->fd, readbuf, EVENT_READ_SIZE);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (got <= 0) {
+            c->eof = 1;
+            break;
+        }
+        if (c->inlen > 0) {
+            // finish the line started by an earlier read
+            event_keep(c, readbuf, got);
+        }
+        else {
+            // answer straight from the shared buffer, keeping only the rest
+            size_t used = event_serve(c, readbuf, got);
+            event_keep(c, readbuf + used, got - used);
+        }
+        event_process(c);
+        if (c->inlen > EVENT_MAX_LINE && memchr(c->in, '\n', c->inlen) == NULL) {
+            c->dead = 1;
+        }
+    }
+    event_process(c);
+}
+
+
+/*
+ * Disconnect a client and release everything it holds.
+ *
+ * Input:
+ *   c - the client
+ */
+static void event_close(Client *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    }
+    else {
+        clients = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+
+/*
+ * Disconnect a client that is finished, or register it for the events it is
+ * now waiting for.
+ *
+ * Input:
+ *   c - the client
+ */
+static void event_update(Client *c) {
+    int pending = c->outsent < c->outlen;
+    if (c->dead || (c->done && !pending)) {
+        event_close(c);
+        return;
+    }
+    uint32_t events = 0;
+    if (pending) {
+        events |= EPOLLOUT;
+    }
+    if (!c->eof && !c->done && !event_stalled(c)) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (events != c->events) {
+        struct epoll_event ev = { .events = events, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+
+/*
+ * Accept every client waiting on the listening socket.
+ *
+ * Input:
+ *   lfd - the listening socket
+ */
+static void event_accept(int lfd) {
+    for (;;) {
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        Client *c = calloc(1, sizeof(Client));
+        if (c == NULL || fcntl(cfd, F_SETFL, O_NONBLOCK) != 0) {
+            close(cfd);
+            free(c);
+            continue;
+        }
+        c->fd = cfd;
+        c->events = EPOLLIN | EPOLLRDHUP;
+        struct epoll_event ev = { .events = c->events, .data.ptr = c };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev) != 0) {
+            close(cfd);
+            free(c);
+            continue;
+        }
+        c->next = clients;
+        if (clients != NULL) {
+            clients->prev = c;
+        }
+        clients = c;
+    }
+}
+
+
+/*
+ * Run the event-driven query server.
+ *
+ * Input:
+ *   path - the path of the Unix domain socket to listen on; any existing
+ *          file at this path is replaced
+ *
+ * Returns: 0 when stopped by a signal, 1 if the socket could not be set up
+ */
+int event_run(const char *path) {
+    int lfd = server_listen(path);
+    if (lfd < 0) {
+        return 1;
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) != 0) {
+        perror("epoll");
+        close(lfd);
+        unlink(path);
+        return 1;
+    }
+    // accept() must not block once epoll has reported a client
+    fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+
+    // no SA_RESTART, so a signal interrupts epoll_wait()
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = event_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    chatbot_set_interactive(0);
+    struct epoll_event events[EVENT_BATCH];
+    while (!stopping) {
+        int count = epoll_wait(epfd, events, EVENT_BATCH, -1);
+        if (count < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            Client *c = events[i].data.ptr;
+            if (c == NULL) {
+                event_accept(lfd);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                event_flush(c);
+                // room to answer input that was held back
+                event_process(c);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                event_read(c);
+            }
+            event_update(c);
+        }
+    }
+
+    while (clients != NULL) {
+        event_close(clients);
+    }
+    close(epfd);
+    epfd = -1;
+    close(lfd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,313 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the table that chatbot_main() uses to find the
+ * handler for an intent.
+ *
+ * Intents are registered with intent_register(); the chatbot's own intents,
+ * listed by chatbot_intents(), are registered the first time the table is
+ * used, so an intent registered later with the same word replaces the
+ * built-in one. The table is a hash table with linear probing that is never
+ * more than half full, so intent_find() folds and hashes the word once and
+ * compares it with an entry or two, however many intents there are. A
+ * registration fills in a slot of the published table; only when the table
+ * would be more than half full is a table twice the size built to replace
+ * it, so registering n intents costs O(n) in all.
+ *
+ * Registered intents are numbered in the order they were first registered,
+ * for metrics.c; intent_get() finds an intent by its number.
+ *
+ * Intents may be registered while other threads are calling chatbot_main(),
+ * e.g. by chatbot_add_question(). Lookups never lock: they read the table inside an
+ * epoch (see epoch.c), and a replaced table is freed once no lookup can
+ * still be reading it. A replaced entry is kept, since the Intent found by a
+ * lookup is used after the lookup returns.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+/* the number of slots in the first table */
+#define INTENT_MIN_SLOTS 64
+
+/* a registered intent, with its word folded to lower case */
+typedef struct {
+    Intent intent;
+    char key[MAX_INTENT];
+    size_t keylen;
+} IntentEntry;
+
+/* a hash table over the registered intents */
+typedef struct intent_table {
+    size_t mask;                    /* the number of slots, less one */
+    _Atomic(const IntentEntry *) *slots;    /* NULL for an empty slot */
+    unsigned long retired;          /* the epoch in which it was replaced */
+    struct intent_table *next;      /* the next replaced table waiting to be freed */
+} IntentTable;
+
+// the registered intents, protected by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static IntentEntry **entries;
+static size_t nentries;
+
+// the table lookups use, and the ones replaced that lookups may still be reading
+static _Atomic(IntentTable *) table;
+static IntentTable *retired;
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Fold a word to lower case.
+ *
+ * Input:
+ *   word - the word
+ *   key  - a buffer of MAX_INTENT characters to receive the folded word
+ *
+ * Returns: the length of the folded word, or -1 if it is too long to be an intent
+ */
+static int intent_fold(const char *word, char *key) {
+    int i = 0;
+    while (word[i] != '\0') {
+        if (i == MAX_INTENT - 1) {
+            return -1;
+        }
+        key[i] = (char) tolower((unsigned char) word[i]);
+        i++;
+    }
+    key[i] = '\0';
+    return i;
+}
+
+
+/*
+ * Hash a folded word (FNV-1a).
+ */
+static uint32_t intent_hash(const char *key, size_t len) {
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) key[i]) * 16777619U;
+    }
+    return hash ^ (hash >> 15);
+}
+
+
+/*
+ * Find the slot for a folded word in a table: the slot holding its entry,
+ * or the empty slot where the entry would go.
+ */
+static _Atomic(const IntentEntry *) *intent_slot(const IntentTable *t, const char *key, size_t len) {
+    for (size_t slot = intent_hash(key, len) & t->mask;; slot = (slot + 1) & t->mask) {
+        const IntentEntry *entry = atomic_load_explicit(&t->slots[slot], memory_order_acquire);
+        if (entry == NULL || (entry->keylen == len && memcmp(entry->key, key, len) == 0)) {
+            return &t->slots[slot];
+        }
+    }
+}
+
+
+/*
+ * Free the replaced tables that no lookup is reading any more. The caller
+ * must hold lock.
+ */
+static void intent_reclaim() {
+    IntentTable **link = &retired;
+    while (*link != NULL) {
+        IntentTable *t = *link;
+        if (epoch_safe(t->retired)) {
+            *link = t->next;
+            free(t->slots);
+            free(t);
+        }
+        else {
+            link = &t->next;
+        }
+    }
+}
+
+
+/*
+ * Put a registered intent in the table, replacing the table with one twice
+ * the size if it would otherwise be more than half full. The caller must
+ * hold lock.
+ *
+ * Input:
+ *   entry - the intent, already in entries
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+static int intent_publish(const IntentEntry *entry) {
+    IntentTable *t = atomic_load(&table);
+    if (t == NULL || nentries * 2 > t->mask + 1) {
+        size_t size = t == NULL ? INTENT_MIN_SLOTS : (t->mask + 1) * 2;
+        while (nentries * 2 > size) {
+            size *= 2;
+        }
+        IntentTable *built = malloc(sizeof(IntentTable));
+        _Atomic(const IntentEntry *) *slots = calloc(size, sizeof(*slots));
+        if (built == NULL || slots == NULL) {
+            free(built);
+            free(slots);
+            return KB_NOMEM;
+        }
+        built->mask = size - 1;
+        built->slots = slots;
+        for (size_t i = 0; i < nentries; i++) {
+            atomic_init(intent_slot(built, entries[i]->key, entries[i]->keylen), entries[i]);
+        }
+        atomic_store_explicit(&table, built, memory_order_release);
+        if (t != NULL) {
+            t->retired = epoch_advance();
+            t->next = retired;
+            retired = t;
+        }
+        intent_reclaim();
+        return KB_OK;
+    }
+    // a lookup sees the slot empty, or holding the old entry or the new one
+    atomic_store_explicit(intent_slot(t, entry->key, entry->keylen), entry, memory_order_release);
+    intent_reclaim();
+    return KB_OK;
+}
+
+
+/*
+ * Add an intent to the registered intents, replacing any with the same word,
+ * and to the table. The caller must hold lock.
+ *
+ * Input:
+ *   intent - the intent
+ *
+ * Returns: as intent_register()
+ */
+static int intent_add(const Intent *intent) {
+    char key[MAX_INTENT];
+    int len = intent_fold(intent->word, key);
+    if (len <= 0) {
+        return KB_INVALID;
+    }
+    IntentEntry *entry = malloc(sizeof(IntentEntry));
+    IntentEntry **grown = realloc(entries, (nentries + 1) * sizeof(IntentEntry *));
+    if (grown != NULL) {
+        entries = grown;
+    }
+    if (entry == NULL || grown == NULL) {
+        free(entry);
+        return KB_NOMEM;
+    }
+    memcpy(entry->key, key, len + 1);
+    entry->keylen = len;
+    entry->intent = *intent;
+    entry->intent.word = entry->key;
+    // an entry that is replaced is not freed, the published table may still
+    // point at it
+    size_t i;
+    for (i = 0; i < nentries; i++) {
+        if (entries[i]->keylen == (size_t) len && memcmp(entries[i]->key, key, len) == 0) {
+            break;
+        }
+    }
+    // the replacement keeps the number of the intent it replaces
+    entry->intent.id = (int) i;
+    const IntentEntry *replaced = i == nentries ? NULL : entries[i];
+    entries[i] = entry;
+    if (i == nentries) {
+        nentries++;
+    }
+    int result = intent_publish(entry);
+    if (result != KB_OK) {
+        // not in the table, so not registered
+        if (replaced == NULL) {
+            nentries--;
+        }
+        else {
+            entries[i] = (IntentEntry *) replaced;
+        }
+        free(entry);
+    }
+    return result;
+}
+
+
+/*
+ * Register the chatbot's own intents when the table is first used.
+ */
+static void intent_init() {
+    size_t count;
+    const Intent *builtin = chatbot_intents(&count);
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < count; i++) {
+        intent_add(&builtin[i]);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Register an intent. If an intent is already registered for the word, it
+ * is replaced.
+ *
+ * Input:
+ *   word    - the first word of the input that selects the intent; case is ignored
+ *   handler - the function that carries out the intent
+ *   kind    - INTENT_COMMAND, INTENT_QUESTION or INTENT_SMALLTALK
+ *
+ * Returns:
+ *   KB_OK, if the intent was registered
+ *   KB_INVALID, if the word is empty or longer than MAX_INTENT - 1 characters
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int intent_register(const char *word, IntentHandler handler, int kind) {
+    pthread_once(&table_once, intent_init);
+    Intent intent = {word, handler, kind};
+    pthread_mutex_lock(&lock);
+    int result = intent_add(&intent);
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+
+/*
+ * Find the intent selected by a word.
+ *
+ * Input:
+ *   word - the word; case is ignored
+ *
+ * Returns: the intent, or NULL if no intent is registered for the word
+ */
+const Intent *intent_find(const char *word) {
+    pthread_once(&table_once, intent_init);
+    char key[MAX_INTENT];
+    int len = intent_fold(word, key);
+    if (len < 0 || epoch_enter() != KB_OK) {
+        return NULL;
+    }
+    const IntentTable *t = atomic_load_explicit(&table, memory_order_acquire);
+    const IntentEntry *entry = t == NULL ? NULL : atomic_load_explicit(intent_slot(t, key, len), memory_order_acquire);
+    epoch_exit();
+    return entry == NULL ? NULL : &entry->intent;
+}
+
+
+/*
+ * Get a registered intent by its number.
+ *
+ * Input:
+ *   id - the number, as in Intent.id
+ *
+ * Returns: the intent, or NULL if fewer intents are registered
+ */
+const Intent *intent_get(int id) {
+    pthread_once(&table_once, intent_init);
+    const Intent *intent = NULL;
+    pthread_mutex_lock(&lock);
+    if (id >= 0 && (size_t) id < nentries) {
+        intent = &entries[id]->intent;
+    }
+    pthread_mutex_unlock(&lock);
+    return intent;
+}
@@ -0,0 +1,459 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the write-ahead journal of taught facts.
+ *
+ * When journaling is enabled, loading a knowledge base from FILE attaches the
+ * journal FILE.journal: any records already in it are replayed on top of what
+ * was loaded, and every later knowledge_put() appends a record to it. A fact
+ * taught in conversation is therefore on disk as soon as it is learned, and
+ * costs one small write rather than a full SAVE.
+ *
+ * Records are written immediately, so they survive the chatbot crashing.
+ * fsync() is batched (group commit): journal_commit() runs it once
+ * JOURNAL_BATCH records are pending or JOURNAL_INTERVAL_MS has passed since
+ * the last one, a flush thread runs it for records still pending when
+ * JOURNAL_INTERVAL_MS runs out with nothing else taught, and it always runs
+ * when the journal is closed. So a record is on disk at most about
+ * JOURNAL_INTERVAL_MS after it is written. One fsync() covers every record
+ * written before it, by any thread.
+ *
+ * COMPACT rewrites the attached file from memory and then drops the records
+ * that the file now includes from the journal. The records taught meanwhile
+ * are written to FILE.journal.tmp, which is synced and renamed over the
+ * journal, so a crash at any point leaves every record in one or the other.
+ *
+ * The journal starts with JOURNAL_MAGIC. Each record is
+ *
+ *   uint32_t length     (of the payload)
+ *   uint32_t checksum   (FNV-1a of the payload)
+ *   intent\0entity\0response\0
+ *
+ * A torn record at the end (e.g. from a power cut) is discarded on replay.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+#define JOURNAL_MAGIC       "C1002JNL"
+#define JOURNAL_BATCH       64
+#define JOURNAL_INTERVAL_MS 200
+
+// set when journaling is turned on from the command line
+static int enabled;
+
+// protects everything below
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the attached journal, or -1
+static int fd = -1;
+static char base_name[MAX_INPUT];
+
+// group commit state
+static int pending;
+static struct timespec last_sync;
+
+// the thread that syncs records left pending (see journal_flush_loop())
+static pthread_cond_t flush_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t flush_thread;
+static int flushing;            /* set while the flush thread should run */
+static int flush_started;       /* set while there is a flush thread to join */
+
+
+/*
+ * Checksum a journal record payload (FNV-1a).
+ *
+ * Input:
+ *   buf - the payload
+ *   len - the number of bytes in buf
+ *
+ * Returns: the checksum
+ */
+static uint32_t journal_checksum(const char *buf, size_t len) {
+    uint32_t sum = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        sum = (sum ^ (unsigned char) buf[i]) * 16777619U;
+    }
+    return sum;
+}
+
+
+/*
+ * Get the number of milliseconds since the last fsync() of the journal.
+ */
+static long journal_elapsed() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - last_sync.tv_sec) * 1000 + (now.tv_nsec - last_sync.tv_nsec) / 1000000;
+}
+
+
+/*
+ * Sync records that have been pending for JOURNAL_INTERVAL_MS, waiting for
+ * the next one when there are none, until told to stop.
+ */
+static void *journal_flush_loop(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (flushing) {
+        if (pending == 0) {
+            pthread_cond_wait(&flush_wake, &lock);
+            continue;
+        }
+        long wait = JOURNAL_INTERVAL_MS - journal_elapsed();
+        if (wait > 0) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += wait / 1000;
+            until.tv_nsec += wait % 1000 * 1000000;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&flush_wake, &lock, &until);
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+        int result = journal_sync();
+        pthread_mutex_lock(&lock);
+        if (result != KB_OK) {
+            // try again after another interval rather than straight away
+            clock_gettime(CLOCK_MONOTONIC, &last_sync);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+
+/*
+ * Turn journaling on or off. Takes effect at the next journal_attach().
+ *
+ * Input:
+ *   on - 1 to journal taught facts, 0 not to
+ */
+void journal_enable(int on) {
+    enabled = on;
+}
+
+
+/*
+ * Get the name of the file the journal is attached to.
+ *
+ * Input:
+ *   buf - a buffer to receive the file name
+ *   n   - the size of buf
+ *
+ * Returns: 1 if a journal is attached, 0 otherwise
+ */
+int journal_base(char *buf, int n) {
+    pthread_mutex_lock(&lock);
+    int attached = fd >= 0;
+    if (attached) {
+        snprintf(buf, n, "%s", base_name);
+    }
+    pthread_mutex_unlock(&lock);
+    return attached;
+}
+
+
+/*
+ * Replay a journal into the knowledge base and attach it, so that later
+ * knowledge_put() calls are appended to it. Any previously attached journal
+ * is closed first. Does nothing if journaling is not enabled.
+ *
+ * Input:
+ *   filename - the knowledge base file the journal belongs to
+ *
+ * Returns: the number of records replayed, or F_INVALID if the journal could
+ *   not be opened or is not a journal
+ */
+int journal_attach(const char *filename) {
+    if (!enabled) {
+        return 0;
+    }
+    journal_close();
+    char name[MAX_INPUT + 8];
+    snprintf(name, sizeof name, "%s.journal", filename);
+    int jfd = open(name, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (jfd < 0) {
+        return F_INVALID;
+    }
+
+    // read the whole journal, it only holds what was taught since COMPACT
+    struct stat st;
+    if (fstat(jfd, &st) != 0) {
+        close(jfd);
+        return F_INVALID;
+    }
+    char *buf = malloc(st.st_size + 1);
+    if (buf == NULL) {
+        close(jfd);
+        return KB_NOMEM;
+    }
+    size_t size = 0;
+    ssize_t got;
+    while (size < (size_t) st.st_size && (got = pread(jfd, buf + size, st.st_size - size, size)) > 0) {
+        size += got;
+    }
+
+    int count = 0;
+    size_t good;
+    if (size == 0) {
+        // new journal
+        if (write(jfd, JOURNAL_MAGIC, 8) != 8) {
+            free(buf);
+            close(jfd);
+            return F_INVALID;
+        }
+        good = 8;
+    }
+    else if (size < 8 || memcmp(buf, JOURNAL_MAGIC, 8) != 0) {
+        free(buf);
+        close(jfd);
+        return F_INVALID;
+    }
+    else {
+        good = 8;
+        while (good + 8 <= size) {
+            uint32_t len, sum;
+            memcpy(&len, buf + good, 4);
+            memcpy(&sum, buf + good + 4, 4);
+            const char *payload = buf + good + 8;
+            if (len > size - good - 8 || len < 3 || payload[len - 1] != '\0'
+                    || journal_checksum(payload, len) != sum) {
+                break;
+            }
+            const char *intent = payload;
+            const char *entity = intent + strlen(intent) + 1;
+            if (entity >= payload + len) {
+                break;
+            }
+            const char *response = entity + strlen(entity) + 1;
+            if (response >= payload + len) {
+                break;
+            }
+            // fd is still closed here, so this is not journaled again
+            if (knowledge_put(intent, entity, response) == KB_OK) {
+                count++;
+            }
+            good += 8 + len;
+        }
+    }
+    free(buf);
+    // drop a torn record at the end so new records follow a good one
+    if (good < size && ftruncate(jfd, good) != 0) {
+        close(jfd);
+        return F_INVALID;
+    }
+
+    pthread_mutex_lock(&lock);
+    fd = jfd;
+    snprintf(base_name, sizeof base_name, "%s", filename);
+    pending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    // without a flush thread, records are still synced by later puts and on close
+    flushing = 1;
+    flush_started = pthread_create(&flush_thread, NULL, journal_flush_loop, NULL) == 0;
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+
+/*
+ * Append a record to the attached journal. Does nothing if no journal is
+ * attached. The record is not necessarily on disk until journal_commit(), or
+ * until the flush thread syncs it about JOURNAL_INTERVAL_MS later.
+ *
+ * Input:
+ *   intent   - the question word
+ *   entity   - the entity
+ *   response - the response
+ *
+ * Returns:
+ *   KB_OK, if the record was written (or there is no journal)
+ *   F_INVALID, if the record could not be written
+ */
+int journal_append(const char *intent, const char *entity, const char *response) {
+    char record[8 + MAX_INTENT + MAX_ENTITY + MAX_RESPONSE];
+    size_t len = 0;
+    char *payload = record + 8;
+    // store what knowledge_put() keeps, so replay gives the same result
+    size_t n = strnlen(intent, MAX_INTENT - 1);
+    memcpy(payload + len, intent, n);
+    len += n;
+    payload[len++] = '\0';
+    n = strnlen(entity, MAX_ENTITY - 1);
+    memcpy(payload + len, entity, n);
+    len += n;
+    payload[len++] = '\0';
+    n = strnlen(response, MAX_RESPONSE - 1);
+    memcpy(payload + len, response, n);
+    len += n;
+    payload[len++] = '\0';
+    uint32_t len32 = (uint32_t) len;
+    uint32_t sum = journal_checksum(payload, len);
+    memcpy(record, &len32, 4);
+    memcpy(record + 4, &sum, 4);
+
+    // one write() per record, so a record is never interleaved with another
+    int result = KB_OK;
+    pthread_mutex_lock(&lock);
+    if (fd >= 0) {
+        if (write(fd, record, 8 + len) == (ssize_t) (8 + len)) {
+            if (pending++ == 0) {
+                pthread_cond_signal(&flush_wake);
+            }
+        }
+        else {
+            result = F_INVALID;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+
+/*
+ * Sync the journal if enough records are pending or enough time has passed
+ * since the last sync.
+ *
+ * Returns:
+ *   KB_OK, if the journal is in order (or there is no journal)
+ *   F_INVALID, if fsync() failed
+ */
+int journal_commit() {
+    pthread_mutex_lock(&lock);
+    int due = fd >= 0 && pending > 0
+            && (pending >= JOURNAL_BATCH || journal_elapsed() >= JOURNAL_INTERVAL_MS);
+    pthread_mutex_unlock(&lock);
+    return due ? journal_sync() : KB_OK;
+}
+
+
+/*
+ * Force pending journal records to disk.
+ *
+ * Returns:
+ *   KB_OK, if the records are on disk (or there is no journal)
+ *   F_INVALID, if fsync() failed
+ */
+int journal_sync() {
+    pthread_mutex_lock(&lock);
+    if (fd < 0 || pending == 0) {
+        pthread_mutex_unlock(&lock);
+        return KB_OK;
+    }
+    // sync a duplicate without holding the lock, so other threads can keep
+    // appending (and the journal can be closed) while the disk catches up
+    int synced = pending;
+    int sfd = dup(fd);
+    pthread_mutex_unlock(&lock);
+    if (sfd < 0) {
+        return F_INVALID;
+    }
+    int result = fsync(sfd) == 0 ? KB_OK : F_INVALID;
+    close(sfd);
+    if (result == KB_OK) {
+        pthread_mutex_lock(&lock);
+        pending = pending > synced ? pending - synced : 0;
+        clock_gettime(CLOCK_MONOTONIC, &last_sync);
+        pthread_mutex_unlock(&lock);
+    }
+    return result;
+}
+
+
+/*
+ * Get the current end of the journal. Every record before it has already been
+ * applied to the knowledge base.
+ *
+ * Returns: the size of the journal, or 0 if there is no journal
+ */
+long journal_mark() {
+    pthread_mutex_lock(&lock);
+    long mark = fd < 0 ? 0 : (long) lseek(fd, 0, SEEK_END);
+    pthread_mutex_unlock(&lock);
+    return mark < 0 ? 0 : mark;
+}
+
+
+/*
+ * Drop the records before a mark from the attached journal, after they have
+ * been folded into the knowledge base file. Records appended since the mark
+ * are kept, since the file may not include them.
+ *
+ * Input:
+ *   mark - a value returned by journal_mark() before the file was written
+ *
+ * Returns:
+ *   KB_OK, if the journal was trimmed (or there is no journal)
+ *   F_INVALID, if the journal could not be rewritten
+ */
+int journal_truncate(long mark) {
+    int result = KB_OK;
+    pthread_mutex_lock(&lock);
+    if (fd >= 0 && mark > 8) {
+        // write the (usually empty) tail written since the mark to a new
+        // journal and rename it into place, so a crash leaves one or the other
+        char name[MAX_INPUT + 8];
+        char tmpname[MAX_INPUT + 12];
+        snprintf(name, sizeof name, "%s.journal", base_name);
+        snprintf(tmpname, sizeof tmpname, "%s.tmp", name);
+        off_t end = lseek(fd, 0, SEEK_END);
+        size_t tail = end > mark ? (size_t) (end - mark) : 0;
+        char *buf = malloc(tail + 8);
+        int tfd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (buf != NULL) {
+            memcpy(buf, JOURNAL_MAGIC, 8);
+        }
+        if (buf == NULL || tfd < 0 || (tail > 0 && pread(fd, buf + 8, tail, mark) != (ssize_t) tail)
+                || write(tfd, buf, tail + 8) != (ssize_t) (tail + 8)
+                || fsync(tfd) != 0 || rename(tmpname, name) != 0) {
+            result = F_INVALID;
+            if (tfd >= 0) {
+                close(tfd);
+                remove(tmpname);
+            }
+        }
+        else {
+            // everything in the old journal is on disk, in the file or the new one
+            close(fd);
+            fd = tfd;
+            pending = 0;
+            clock_gettime(CLOCK_MONOTONIC, &last_sync);
+        }
+        free(buf);
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+
+/*
+ * Sync and detach the journal.
+ */
+void journal_close() {
+    pthread_mutex_lock(&lock);
+    int started = flush_started;
+    flushing = 0;
+    flush_started = 0;
+    pthread_cond_signal(&flush_wake);
+    pthread_mutex_unlock(&lock);
+    if (started) {
+        pthread_join(flush_thread, NULL);
+    }
+    pthread_mutex_lock(&lock);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -4,272 +4,3633 @@
  * This file implements the chatbot's knowledge base.
  *
  * knowledge_get() retrieves the response to a question.
+ * knowledge_get_many() retrieves the responses to many questions at once.
+ * knowledge_search() finds the entities whose responses best match some words.
+ * knowledge_get_near() answers for the entity nearest to one that is not known.
  * knowledge_put() inserts a new response to a question.
  * knowledge_read() reads the knowledge base from a file.
+ * knowledge_read_files() reads it from several files at once.
  * knowledge_reset() erases all of the knowledge.
  * knowledge_write() saves the knowledge base in a file.
+ * knowledge_write_shards() saves it in several files at once.
+ * knowledge_write_snapshot() saves the knowledge base in a binary snapshot.
+ * knowledge_begin() and knowledge_end() replace the knowledge base as a whole.
+ * knowledge_stats() measures the knowledge base for STATS.
+ *
+ * Each of these works on the chatbot's own knowledge base. A process may
+ * hold any number of others, made with knowledge_create(), which are used
+ * through the *_ctx() functions (knowledge_get_ctx() and so on); they share
+ * nothing, so lookups in one never wait on another.
+ *
+ * Entities are kept in a hash index over their folded names, and numbered in
+ * the order they were added. Responses are kept apart from the entities, in
+ * a column for each question word (i.e. each section of the INI file): the
+ * column lists the entities it has a response for, in the order they were
+ * given one, with a small hash index from entity number to row. A column is
+ * created when a question word is first seen, and having a column makes the
+ * word a question in that knowledge base alone (see knowledge_is_question()),
+ * so "[when]" in a file needs nothing more, and is forgotten again on RESET.
+ * A heading that already selects a command or small talk, such as "[how]",
+ * still gets a column, which is loaded and saved like any other but never
+ * asked. Memory grows with the
+ * responses actually given, and SAVE writes each section by scanning its
+ * column.
+ *
+ * Each column also keeps an inverted index over the words of its responses,
+ * for SEARCH: every word used lists the rows using it, and how often. It is
+ * kept up to date as rows are indexed, replaced and taken away, so
+ * knowledge_search() ranks entities (by BM25, summed over the columns)
+ * without reading any response.
+ *
+ * The folded entity names are indexed by their trigrams too, so that a
+ * question about an unknown entity can be answered for a known one a typo
+ * or two away (see knowledge_get_near()) without comparing it with every
+ * name.
+ *
+ * The knowledge base may be used from several threads. Lookups and saves take
+ * a shared lock, and changes made in place take it exclusively. Replacing the
+ * knowledge base (RELOAD, RESET) swaps in a new version with one atomic store
+ * instead, so lookups never wait for it; old versions are freed using
+ * epoch-based reclamation (see epoch.c).
  *
  * You may add helper functions as necessary.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "chat1002.h"
 
-// global vars
-EntityNode *head;
-EntityNode *tail;
+// initial number of hash buckets, must be a power of two
+#define KB_MIN_BUCKETS 64
+
+// initial number of slots in a column's index, must be a power of two
+#define KB_MIN_SLOTS 16
+
+// the number of questions knowledge_get_many() looks up together
+#define KB_BATCH 16
+
+// the most words of a query that knowledge_search() looks for
+#define KB_SEARCH_WORDS 32
+
+// the number of trigrams a typo can change in a name, see knowledge_get_near()
+#define KB_GRAM 3
+
+// the length of a row whose response could not be added to the inverted index
+#define KB_UNSEARCHED UINT16_MAX
+
+// BM25's term frequency saturation and length normalisation
+#define KB_BM25_K1 1.2
+#define KB_BM25_B  0.75
+
+// start loading memory that will be read soon
+#if defined(__GNUC__)
+#define KB_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define KB_PREFETCH(p) ((void) (p))
+#endif
 
 /*
- * Get the response to a question.
+ * A binary snapshot is laid out so that it can be mapped and used in place:
  *
- * Input:
- *   intent   - the question word
- *   entity   - the entity
- *   response - a buffer to receive the response
- *   n        - the maximum number of characters to write to the response buffer
+ *   SnapshotHeader
+ *   SnapshotEntity[nentities]   (in insertion order)
+ *   uint32_t[nbuckets]          (first entity in each hash bucket)
+ *   SnapshotColumn[ncolumns]    (one for each question word)
+ *   SnapshotRow[nrows]          (the responses, column by column)
+ *   char[nstrings]              (null-terminated names and responses)
  *
- * Returns:
- *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
- *   KB_NOTFOUND, if no response could be found
- *   KB_INVALID, if 'intent' is not a recognised question word
+ * Strings are referred to by their offset in the string table. The checksum
+ * covers everything after the header.
+ *
+ * Version 1 snapshots, from before responses were kept in columns, had no
+ * columns or rows; each entity held its what, where and who responses
+ * itself (see SnapshotEntityV1). They can still be read.
  */
-int knowledge_get(const char *intent, const char *entity, char *response, int n) {
-	if (!chatbot_is_question(intent)){
-	    return KB_INVALID;
-	}
-	// valid question
-	EntityNode *current;
-	current = head;
-	int found = 0;
-	// traverse and search linked-list for
-	while (current != NULL){
-        if (compare_token(current->entity,entity) == 0){
-            found = 1;
-            break;
+#define SNAPSHOT_MAGIC   "C1002KB"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_NONE    UINT32_MAX
+#define SNAPSHOT_NOSTR   UINT64_MAX
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t nentities;
+    uint64_t nbuckets;
+    uint64_t nstrings;
+    uint64_t checksum;
+    uint64_t ncolumns;      /* 0 in version 1 */
+    uint64_t nrows;         /* 0 in version 1 */
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t entity;        /* string offsets */
+    uint64_t key;
+    uint32_t keylen;
+    uint32_t chain;         /* the next entity in the same bucket, or SNAPSHOT_NONE */
+} SnapshotEntity;
+
+typedef struct {
+    uint64_t name;          /* string offset of the question word */
+    uint64_t first;         /* the column's first row */
+    uint64_t nrows;
+} SnapshotColumn;
+
+typedef struct {
+    uint64_t response;      /* string offset */
+    uint32_t entity;        /* the entity's index */
+    uint32_t reserved;
+} SnapshotRow;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t entity;        /* string offsets, or SNAPSHOT_NOSTR */
+    uint64_t key;
+    uint64_t what;
+    uint64_t where;
+    uint64_t who;
+    uint32_t keylen;
+    uint32_t chain;
+} SnapshotEntityV1;
+
+// running state of a snapshot checksum
+typedef struct {
+    uint64_t sum;
+    unsigned char pending[8];
+    size_t npending;
+} Checksum;
+
+// a snapshot whose strings are referenced by the knowledge base
+typedef struct mapping {
+    char *addr;
+    size_t size;
+    int mapped;             /* 1 if addr came from mmap(), 0 if from malloc() */
+    struct mapping *next;
+} Mapping;
+
+/* a slot in a column's hash index; the id is kept so a lookup only visits the rows it finds */
+typedef struct {
+    uint32_t id;                /* the entity's id */
+    uint32_t row;               /* its row + 1, or 0 if the slot is empty */
+} ColumnSlot;
+
+/* a row whose response uses a word */
+typedef struct {
+    uint32_t row;
+    uint32_t count;             /* the number of times the response uses the word */
+} Posting;
+
+/* a word used in a column's responses, for SEARCH */
+typedef struct {
+    const char *word;           /* the word where it was first seen, in a response; not null-terminated */
+    uint32_t len;
+    uint32_t hash;              /* hash of the word folded to lower case */
+    Posting *postings;          /* the rows using the word, in no particular order */
+    uint32_t npostings;
+    uint32_t size;              /* the number of postings there is room for */
+} Term;
+
+/*
+ * The responses to one question word, i.e. one section of the INI file.
+ * Rows are never removed; a response that is taken away is set to NULL.
+ * A bulk load appends rows without indexing them, then indexes them all at
+ * once (see knowledge_column_index()); lookups only see indexed rows.
+ */
+typedef struct {
+    char name[MAX_INTENT];      /* the question word, folded to lower case */
+    size_t namelen;
+    uint32_t *entities;         /* the entity each row answers, by id */
+    const char **responses;     /* the response in each row, or NULL */
+    size_t nrows;
+    size_t size;                /* the number of rows there is room for */
+    ColumnSlot *slots;          /* hash index from entity id to row */
+    size_t nslots;
+    size_t indexed;             /* the number of rows in the index */
+    uint16_t *lengths;          /* the number of words in each indexed row's response, or KB_UNSEARCHED */
+    Term *terms;                /* the words used in the indexed rows' responses */
+    size_t nterms;
+    size_t termsize;            /* the number of terms there is room for */
+    uint32_t *termslots;        /* hash index from word to term + 1, or 0 if the slot is empty */
+    size_t ntermslots;
+    size_t nwords;              /* the number of words in all of the responses */
+    size_t ndocs;               /* the number of rows with a response */
+    size_t npostings;           /* the number of postings there is room for, over every term */
+    size_t searched;            /* the number of rows in the inverted index, see knowledge_column_search() */
+} Column;
+
+/* the entities whose folded names contain a trigram, see knowledge_grams() */
+typedef struct {
+    uint32_t gram;              /* the trigram, or 0 if the slot is empty */
+    uint32_t nids;
+    uint32_t size;              /* the number of ids there is room for */
+    uint32_t *ids;              /* the entities, by id, in increasing order */
+} Gram;
+
+/*
+ * One version of the knowledge base. LOAD and knowledge_put() change the
+ * current version in place, under its lock. RELOAD and RESET build a new
+ * version off to the side and swap it in (see knowledge_begin()); lookups
+ * that are still using the old version finish with it undisturbed, and it is
+ * freed once the last of them is done.
+ */
+typedef struct knowledge {
+    pthread_rwlock_t lock;      /* shared by lookups and saves, exclusive for changes */
+    Arena arena;                /* nodes and their strings, released all at once */
+    Mapping *mappings;          /* snapshots that nodes point into */
+    EntityNode **nodes;         /* the entities, by id */
+    size_t nentities;
+    size_t size;                /* the number of entities there is room for in nodes */
+    EntityNode **buckets;       /* hash index over the folded entity names, chained through EntityNode.chain */
+    size_t nbuckets;
+    Column *columns;            /* in the order the question words were first seen */
+    size_t ncolumns;
+    Gram *grams;                /* hash index from trigram to the entities whose names contain it */
+    size_t ngrams;
+    size_t ngramslots;
+    size_t grammed;             /* the number of entities in the trigram index */
+    unsigned long retired;      /* the epoch in which it was swapped out */
+    struct knowledge *next;     /* the next version waiting to be freed */
+} Knowledge;
+
+static int knowledge_put_span(Knowledge *kb, const char *intent, const char *entity, size_t elen,
+                              const char *response, size_t rlen);
+static int knowledge_insert(Knowledge *kb, Column *column, const char *entity, size_t elen,
+                            const char *response, size_t rlen, int bulk);
+static int knowledge_write_snapshot_locked(Knowledge *kb, FILE *f);
+static int knowledge_read_file(KBContext *ctx, FILE *f);
+static void knowledge_write_file(const Knowledge *kb, FILE *f, size_t first, size_t last);
+
+/* an entity's score in a search; the accumulator is a hash table of these */
+typedef struct search_score {
+    uint32_t id;                /* the entity's id + 1, or 0 if the slot is empty */
+    float score;
+} SearchScore;
+
+/*
+ * A knowledge base, as handed out by knowledge_create(): the version lookups
+ * see, and the versions swapped out of it. Knowledge bases share nothing, so
+ * threads using different ones never wait for each other.
+ */
+struct kb_context {
+    _Atomic(Knowledge *) current;   /* the version lookups see; readers load it inside an epoch (see epoch.c) */
+    pthread_mutex_t update;         /* serialises changes, and swaps between versions */
+    Knowledge *retired;             /* versions swapped out but perhaps still being read, protected by update */
+    atomic_int nretired;
+    Knowledge *forked;              /* the version locked across fork() */
+    struct kb_context *next;        /* the next knowledge base in contexts */
+};
+
+// the knowledge base used by the functions without a context, which is the
+// chatbot's own
+static KBContext defaults = {.update = PTHREAD_MUTEX_INITIALIZER};
+
+// every knowledge base, so that all of them can be locked around fork()
+static KBContext *contexts = &defaults;
+static pthread_mutex_t contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+
+// the scores of the entities found by this thread's last search, kept for
+// the next (see knowledge_search_ctx()) and freed when the thread exits
+static _Thread_local struct search_score *scores;
+static _Thread_local size_t nscores;
+static pthread_key_t scores_key;
+static pthread_once_t scores_once = PTHREAD_ONCE_INIT;
+
+// the version being built on this thread by knowledge_begin_ctx(), if any,
+// and the knowledge base it is for
+static _Thread_local Knowledge *staging;
+static _Thread_local KBContext *staged;
+
+
+/*
+ * Lock every knowledge base exclusively around fork(), so the child (e.g. a
+ * background save) never starts with a lock held by a thread that it does
+ * not have.
+ */
+static void knowledge_prefork() {
+    pthread_mutex_lock(&contexts_lock);
+    for (KBContext *ctx = contexts; ctx != NULL; ctx = ctx->next) {
+        pthread_mutex_lock(&ctx->update);
+        ctx->forked = atomic_load(&ctx->current);
+        if (ctx->forked != NULL) {
+            pthread_rwlock_wrlock(&ctx->forked->lock);
         }
-        current = current->next;
-	}
-	if (found) {
-        // check if intent has corresponding response
-        if (compare_token(intent, "what") == 0) {
-            // process what
-            if (current->what[0] != '\0') {
-                strncpy(response,current->what,n);
-                return KB_OK;
-            }
+    }
+}
+
+static void knowledge_postfork() {
+    for (KBContext *ctx = contexts; ctx != NULL; ctx = ctx->next) {
+        if (ctx->forked != NULL) {
+            pthread_rwlock_unlock(&ctx->forked->lock);
         }
-        else if (compare_token(intent, "where") == 0) {
-            // process where
-            if (current->where[0] != '\0') {
-                strncpy(response,current->where,n);
-                return KB_OK;
-            }
+        pthread_mutex_unlock(&ctx->update);
+    }
+    pthread_mutex_unlock(&contexts_lock);
+}
+
+// the child is a different thread as far as the locks are concerned, so it
+// starts them afresh rather than unlocking them
+static void knowledge_postfork_child() {
+    for (KBContext *ctx = contexts; ctx != NULL; ctx = ctx->next) {
+        if (ctx->forked != NULL) {
+            pthread_rwlock_init(&ctx->forked->lock, NULL);
+        }
+        pthread_mutex_init(&ctx->update, NULL);
+    }
+    pthread_mutex_init(&contexts_lock, NULL);
+}
+
+static void knowledge_fork_init() {
+    pthread_atfork(knowledge_prefork, knowledge_postfork, knowledge_postfork_child);
+}
+
+
+/*
+ * Create an empty version of the knowledge base.
+ *
+ * Returns: the version, or NULL if there was a memory allocation failure
+ */
+static Knowledge *knowledge_new() {
+    pthread_once(&fork_once, knowledge_fork_init);
+    Knowledge *kb = calloc(1, sizeof(Knowledge));
+    if (kb == NULL) {
+        return NULL;
+    }
+    pthread_rwlock_init(&kb->lock, NULL);
+    return kb;
+}
+
+
+/*
+ * Free a version of the knowledge base and everything it holds.
+ *
+ * Input:
+ *   kb - the version, which no thread may be using
+ */
+static void knowledge_free(Knowledge *kb) {
+    // every node lives in the arena, so there is nothing to free one by one
+    arena_free(&kb->arena);
+    free(kb->nodes);
+    free(kb->buckets);
+    for (size_t i = 0; i < kb->ncolumns; i++) {
+        free(kb->columns[i].entities);
+        free(kb->columns[i].responses);
+        free(kb->columns[i].slots);
+        free(kb->columns[i].lengths);
+        for (size_t t = 0; t < kb->columns[i].nterms; t++) {
+            free(kb->columns[i].terms[t].postings);
+        }
+        free(kb->columns[i].terms);
+        free(kb->columns[i].termslots);
+    }
+    free(kb->columns);
+    for (size_t i = 0; i < kb->ngramslots; i++) {
+        free(kb->grams[i].ids);
+    }
+    free(kb->grams);
+    // release the snapshots the nodes were pointing into
+    while (kb->mappings != NULL) {
+        Mapping *next = kb->mappings->next;
+        if (kb->mappings->mapped) {
+            munmap(kb->mappings->addr, kb->mappings->size);
         }
         else {
-            // process who
-            if (current->who[0] != '\0') {
-                strncpy(response,current->who,n);
-                return KB_OK;
-            }
+            free(kb->mappings->addr);
         }
+        free(kb->mappings);
+        kb->mappings = next;
     }
-	return KB_NOTFOUND;
+    pthread_rwlock_destroy(&kb->lock);
+    free(kb);
 }
 
 
 /*
- * Insert a new response to a question. If a response already exists for the
- * given intent and entity, it will be overwritten. Otherwise, it will be added
- * to the knowledge base.
+ * Create a knowledge base of its own, independent of the chatbot's and of
+ * every other, e.g. for one tenant of many served by one process. It starts
+ * out empty, and is used with the *_ctx() functions.
+ *
+ * A section heading loaded into it makes the word a question in it alone
+ * (see knowledge_is_question_ctx()).
+ *
+ * Returns: the knowledge base, or NULL if there was a memory allocation failure
+ */
+KBContext *knowledge_create() {
+    pthread_once(&fork_once, knowledge_fork_init);
+    KBContext *ctx = calloc(1, sizeof(KBContext));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    // start with an empty version, so there is always one to read
+    Knowledge *kb = knowledge_new();
+    if (kb == NULL) {
+        free(ctx);
+        return NULL;
+    }
+    atomic_init(&ctx->current, kb);
+    atomic_init(&ctx->nretired, 0);
+    pthread_mutex_init(&ctx->update, NULL);
+    pthread_mutex_lock(&contexts_lock);
+    ctx->next = contexts;
+    contexts = ctx;
+    pthread_mutex_unlock(&contexts_lock);
+    return ctx;
+}
+
+
+/*
+ * Free a knowledge base made by knowledge_create(), and everything in it.
  *
  * Input:
- *   intent    - the question word
- *   entity    - the entity
- *   response  - the response for this question and entity
+ *   ctx - the knowledge base, which no thread may be using; the chatbot's
+ *         own (knowledge_default()) cannot be freed, and is left as it is
+ */
+void knowledge_destroy(KBContext *ctx) {
+    if (ctx == NULL || ctx == &defaults) {
+        return;
+    }
+    pthread_mutex_lock(&contexts_lock);
+    KBContext **link = &contexts;
+    while (*link != ctx) {
+        link = &(*link)->next;
+    }
+    *link = ctx->next;
+    pthread_mutex_unlock(&contexts_lock);
+    Knowledge *kb = atomic_load(&ctx->current);
+    if (kb != NULL) {
+        knowledge_free(kb);
+    }
+    // no lookup is using it, so whatever was retired can go now too
+    while (ctx->retired != NULL) {
+        kb = ctx->retired;
+        ctx->retired = kb->next;
+        knowledge_free(kb);
+    }
+    pthread_mutex_destroy(&ctx->update);
+    free(ctx);
+}
+
+
+/*
+ * Get the chatbot's own knowledge base, the one used by the functions that
+ * take no context (knowledge_get() and so on).
  *
- * Returns:
- *   KB_FOUND, if successful
- *   KB_NOMEM, if there was a memory allocation failure
- *   KB_INVALID, if the intent is not a valid question word
+ * Returns: the knowledge base
  */
-int knowledge_put(const char *intent, const char *entity, const char *response) {
-	// invalid question word
-	if(!chatbot_is_question(intent)){
-	    return KB_INVALID;
-	}
-	EntityNode *current;
-	current = head;
-	int entityFound = 0;
-	// existing data structure
-    if(current != NULL){
-        // iterate linked-list
-        while(current != NULL){
-            if (compare_token(current->entity,entity) == 0){
-                entityFound = 1;
-                break;
-            }
-            // current node is not target, move on
-            current = current->next;
+KBContext *knowledge_default() {
+    return &defaults;
+}
+
+
+/*
+ * Free the swapped-out versions that no lookup is using any more. The caller
+ * must hold ctx->update.
+ */
+static void knowledge_reclaim(KBContext *ctx) {
+    Knowledge **link = &ctx->retired;
+    while (*link != NULL) {
+        Knowledge *kb = *link;
+        if (epoch_safe(kb->retired)) {
+            *link = kb->next;
+            knowledge_free(kb);
+            atomic_fetch_sub(&ctx->nretired, 1);
+        }
+        else {
+            link = &kb->next;
         }
     }
-    // target entity does not exist, create one and add to linked-list
-    if (!entityFound){
-        // allocate memory to prevent unexpected behaviour
-        EntityNode *target = calloc(1,sizeof(EntityNode));
-        if (target == NULL){
-            return KB_NOMEM;
+}
+
+
+/*
+ * Make a version of the knowledge base the one lookups see. The old version
+ * is freed once the lookups using it have finished. The caller must hold
+ * ctx->update.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ *   kb  - the new version
+ */
+static void knowledge_publish(KBContext *ctx, Knowledge *kb) {
+    Knowledge *old = atomic_exchange(&ctx->current, kb);
+    if (old != NULL) {
+        old->retired = epoch_advance();
+        old->next = ctx->retired;
+        ctx->retired = old;
+        atomic_fetch_add(&ctx->nretired, 1);
+    }
+    knowledge_reclaim(ctx);
+}
+
+
+/*
+ * Lock the knowledge base for a change. While this thread is building a new
+ * version (see knowledge_begin_ctx()), changes go to that version instead,
+ * which no other thread can see yet.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ *
+ * Returns: the version to change, or NULL if there was a memory allocation failure
+ */
+static Knowledge *knowledge_lock(KBContext *ctx) {
+    if (staged == ctx) {
+        return staging;
+    }
+    pthread_mutex_lock(&ctx->update);
+    Knowledge *kb = atomic_load(&ctx->current);
+    if (kb == NULL) {
+        kb = knowledge_new();
+        if (kb == NULL) {
+            pthread_mutex_unlock(&ctx->update);
+            return NULL;
         }
-        snprintf(target->entity,MAX_ENTITY,"%s",entity);
-        memset(target->what,0,MAX_RESPONSE);
-        memset(target->where,0,MAX_RESPONSE);
-        memset(target->who,0,MAX_RESPONSE);
-        target->next = NULL;
-        current = target;
-        // check if current node is first node in linked-list
-        if (head == NULL){
-            head = target;
-            tail = target;
+        atomic_store(&ctx->current, kb);
+    }
+    pthread_rwlock_wrlock(&kb->lock);
+    return kb;
+}
+
+
+/*
+ * Unlock the knowledge base after a change.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ *   kb  - the version returned by knowledge_lock()
+ */
+static void knowledge_unlock(KBContext *ctx, Knowledge *kb) {
+    if (staged == ctx) {
+        return;
+    }
+    pthread_rwlock_unlock(&kb->lock);
+    knowledge_reclaim(ctx);
+    pthread_mutex_unlock(&ctx->update);
+}
+
+
+/*
+ * Start reading the current version of the knowledge base.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ *
+ * Returns: the version, or NULL if there was a memory allocation failure
+ */
+static Knowledge *knowledge_acquire(KBContext *ctx) {
+    for (;;) {
+        if (epoch_enter() != KB_OK) {
+            return NULL;
         }
-        // if not first node and entity not found, create and add to linked-list
-        else{
-            tail->next = target;
-            tail = target;
+        Knowledge *kb = atomic_load(&ctx->current);
+        if (kb != NULL) {
+            pthread_rwlock_rdlock(&kb->lock);
+            return kb;
         }
+        // nothing has been loaded yet, start with an empty knowledge base
+        epoch_exit();
+        kb = knowledge_lock(ctx);
+        if (kb == NULL) {
+            return NULL;
+        }
+        knowledge_unlock(ctx, kb);
     }
-    // check and set response
-    if(compare_token(intent,"what") == 0){
-        // process what
-        snprintf(current->what,MAX_RESPONSE,"%s",response);
+}
+
+
+/*
+ * Finish reading a version of the knowledge base.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ *   kb  - the version returned by knowledge_acquire()
+ */
+static void knowledge_release(KBContext *ctx, Knowledge *kb) {
+    pthread_rwlock_unlock(&kb->lock);
+    epoch_exit();
+    // free versions that were waiting for this lookup, unless a change is
+    // under way, in which case it will
+    if (atomic_load_explicit(&ctx->nretired, memory_order_relaxed) > 0
+            && pthread_mutex_trylock(&ctx->update) == 0) {
+        knowledge_reclaim(ctx);
+        pthread_mutex_unlock(&ctx->update);
     }
-    else if (compare_token(intent, "where") == 0){
-        // process where
-        snprintf(current->where,MAX_RESPONSE,"%s",response);
+}
+
+
+/*
+ * Fold an entity name to lower case and hash it (FNV-1a).
+ *
+ * Input:
+ *   entity - the entity name, which need not be null-terminated
+ *   n      - the maximum number of characters to read from entity
+ *   key    - a buffer of MAX_ENTITY characters to receive the folded name
+ *   len    - receives the length of the folded name
+ *
+ * Returns: the hash of the folded name
+ */
+static unsigned long knowledge_fold(const char *entity, size_t n, char *key, size_t *len) {
+    unsigned long hash = 2166136261UL;
+    size_t i = 0;
+    while (i < n && entity[i] != '\0' && i < MAX_ENTITY - 1) {
+        key[i] = (char) tolower((unsigned char) entity[i]);
+        hash = (hash ^ (unsigned char) key[i]) * 16777619UL;
+        i++;
     }
-    else{
-        // process who
-        snprintf(current->who,MAX_RESPONSE,"%s",response);
+    key[i] = '\0';
+    *len = i;
+    return hash;
+}
+
+
+/*
+ * Find the node for a folded entity name in a hash bucket.
+ *
+ * Input:
+ *   current        - the first node in the bucket, or NULL
+ *   key, len, hash - as knowledge_find()
+ *
+ * Returns: the node, or NULL if the entity is not in the bucket
+ */
+static EntityNode *knowledge_chain(EntityNode *current, const char *key, size_t len, unsigned long hash) {
+    while (current != NULL) {
+        if (current->hash == hash && current->keylen == len && memcmp(current->key, key, len) == 0) {
+            return current;
+        }
+        current = current->chain;
     }
-    return KB_OK;
+    return NULL;
 }
 
 
 /*
- * Read a knowledge base from a file.
+ * Find the node for a folded entity name in the hash index.
  *
  * Input:
- *   f - the file
+ *   kb   - the version of the knowledge base
+ *   key  - the folded entity name, as produced by knowledge_fold()
+ *   len  - the length of the folded entity name
+ *   hash - the hash of the folded entity name
  *
- * Returns: the number of entity/response pairs successful read from the file
+ * Returns: the node, or NULL if the entity is not in the knowledge base
  */
-int knowledge_read(FILE *f) {
-    if(f == NULL){
-        return F_INVALID;
+static EntityNode *knowledge_find(const Knowledge *kb, const char *key, size_t len, unsigned long hash) {
+    if (kb->nbuckets == 0) {
+        return NULL;
     }
-    int count = 0;
-    char entitybuf[MAX_ENTITY];
-    char responsebuf[MAX_RESPONSE];
-    char *tokenptr;
-    // each line has maximum one entity and one response plus a =
-    char line[MAX_RESPONSE + MAX_ENTITY + 1];
-    char intentkey[MAX_INTENT];
-    while(fgets(line,sizeof line, f) != NULL) {
-        if (line[0] == '[') {
-            // process section heading
-            char *tmp = strchr(line, ']');
-            int length = tmp - line;
-            strncpy(intentkey, line + 1, length);
-            intentkey[length - 1] = '\0';
-            continue;
+    return knowledge_chain(kb->buckets[hash & (kb->nbuckets - 1)], key, len, hash);
+}
+
+
+/*
+ * Make room for more entities: in the list of nodes, and in the hash index,
+ * doubling the number of buckets until the load factor would not exceed 3/4.
+ * The index is rebuilt at most once, however many entities are to come.
+ *
+ * Input:
+ *   kb    - the version of the knowledge base
+ *   extra - the number of entities to make room for
+ *
+ * Returns:
+ *   KB_OK, if there is room for the entities
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int knowledge_reserve(Knowledge *kb, size_t extra) {
+    size_t need = kb->nentities + extra;
+    if (need > kb->size) {
+        size_t size = kb->size == 0 ? KB_MIN_BUCKETS : kb->size * 2;
+        while (size < need) {
+            size *= 2;
         }
-        // check if current line is new line
-        if (isspace(line[0])) {
-            continue;
+        EntityNode **nodes = realloc(kb->nodes, size * sizeof(EntityNode *));
+        if (nodes == NULL) {
+            return KB_NOMEM;
         }
-        tokenptr = strtok(line, "=");
-        snprintf(entitybuf, MAX_ENTITY,"%s" ,tokenptr);
-        tokenptr = strtok(NULL, "=");
-        if (tokenptr == NULL){
-            return F_INVALID;
+        kb->nodes = nodes;
+        kb->size = size;
+    }
+    if (kb->nbuckets != 0 && need * 4 <= kb->nbuckets * 3) {
+        return KB_OK;
+    }
+    size_t size = kb->nbuckets == 0 ? KB_MIN_BUCKETS : kb->nbuckets * 2;
+    while (need * 4 > size * 3) {
+        size *= 2;
+    }
+    EntityNode **table = calloc(size, sizeof(EntityNode *));
+    if (table == NULL) {
+        return KB_NOMEM;
+    }
+    // rehash using the cached hashes, no need to fold the names again
+    for (size_t i = 0; i < kb->nentities; i++) {
+        EntityNode *current = kb->nodes[i];
+        size_t slot = current->hash & (size - 1);
+        current->chain = table[slot];
+        table[slot] = current;
+    }
+    free(kb->buckets);
+    kb->buckets = table;
+    kb->nbuckets = size;
+    return KB_OK;
+}
+
+
+/*
+ * Number a new node and add it to the list of nodes and the hash index. The
+ * caller must have made room with knowledge_reserve() and filled in every field
+ * except id and chain.
+ *
+ * Input:
+ *   kb     - the version of the knowledge base
+ *   target - the node
+ */
+static void knowledge_link(Knowledge *kb, EntityNode *target) {
+    target->id = (uint32_t) kb->nentities;
+    kb->nodes[kb->nentities++] = target;
+    // link into the hash bucket
+    size_t slot = target->hash & (kb->nbuckets - 1);
+    target->chain = kb->buckets[slot];
+    kb->buckets[slot] = target;
+}
+
+
+/*
+ * List the distinct trigrams of a folded entity name. A name of n
+ * characters has n trigrams, counting one at each end that includes the
+ * start or end of the name.
+ *
+ * Input:
+ *   key   - the folded name
+ *   len   - the length of the name
+ *   grams - an array of MAX_ENTITY elements to receive the trigrams
+ *
+ * Returns: the number of distinct trigrams
+ */
+static size_t knowledge_grams(const char *key, size_t len, uint32_t *grams) {
+    size_t ngrams = 0;
+    for (size_t i = 0; i < len; i++) {
+        // the trigram centred on character i, never 0
+        uint32_t before = i == 0 ? 0 : (unsigned char) key[i - 1];
+        uint32_t after = i + 1 == len ? 0 : (unsigned char) key[i + 1];
+        uint32_t gram = 1U << 24 | before << 16 | (uint32_t) (unsigned char) key[i] << 8 | after;
+        size_t j = 0;
+        while (j < ngrams && grams[j] != gram) {
+            j++;
         }
-        // replace newline with null to prevent double newline when write
-        *strchr(tokenptr,'\n') = '\0';
-        snprintf(responsebuf, MAX_RESPONSE,"%s",tokenptr);
-        int success = knowledge_put(intentkey, entitybuf, responsebuf);
-        if (success != KB_OK) {
-            return success;
+        if (j == ngrams) {
+            grams[ngrams++] = gram;
         }
-        // clear buffer
-        memset(entitybuf, 0, sizeof entitybuf);
-        memset(responsebuf, 0, sizeof entitybuf);
-        count++;
     }
-    return count;
+    return ngrams;
 }
 
+
 /*
- * Reset the knowledge base, removing all know entitities from all intents.
+ * Find the slot for a trigram in the trigram index: the slot holding it, or
+ * the empty slot where it would go.
  */
-void knowledge_reset() {
-	// free all nodes in linked-list and reset head & tail
-	EntityNode *current = head;
-    EntityNode *next;
-	while (current != NULL){
-	   next = current->next;
-	   memset(current,0, sizeof(EntityNode));
-	   free(current);
-	   current = next;
-	}
-	head = NULL;
-	tail = NULL;
+static Gram *knowledge_gram_slot(Gram *grams, size_t nslots, uint32_t gram) {
+    size_t slot = (gram * 2654435761U) & (nslots - 1);
+    while (grams[slot].gram != 0 && grams[slot].gram != gram) {
+        slot = (slot + 1) & (nslots - 1);
+    }
+    return &grams[slot];
 }
 
 
 /*
- * Write the knowledge base to a file.
+ * Add an entity to the list for a trigram, adding the trigram to the index
+ * if it is new. The index is doubled whenever it would be more than 3/4 full.
  *
  * Input:
- *   f - the file
+ *   kb   - the version of the knowledge base
+ *   gram - the trigram
+ *   id   - the entity's id
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
  */
-void knowledge_write(FILE *f) {
-	EntityNode *current = head;
-    fprintf(f,"[what]\n");
-    // traverse linked-list to print for what
-    while (current != NULL){
-        // node has response for what
-        if (current->what[0] != '\0'){
-            // no need \n as response alr has \n
-            fprintf(f,"%s=%s\n",current->entity,current->what);
-        }
-        current = current->next;
-    }
-    // reset current to start of linked-list
-    current = head;
-    // \n at start to create visual spacing between sections
-    fprintf(f,"\n[where]\n");
-    // traverse linked-list to print for where
-    while (current != NULL){
-        // node has response for where
-        if (current->where[0] != '\0'){
-            // no need \n as response alr has \n
-            fprintf(f,"%s=%s\n",current->entity,current->where);
-        }
-        current = current->next;
-    }
-    // reset current to start of linked-list
-    current = head;
-    // \n at start to create visual spacing between sections
-    fprintf(f,"\n[who]\n");
-    // traverse linked-list to print for who
-    while (current != NULL){
-        // node has response for what
-        if (current->who[0] != '\0'){
-            // no need \n as response alr has \n
-            fprintf(f,"%s=%s\n",current->entity,current->who);
-        }
-        current = current->next;
+static int knowledge_gram_add(Knowledge *kb, uint32_t gram, uint32_t id) {
+    if ((kb->ngrams + 1) * 4 > kb->ngramslots * 3) {
+        size_t nslots = kb->ngramslots == 0 ? KB_MIN_BUCKETS : kb->ngramslots * 2;
+        Gram *grams = calloc(nslots, sizeof(Gram));
+        if (grams == NULL) {
+            return KB_NOMEM;
+        }
+        for (size_t i = 0; i < kb->ngramslots; i++) {
+            if (kb->grams[i].gram != 0) {
+                *knowledge_gram_slot(grams, nslots, kb->grams[i].gram) = kb->grams[i];
+            }
+        }
+        free(kb->grams);
+        kb->grams = grams;
+        kb->ngramslots = nslots;
     }
-    // fclose to be handled by caller function
+    Gram *found = knowledge_gram_slot(kb->grams, kb->ngramslots, gram);
+    if (found->gram == 0) {
+        found->gram = gram;
+        kb->ngrams++;
+    }
+    if (found->nids == found->size) {
+        uint32_t size = found->size == 0 ? 4 : found->size * 2;
+        uint32_t *ids = realloc(found->ids, size * sizeof(uint32_t));
+        if (ids == NULL) {
+            return KB_NOMEM;
+        }
+        found->ids = ids;
+        found->size = size;
+    }
+    found->ids[found->nids++] = id;
+    return KB_OK;
+}
+
+
+/*
+ * Add the entities added since the last call to the trigram index.
+ *
+ * Input:
+ *   kb - the version of the knowledge base
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure, in
+ *          which case some names may be left out of the index
+ */
+static int knowledge_gram_index(Knowledge *kb) {
+    int result = KB_OK;
+    uint32_t grams[MAX_ENTITY];
+    for (; kb->grammed < kb->nentities; kb->grammed++) {
+        const EntityNode *node = kb->nodes[kb->grammed];
+        size_t ngrams = knowledge_grams(node->key, node->keylen, grams);
+        for (size_t i = 0; i < ngrams; i++) {
+            if (knowledge_gram_add(kb, grams[i], node->id) != KB_OK) {
+                result = KB_NOMEM;
+            }
+        }
+    }
+    return result;
+}
+
+
+/*
+ * Find the column for a question word.
+ *
+ * Input:
+ *   kb     - the version of the knowledge base
+ *   intent - the question word; case is ignored
+ *
+ * Returns: the column, or NULL if the knowledge base has none for the word
+ */
+static Column *knowledge_column(const Knowledge *kb, const char *intent) {
+    size_t len = strnlen(intent, MAX_INTENT);
+    for (size_t i = 0; i < kb->ncolumns; i++) {
+        Column *column = &kb->columns[i];
+        if (token_equal(column->name, column->namelen, intent, len)) {
+            return column;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Find the column for a question word, adding an empty one if there is
+ * none. Adding a column makes the word a question if it can be one (see
+ * knowledge_is_question()); a heading that cannot keeps its column all the
+ * same, so that the section is saved again, but is never asked.
+ *
+ * Input:
+ *   kb     - the version of the knowledge base
+ *   intent - the question word; case is ignored
+ *   column - receives the column
+ *
+ * Returns:
+ *   KB_OK, if the column was found or added
+ *   KB_INVALID, if the word is longer than MAX_INTENT - 1 characters
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int knowledge_column_add(Knowledge *kb, const char *intent, Column **column) {
+    *column = knowledge_column(kb, intent);
+    if (*column != NULL) {
+        return KB_OK;
+    }
+    if (strnlen(intent, MAX_INTENT) == MAX_INTENT) {
+        return KB_INVALID;
+    }
+    Column *columns = realloc(kb->columns, (kb->ncolumns + 1) * sizeof(Column));
+    if (columns == NULL) {
+        return KB_NOMEM;
+    }
+    kb->columns = columns;
+    Column *added = &columns[kb->ncolumns++];
+    memset(added, 0, sizeof(Column));
+    // the name fits, as checked above
+    while (intent[added->namelen] != '\0') {
+        added->name[added->namelen] = (char) tolower((unsigned char) intent[added->namelen]);
+        added->namelen++;
+    }
+    *column = added;
+    return KB_OK;
+}
+
+
+/*
+ * Determine whether a word is a question in a version of the knowledge
+ * base: either one of the chatbot's question words (see
+ * chatbot_is_question()), or a word the knowledge base has a column for that
+ * selects no other intent.
+ *
+ * Input:
+ *   kb     - the version of the knowledge base
+ *   intent - the word; case is ignored
+ *
+ * Returns: 1 if the word is a question, 0 otherwise
+ */
+static int knowledge_is_question(const Knowledge *kb, const char *intent) {
+    const Intent *found = intent_find(intent);
+    if (found != NULL) {
+        return found->kind == INTENT_QUESTION;
+    }
+    return knowledge_column(kb, intent) != NULL;
+}
+
+
+/*
+ * Determine whether a word can become a question when it is taught, i.e.
+ * it is a single word that selects no intent but a question.
+ *
+ * Input:
+ *   intent - the word
+ *
+ * Returns:
+ *   KB_OK, if the word can be a question
+ *   KB_INVALID, otherwise
+ */
+static int knowledge_question_word(const char *intent) {
+    const Intent *found = intent_find(intent);
+    if (found != NULL) {
+        return found->kind == INTENT_QUESTION ? KB_OK : KB_INVALID;
+    }
+    if (*intent == '\0') {
+        return KB_INVALID;
+    }
+    for (const char *c = intent; *c != '\0'; c++) {
+        if (isspace((unsigned char) *c)) {
+            return KB_INVALID;
+        }
+    }
+    return KB_OK;
+}
+
+
+/*
+ * Hash an entity id to its first slot in a column's index.
+ */
+static size_t knowledge_slot(uint32_t id, size_t nslots) {
+    return (size_t) ((id * 2654435761U) & (nslots - 1));
+}
+
+
+/*
+ * Find the row holding an entity's response in a column.
+ *
+ * Input:
+ *   column - the column
+ *   id     - the entity's id
+ *
+ * Returns: the row, or column->nrows if the column has no row for the entity
+ */
+static size_t knowledge_row(const Column *column, uint32_t id) {
+    if (column->nslots == 0) {
+        return column->nrows;
+    }
+    for (size_t slot = knowledge_slot(id, column->nslots);; slot = (slot + 1) & (column->nslots - 1)) {
+        const ColumnSlot *found = &column->slots[slot];
+        if (found->row == 0) {
+            return column->nrows;
+        }
+        if (found->id == id) {
+            return found->row - 1;
+        }
+    }
+}
+
+
+/*
+ * Make room for more rows in a column.
+ *
+ * Input:
+ *   column - the column
+ *   extra  - the number of rows to make room for
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+static int knowledge_column_reserve(Column *column, size_t extra) {
+    size_t need = column->nrows + extra;
+    if (need <= column->size) {
+        return KB_OK;
+    }
+    size_t size = column->size == 0 ? KB_MIN_SLOTS : column->size * 2;
+    while (size < need) {
+        size *= 2;
+    }
+    uint32_t *entities = realloc(column->entities, size * sizeof(uint32_t));
+    if (entities == NULL) {
+        return KB_NOMEM;
+    }
+    column->entities = entities;
+    const char **responses = realloc(column->responses, size * sizeof(const char *));
+    if (responses == NULL) {
+        return KB_NOMEM;
+    }
+    column->responses = responses;
+    uint16_t *lengths = realloc(column->lengths, size * sizeof(uint16_t));
+    if (lengths == NULL) {
+        return KB_NOMEM;
+    }
+    column->lengths = lengths;
+    column->size = size;
+    return KB_OK;
+}
+
+
+/*
+ * Hash a word folded to lower case (FNV-1a). Only ASCII letters are folded,
+ * as token_equal() does.
+ */
+static uint32_t knowledge_word_hash(const char *word, size_t len) {
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) word[i];
+        hash = (hash ^ (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c)) * 16777619U;
+    }
+    return hash;
+}
+
+
+/*
+ * Find a word in a column's inverted index.
+ *
+ * Input:
+ *   column - the column
+ *   word   - the word, which need not be null-terminated; case is ignored
+ *   len    - the number of characters in word
+ *   hash   - the hash of the word, from knowledge_word_hash()
+ *
+ * Returns: the word's term, or NULL if no response in the column has used it
+ */
+static Term *knowledge_term(const Column *column, const char *word, size_t len, uint32_t hash) {
+    if (column->ntermslots == 0) {
+        return NULL;
+    }
+    for (size_t slot = hash & (column->ntermslots - 1);; slot = (slot + 1) & (column->ntermslots - 1)) {
+        uint32_t found = column->termslots[slot];
+        if (found == 0) {
+            return NULL;
+        }
+        Term *term = &column->terms[found - 1];
+        if (term->hash == hash && token_equal(term->word, term->len, word, len)) {
+            return term;
+        }
+    }
+}
+
+
+/*
+ * Find a word in a column's inverted index, adding it if it is not there.
+ * The index of words is doubled whenever it would be more than 3/4 full.
+ *
+ * Input:
+ *   column, word, len, hash - as knowledge_term(); word must live as long
+ *                             as the knowledge base
+ *
+ * Returns: the word's term, or NULL if there was a memory allocation failure
+ */
+static Term *knowledge_term_add(Column *column, const char *word, size_t len, uint32_t hash) {
+    Term *term = knowledge_term(column, word, len, hash);
+    if (term != NULL) {
+        return term;
+    }
+    if (column->nterms == column->termsize) {
+        size_t size = column->termsize == 0 ? KB_MIN_SLOTS : column->termsize * 2;
+        Term *terms = realloc(column->terms, size * sizeof(Term));
+        if (terms == NULL) {
+            return NULL;
+        }
+        column->terms = terms;
+        column->termsize = size;
+    }
+    if ((column->nterms + 1) * 4 > column->ntermslots * 3) {
+        size_t nslots = column->ntermslots == 0 ? KB_MIN_SLOTS : column->ntermslots * 2;
+        uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+        if (slots == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < column->nterms; i++) {
+            size_t slot = column->terms[i].hash & (nslots - 1);
+            while (slots[slot] != 0) {
+                slot = (slot + 1) & (nslots - 1);
+            }
+            slots[slot] = (uint32_t) i + 1;
+        }
+        free(column->termslots);
+        column->termslots = slots;
+        column->ntermslots = nslots;
+    }
+    term = &column->terms[column->nterms++];
+    term->word = word;
+    term->len = (uint32_t) len;
+    term->hash = hash;
+    term->postings = NULL;
+    term->npostings = 0;
+    term->size = 0;
+    size_t slot = hash & (column->ntermslots - 1);
+    while (column->termslots[slot] != 0) {
+        slot = (slot + 1) & (column->ntermslots - 1);
+    }
+    column->termslots[slot] = (uint32_t) column->nterms;
+    return term;
+}
+
+
+/*
+ * Split a response (or a query) into words, hashing each and counting the
+ * uses of each distinct word. The first use of a word keeps its place and
+ * gets the count; later uses get 0.
+ *
+ * Input:
+ *   text   - the text, null-terminated
+ *   words  - an array to receive the words
+ *   hashes - an array to receive the hash of each word
+ *   counts - an array to receive the counts
+ *   max    - the number of elements in each array
+ *
+ * Returns: the number of words, at most max
+ */
+static size_t knowledge_words(const char *text, Token *words, uint32_t *hashes, uint32_t *counts, size_t max) {
+    size_t nwords = token_split(text, strlen(text), words, max);
+    if (nwords > max) {
+        nwords = max;
+    }
+    for (size_t i = 0; i < nwords; i++) {
+        hashes[i] = knowledge_word_hash(words[i].start, words[i].len);
+        counts[i] = 1;
+        for (size_t j = 0; j < i; j++) {
+            if (counts[j] != 0 && hashes[j] == hashes[i]
+                    && token_equal(words[j].start, words[j].len, words[i].start, words[i].len)) {
+                counts[j]++;
+                counts[i] = 0;
+                break;
+            }
+        }
+    }
+    return nwords;
+}
+
+
+/*
+ * Take the response in a row out of its column's inverted index, e.g.
+ * before it is replaced.
+ *
+ * Input:
+ *   column - the column
+ *   row    - the row, which must have been added with knowledge_search_add()
+ */
+static void knowledge_search_remove(Column *column, size_t row) {
+    const char *response = column->responses[row];
+    if (response == NULL || column->lengths[row] == KB_UNSEARCHED) {
+        return;
+    }
+    // a response is at most MAX_RESPONSE - 1 characters, so this holds every word
+    Token words[MAX_RESPONSE / 2];
+    uint32_t hashes[MAX_RESPONSE / 2];
+    uint32_t counts[MAX_RESPONSE / 2];
+    size_t nwords = knowledge_words(response, words, hashes, counts, MAX_RESPONSE / 2);
+    for (size_t i = 0; i < nwords; i++) {
+        Term *term = counts[i] == 0 ? NULL : knowledge_term(column, words[i].start, words[i].len, hashes[i]);
+        if (term == NULL) {
+            continue;
+        }
+        for (uint32_t p = 0; p < term->npostings; p++) {
+            if (term->postings[p].row == row) {
+                term->postings[p] = term->postings[--term->npostings];
+                break;
+            }
+        }
+    }
+    column->nwords -= column->lengths[row];
+    column->ndocs--;
+}
+
+
+/*
+ * Add the response in a row to its column's inverted index.
+ *
+ * Input:
+ *   column - the column
+ *   row    - the row
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure, in
+ *          which case the response is left out of the index
+ */
+static int knowledge_search_add(Column *column, size_t row) {
+    const char *response = column->responses[row];
+    if (response == NULL) {
+        return KB_OK;
+    }
+    Token words[MAX_RESPONSE / 2];
+    uint32_t hashes[MAX_RESPONSE / 2];
+    uint32_t counts[MAX_RESPONSE / 2];
+    size_t nwords = knowledge_words(response, words, hashes, counts, MAX_RESPONSE / 2);
+    column->lengths[row] = (uint16_t) nwords;
+    column->nwords += nwords;
+    column->ndocs++;
+    for (size_t i = 0; i < nwords; i++) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        Term *term = knowledge_term_add(column, words[i].start, words[i].len, hashes[i]);
+        if (term != NULL && term->npostings == term->size) {
+            uint32_t size = term->size == 0 ? 4 : term->size * 2;
+            Posting *postings = realloc(term->postings, size * sizeof(Posting));
+            if (postings != NULL) {
+                column->npostings += size - term->size;
+                term->postings = postings;
+                term->size = size;
+            }
+        }
+        if (term == NULL || term->npostings == term->size) {
+            // take back the words already added
+            knowledge_search_remove(column, row);
+            column->lengths[row] = KB_UNSEARCHED;
+            return KB_NOMEM;
+        }
+        term->postings[term->npostings].row = (uint32_t) row;
+        term->postings[term->npostings].count = counts[i];
+        term->npostings++;
+    }
+    return KB_OK;
+}
+
+
+/*
+ * Append a row to a column without indexing it, for a bulk load. If the
+ * entity already has a row, knowledge_column_index() folds the new row into
+ * it. Appended rows are not seen by lookups until then.
+ *
+ * Input:
+ *   column   - the column, with room reserved for the row
+ *   id       - the entity's id
+ *   response - the response, or NULL
+ */
+static void knowledge_column_append(Column *column, uint32_t id, const char *response) {
+    column->entities[column->nrows] = id;
+    column->responses[column->nrows] = response;
+    column->nrows++;
+}
+
+
+/*
+ * Index the rows appended to a column, growing the index until it would be
+ * no more than 3/4 full; it is rebuilt at most once. An appended row for an
+ * entity that already has a row is folded into the earlier row, as if the
+ * rows had been set one at a time, so the last response given wins. A
+ * response folded into a row already in the inverted index replaces it
+ * there too; new rows are left for knowledge_column_search().
+ *
+ * Input:
+ *   column - the column
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure, in
+ *          which case the appended rows are dropped, or some responses are
+ *          left out of the inverted index
+ */
+static int knowledge_column_index(Column *column) {
+    if (column->nrows * 4 > column->nslots * 3) {
+        size_t nslots = column->nslots == 0 ? KB_MIN_SLOTS : column->nslots * 2;
+        while (column->nrows * 4 > nslots * 3) {
+            nslots *= 2;
+        }
+        ColumnSlot *slots = calloc(nslots, sizeof(ColumnSlot));
+        if (slots == NULL) {
+            column->nrows = column->indexed;
+            return KB_NOMEM;
+        }
+        for (size_t i = 0; i < column->indexed; i++) {
+            size_t slot = knowledge_slot(column->entities[i], nslots);
+            while (slots[slot].row != 0) {
+                slot = (slot + 1) & (nslots - 1);
+            }
+            slots[slot].id = column->entities[i];
+            slots[slot].row = (uint32_t) i + 1;
+        }
+        free(column->slots);
+        column->slots = slots;
+        column->nslots = nslots;
+    }
+    // move each new row down over any folded into an earlier one
+    int result = KB_OK;
+    size_t first = column->indexed;
+    size_t kept = first;
+    for (size_t i = first; i < column->nrows; i++) {
+        uint32_t id = column->entities[i];
+        size_t slot = knowledge_slot(id, column->nslots);
+        while (column->slots[slot].row != 0 && column->slots[slot].id != id) {
+            slot = (slot + 1) & (column->nslots - 1);
+        }
+        if (column->slots[slot].row != 0) {
+            size_t row = column->slots[slot].row - 1;
+            int searched = row < column->searched;
+            if (searched) {
+                knowledge_search_remove(column, row);
+            }
+            column->responses[row] = column->responses[i];
+            if (searched && knowledge_search_add(column, row) != KB_OK) {
+                result = KB_NOMEM;
+            }
+            continue;
+        }
+        column->entities[kept] = id;
+        column->responses[kept] = column->responses[i];
+        kept++;
+        column->slots[slot].id = id;
+        column->slots[slot].row = (uint32_t) kept;
+    }
+    column->nrows = kept;
+    column->indexed = kept;
+    return result;
+}
+
+
+/*
+ * Add the rows indexed since the last call to a column's inverted index. A
+ * bulk load calls this once it has indexed all of its rows (see
+ * knowledge_search_index()), so a file loaded in pieces is searched once.
+ *
+ * Input:
+ *   column - the column
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure, in
+ *          which case some responses are left out of the inverted index
+ */
+static int knowledge_column_search(Column *column) {
+    int result = KB_OK;
+    for (; column->searched < column->indexed; column->searched++) {
+        if (knowledge_search_add(column, column->searched) != KB_OK) {
+            result = KB_NOMEM;
+        }
+    }
+    return result;
+}
+
+
+/*
+ * Set an entity's response in a column, adding a row for the entity if it
+ * has none. No row is added just to hold NULL.
+ *
+ * Input:
+ *   column   - the column
+ *   id       - the entity's id
+ *   response - the response, which must live as long as the knowledge base,
+ *              or NULL to take the response away
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+static int knowledge_column_set(Column *column, uint32_t id, const char *response) {
+    size_t row = knowledge_row(column, id);
+    if (row < column->nrows) {
+        int searched = row < column->searched;
+        if (searched) {
+            knowledge_search_remove(column, row);
+        }
+        column->responses[row] = response;
+        return searched ? knowledge_search_add(column, row) : KB_OK;
+    }
+    if (response == NULL) {
+        return KB_OK;
+    }
+    if (knowledge_column_reserve(column, 1) != KB_OK) {
+        return KB_NOMEM;
+    }
+    knowledge_column_append(column, id, response);
+    if (knowledge_column_index(column) != KB_OK) {
+        return KB_NOMEM;
+    }
+    return knowledge_column_search(column);
+}
+
+
+/*
+ * Copy a response into the arena, truncating it to MAX_RESPONSE - 1 characters.
+ *
+ * Input:
+ *   kb       - the version of the knowledge base
+ *   response - the response, which need not be null-terminated
+ *   n        - the maximum number of characters to read from response
+ *
+ * Returns: the copy, or NULL if there was a memory allocation failure
+ */
+static const char *knowledge_store(Knowledge *kb, const char *response, size_t n) {
+    if (n > MAX_RESPONSE - 1) {
+        n = MAX_RESPONSE - 1;
+    }
+    return arena_strndup(&kb->arena, response, strnlen(response, n));
+}
+
+
+/*
+ * Get the response to a question.
+ *
+ * Input:
+ *   ctx      - the knowledge base
+ *   intent   - the question word
+ *   entity   - the entity
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
+ *   KB_NOTFOUND, if no response could be found
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ */
+int knowledge_get_ctx(KBContext *ctx, const char *intent, const char *entity, char *response, int n) {
+	uint64_t traced = trace_start();
+	Knowledge *kb = knowledge_acquire(ctx);
+	if (kb == NULL) {
+	    trace_span("knowledge_get", entity, traced);
+	    return KB_NOMEM;
+	}
+	if (!knowledge_is_question(kb, intent)){
+	    knowledge_release(ctx, kb);
+	    trace_span("knowledge_get", entity, traced);
+	    return KB_INVALID;
+	}
+	// valid question, look up the folded entity in the hash index
+	char key[MAX_ENTITY];
+	size_t len;
+	unsigned long hash = knowledge_fold(entity, MAX_ENTITY, key, &len);
+	int result = KB_NOTFOUND;
+	// no column means nothing has been taught for the question word yet
+	const Column *column = knowledge_column(kb, intent);
+	EntityNode *current = column == NULL ? NULL : knowledge_find(kb, key, len, hash);
+	if (current != NULL) {
+        // check if intent has corresponding response
+        size_t row = knowledge_row(column, current->id);
+        if (row < column->nrows && column->responses[row] != NULL) {
+            snprintf(response, n, "%s", column->responses[row]);
+            result = KB_OK;
+        }
+    }
+	knowledge_release(ctx, kb);
+	metrics_count(result == KB_OK ? METRIC_HITS : METRIC_MISSES);
+	trace_span("knowledge_get", entity, traced);
+	return result;
+}
+
+
+/*
+ * Get the response to a question from the chatbot's knowledge base, as
+ * knowledge_get_ctx().
+ */
+int knowledge_get(const char *intent, const char *entity, char *response, int n) {
+	return knowledge_get_ctx(&defaults, intent, entity, response, n);
+}
+
+
+/*
+ * Determine whether a word is a question in a knowledge base: one of the
+ * chatbot's question words, or the heading of a section loaded into it (see
+ * knowledge_is_question()).
+ *
+ * Input:
+ *   ctx    - the knowledge base
+ *   intent - the word; case is ignored
+ *
+ * Returns: 1 if the word is a question, 0 otherwise
+ */
+int knowledge_is_question_ctx(KBContext *ctx, const char *intent) {
+	Knowledge *kb = knowledge_acquire(ctx);
+	if (kb == NULL) {
+	    return chatbot_is_question(intent);
+	}
+	int question = knowledge_is_question(kb, intent);
+	knowledge_release(ctx, kb);
+	return question;
+}
+
+
+/*
+ * Answer up to KB_BATCH questions from one version of the knowledge base.
+ * The questions go through each step of a lookup together: every bucket is
+ * requested before any is read, then every node, and so on, so their cache
+ * misses overlap rather than each waiting for the last.
+ *
+ * Input:
+ *   kb      - the version, acquired by the caller
+ *   queries - the questions
+ *   count   - the number of questions, at most KB_BATCH
+ *
+ * Returns: the number of questions answered
+ */
+static size_t knowledge_get_batch(const Knowledge *kb, KBQuery *queries, size_t count) {
+    char keys[KB_BATCH][MAX_ENTITY];
+    size_t lens[KB_BATCH];
+    unsigned long hashes[KB_BATCH];
+    const Column *columns[KB_BATCH];
+    EntityNode *nodes[KB_BATCH];
+    size_t rows[KB_BATCH];
+    const char *intent = NULL;
+    const Column *column = NULL;
+    int result = KB_INVALID;
+
+    // fold and hash the names, and request their buckets
+    for (size_t i = 0; i < count; i++) {
+        KBQuery *query = &queries[i];
+        // batches usually ask one question of many entities
+        if (query->intent != intent) {
+            intent = query->intent;
+            result = knowledge_is_question(kb, intent) ? KB_NOTFOUND : KB_INVALID;
+            column = result == KB_INVALID ? NULL : knowledge_column(kb, intent);
+        }
+        query->result = result;
+        columns[i] = column;
+        nodes[i] = NULL;
+        if (column == NULL || kb->nbuckets == 0) {
+            continue;
+        }
+        hashes[i] = knowledge_fold(query->entity, MAX_ENTITY, keys[i], &lens[i]);
+        KB_PREFETCH(&kb->buckets[hashes[i] & (kb->nbuckets - 1)]);
+    }
+    // request the first node in each bucket
+    for (size_t i = 0; i < count; i++) {
+        if (columns[i] != NULL && kb->nbuckets != 0) {
+            nodes[i] = kb->buckets[hashes[i] & (kb->nbuckets - 1)];
+            KB_PREFETCH(nodes[i]);
+        }
+    }
+    // request the name of each node, which is compared in the next step
+    for (size_t i = 0; i < count; i++) {
+        if (nodes[i] != NULL) {
+            KB_PREFETCH(nodes[i]->key);
+        }
+    }
+    // follow the chains, and request each entity's slot in the column's index
+    for (size_t i = 0; i < count; i++) {
+        nodes[i] = knowledge_chain(nodes[i], keys[i], lens[i], hashes[i]);
+        if (nodes[i] != NULL && columns[i]->nslots != 0) {
+            KB_PREFETCH(&columns[i]->slots[knowledge_slot(nodes[i]->id, columns[i]->nslots)]);
+        }
+    }
+    // find the rows, and request the responses
+    for (size_t i = 0; i < count; i++) {
+        rows[i] = nodes[i] == NULL ? 0 : knowledge_row(columns[i], nodes[i]->id);
+        if (nodes[i] != NULL && rows[i] < columns[i]->nrows) {
+            KB_PREFETCH(&columns[i]->responses[rows[i]]);
+        }
+    }
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+        KBQuery *query = &queries[i];
+        if (nodes[i] != NULL && rows[i] < columns[i]->nrows && columns[i]->responses[rows[i]] != NULL) {
+            snprintf(query->response, query->n, "%s", columns[i]->responses[rows[i]]);
+            query->result = KB_OK;
+            found++;
+        }
+        if (query->result != KB_INVALID) {
+            metrics_count(query->result == KB_OK ? METRIC_HITS : METRIC_MISSES);
+        }
+    }
+    return found;
+}
+
+
+/*
+ * Get the responses to many questions at once. This gives the same answers
+ * as calling knowledge_get_ctx() for each question, but looks them up a
+ * batch at a time (see knowledge_get_batch()), which is faster when there
+ * are many questions and the knowledge base does not fit in the cache.
+ *
+ * Input:
+ *   ctx     - the knowledge base
+ *   queries - the questions; each one's result is set as knowledge_get()
+ *             would return it, and its response buffer is filled if KB_OK
+ *   count   - the number of questions
+ *
+ * Returns: the number of questions answered
+ */
+size_t knowledge_get_many_ctx(KBContext *ctx, KBQuery *queries, size_t count) {
+    uint64_t traced = trace_start();
+    size_t found = 0;
+    for (size_t i = 0; i < count; i += KB_BATCH) {
+        size_t batch = count - i < KB_BATCH ? count - i : KB_BATCH;
+        // the lock is taken for each batch, so teaching need not wait for all of them
+        Knowledge *kb = knowledge_acquire(ctx);
+        if (kb == NULL) {
+            for (; i < count; i++) {
+                queries[i].result = KB_NOMEM;
+            }
+            break;
+        }
+        found += knowledge_get_batch(kb, queries + i, batch);
+        knowledge_release(ctx, kb);
+    }
+    trace_span("knowledge_get_many", NULL, traced);
+    return found;
+}
+
+
+/*
+ * Get the responses to many questions from the chatbot's knowledge base, as
+ * knowledge_get_many_ctx().
+ */
+size_t knowledge_get_many(KBQuery *queries, size_t count) {
+    return knowledge_get_many_ctx(&defaults, queries, count);
+}
+
+
+/*
+ * Release a thread's search scores when the thread exits.
+ */
+static void knowledge_scores_free(void *arg) {
+    free(arg);
+}
+
+static void knowledge_scores_init() {
+    pthread_key_create(&scores_key, knowledge_scores_free);
+}
+
+
+/*
+ * Get an empty table for the scores of up to count entities, followed by
+ * room for extra more, reusing this thread's table from its last search
+ * when it is big enough.
+ *
+ * Input:
+ *   count - the most entities that can be scored
+ *   extra - the number of scores to leave room for after the table
+ *
+ * Returns: the number of slots in the table, a power of two, or 0 if there
+ *          was a memory allocation failure
+ */
+static size_t knowledge_scores(size_t count, size_t extra) {
+    size_t size = KB_MIN_SLOTS;
+    while (size < count * 2) {
+        size *= 2;
+    }
+    if (size + extra > nscores) {
+        pthread_once(&scores_once, knowledge_scores_init);
+        SearchScore *grown = realloc(scores, (size + extra) * sizeof(SearchScore));
+        if (grown == NULL) {
+            return 0;
+        }
+        scores = grown;
+        nscores = size + extra;
+        pthread_setspecific(scores_key, scores);
+    }
+    memset(scores, 0, size * sizeof(SearchScore));
+    return size;
+}
+
+
+/*
+ * Determine whether one search score ranks below another: a lower score, or
+ * the same score for an entity added later.
+ */
+static int knowledge_score_below(const SearchScore *a, const SearchScore *b) {
+    return a->score < b->score || (a->score == b->score && a->id > b->id);
+}
+
+
+/*
+ * Restore the heap order of the k best scores so far, whose worst is at the
+ * top, after the score at i has been replaced.
+ */
+static void knowledge_score_sift(SearchScore *heap, int k, int i) {
+    for (;;) {
+        int worst = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < k && knowledge_score_below(&heap[left], &heap[worst])) {
+            worst = left;
+        }
+        if (right < k && knowledge_score_below(&heap[right], &heap[worst])) {
+            worst = right;
+        }
+        if (worst == i) {
+            return;
+        }
+        SearchScore swap = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = swap;
+        i = worst;
+    }
+}
+
+
+/*
+ * Find the entities whose responses best match some words, ranked by BM25:
+ * each column scores its rows on their own, and an entity's score is the sum
+ * of its rows' scores. Only the inverted index is read, so a search costs
+ * the number of rows using the words rather than the size of the knowledge
+ * base.
+ *
+ * Input:
+ *   ctx   - the knowledge base
+ *   query - the words to look for; case and order are ignored
+ *   hits  - an array to receive the entities, best first
+ *   k     - the number of elements in hits
+ *
+ * Returns: the number of entities found, at most k, or KB_NOMEM if there
+ *          was a memory allocation failure
+ */
+int knowledge_search_ctx(KBContext *ctx, const char *query, KBHit *hits, int k) {
+    uint64_t traced = trace_start();
+    Token words[KB_SEARCH_WORDS];
+    uint32_t counts[KB_SEARCH_WORDS];
+    uint32_t hashes[KB_SEARCH_WORDS];
+    // a word given twice counts once
+    size_t nwords = knowledge_words(query, words, hashes, counts, KB_SEARCH_WORDS);
+    Knowledge *kb = knowledge_acquire(ctx);
+    if (kb == NULL) {
+        trace_span("knowledge_search", query, traced);
+        return KB_NOMEM;
+    }
+
+    // every row using a word may score an entity
+    size_t rows = 0;
+    for (size_t c = 0; c < kb->ncolumns; c++) {
+        for (size_t w = 0; w < nwords; w++) {
+            const Term *term = counts[w] == 0 ? NULL
+                    : knowledge_term(&kb->columns[c], words[w].start, words[w].len, hashes[w]);
+            rows += term == NULL ? 0 : term->npostings;
+        }
+    }
+    size_t size = rows == 0 || k <= 0 ? 0 : knowledge_scores(rows, (size_t) k);
+    if (size == 0) {
+        knowledge_release(ctx, kb);
+        trace_span("knowledge_search", query, traced);
+        return rows == 0 || k <= 0 ? 0 : KB_NOMEM;
+    }
+    for (size_t c = 0; c < kb->ncolumns; c++) {
+        const Column *column = &kb->columns[c];
+        if (column->ndocs == 0) {
+            continue;
+        }
+        double average = (double) column->nwords / column->ndocs;
+        for (size_t w = 0; w < nwords; w++) {
+            const Term *term = counts[w] == 0 ? NULL : knowledge_term(column, words[w].start, words[w].len, hashes[w]);
+            if (term == NULL || term->npostings == 0) {
+                continue;
+            }
+            double idf = log(1.0 + (column->ndocs - term->npostings + 0.5) / (term->npostings + 0.5));
+            for (uint32_t p = 0; p < term->npostings; p++) {
+                const Posting *posting = &term->postings[p];
+                double tf = posting->count;
+                double norm = 1.0 - KB_BM25_B + KB_BM25_B * column->lengths[posting->row] / average;
+                uint32_t id = column->entities[posting->row];
+                size_t slot = (size_t) ((id * 2654435761U) & (size - 1));
+                while (scores[slot].id != 0 && scores[slot].id != id + 1) {
+                    slot = (slot + 1) & (size - 1);
+                }
+                scores[slot].id = id + 1;
+                scores[slot].score += (float) (idf * tf * (KB_BM25_K1 + 1.0) / (tf + KB_BM25_K1 * norm));
+            }
+        }
+    }
+
+    // keep the best k in a heap after the table, whose worst is at the top
+    SearchScore *heap = scores + size;
+    int found = 0;
+    for (size_t slot = 0; slot < size; slot++) {
+        if (scores[slot].id == 0) {
+            continue;
+        }
+        if (found < k) {
+            heap[found++] = scores[slot];
+            for (int i = found / 2 - 1; found == k && i >= 0; i--) {
+                knowledge_score_sift(heap, k, i);
+            }
+        }
+        else if (knowledge_score_below(&heap[0], &scores[slot])) {
+            heap[0] = scores[slot];
+            knowledge_score_sift(heap, k, 0);
+        }
+    }
+    if (found < k) {
+        for (int i = found / 2 - 1; i >= 0; i--) {
+            knowledge_score_sift(heap, found, i);
+        }
+    }
+    // take the worst off the top until the heap is empty, filling hits from the end
+    for (int n = found; n > 0; n--) {
+        hits[n - 1].score = heap[0].score;
+        snprintf(hits[n - 1].entity, MAX_ENTITY, "%s", kb->nodes[heap[0].id - 1]->entity);
+        heap[0] = heap[n - 1];
+        knowledge_score_sift(heap, n - 1, 0);
+    }
+    knowledge_release(ctx, kb);
+    trace_span("knowledge_search", query, traced);
+    return found;
+}
+
+
+/*
+ * Search the chatbot's knowledge base, as knowledge_search_ctx().
+ */
+int knowledge_search(const char *query, KBHit *hits, int k) {
+    return knowledge_search_ctx(&defaults, query, hits, k);
+}
+
+
+/*
+ * Find an entity in the list for a trigram, starting from a cursor that only
+ * moves forward, so that looking up entities in order of id reads the list
+ * once. The cursor is left at the first entity not before the one sought.
+ *
+ * Input:
+ *   gram   - the trigram's list
+ *   cursor - the position in the list to start from
+ *   id     - the entity's id
+ *
+ * Returns: 1 if the entity is in the list, 0 if not
+ */
+static int knowledge_gram_seek(const Gram *gram, size_t *cursor, uint32_t id) {
+    // gallop forward to bracket the id, then search the bracket
+    size_t low = *cursor;
+    size_t step = 1;
+    while (low + step < gram->nids && gram->ids[low + step] < id) {
+        low += step;
+        step *= 2;
+    }
+    size_t high = low + step < gram->nids ? low + step : gram->nids;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (gram->ids[middle] < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *cursor = low;
+    return low < gram->nids && gram->ids[low] == id;
+}
+
+
+/*
+ * Determine the edit distance between two folded names, giving up once it
+ * is certain to exceed a limit.
+ *
+ * Input:
+ *   a, alen - the first name and its length
+ *   b, blen - the second name and its length
+ *   limit   - the largest distance of interest
+ *
+ * Returns: the number of characters that must be inserted, deleted or
+ *          replaced to turn one name into the other, or limit + 1 if that
+ *          is more than limit
+ */
+static int knowledge_distance(const char *a, size_t alen, const char *b, size_t blen, int limit) {
+    int rows[2][MAX_ENTITY];
+    int *previous = rows[0];
+    int *current = rows[1];
+    for (size_t j = 0; j <= blen; j++) {
+        previous[j] = (int) j;
+    }
+    for (size_t i = 1; i <= alen; i++) {
+        current[0] = (int) i;
+        int best = current[0];
+        for (size_t j = 1; j <= blen; j++) {
+            int cost = previous[j - 1] + (a[i - 1] != b[j - 1]);
+            if (previous[j] + 1 < cost) {
+                cost = previous[j] + 1;
+            }
+            if (current[j - 1] + 1 < cost) {
+                cost = current[j - 1] + 1;
+            }
+            current[j] = cost;
+            if (cost < best) {
+                best = cost;
+            }
+        }
+        // the distance never falls below the best of a row
+        if (best > limit) {
+            return limit + 1;
+        }
+        int *swap = previous;
+        previous = current;
+        current = swap;
+    }
+    return previous[blen] > limit ? limit + 1 : previous[blen];
+}
+
+
+/*
+ * Get the response to a question about the known entity nearest to one
+ * that is not known, such as a name with a typo in it. A name of fewer than
+ * four characters has no near neighbours; otherwise one within an edit
+ * distance of one, or of two for names of eight characters or more, is
+ * accepted, the nearest first and then the one taught first.
+ *
+ * The candidates come from the trigram index: a single edit changes at most
+ * KB_GRAM of a name's trigrams, so only the entities in the lists of its
+ * rarest few trigrams can be near it, and only those sharing enough of the
+ * rest are checked.
+ *
+ * Input:
+ *   ctx      - the knowledge base
+ *   intent   - the question word
+ *   entity   - the entity that was not found
+ *   nearest  - a buffer of MAX_ENTITY characters to receive the nearest entity
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a near entity with a response was found (both are copied to their buffers)
+ *   KB_NOTFOUND, if no entity is near enough
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_get_near_ctx(KBContext *ctx, const char *intent, const char *entity, char *nearest, char *response, int n) {
+    char key[MAX_ENTITY];
+    size_t len;
+    knowledge_fold(entity, MAX_ENTITY, key, &len);
+    int limit = len < 4 ? 0 : len < 8 ? 1 : 2;
+    uint64_t traced = trace_start();
+    Knowledge *kb = knowledge_acquire(ctx);
+    if (kb == NULL) {
+        trace_span("knowledge_get_near", entity, traced);
+        return KB_NOMEM;
+    }
+    int result = knowledge_is_question(kb, intent) ? KB_NOTFOUND : KB_INVALID;
+    if (result == KB_INVALID || limit == 0) {
+        knowledge_release(ctx, kb);
+        trace_span("knowledge_get_near", entity, traced);
+        return result;
+    }
+    const Column *column = knowledge_column(kb, intent);
+    uint32_t grams[MAX_ENTITY];
+    const Gram *lists[MAX_ENTITY];
+    size_t ngrams = column == NULL || kb->ngrams == 0 ? 0 : knowledge_grams(key, len, grams);
+    for (size_t g = 0; g < ngrams; g++) {
+        // rarest first, an unknown trigram has an empty list
+        const Gram *list = knowledge_gram_slot(kb->grams, kb->ngramslots, grams[g]);
+        size_t i = g;
+        for (; i > 0 && lists[i - 1]->nids > list->nids; i--) {
+            lists[i] = lists[i - 1];
+        }
+        lists[i] = list;
+    }
+
+    // an entity within the limit shares all but KB_GRAM of the trigrams for
+    // each edit, so it is in at least one of the lists for the rarest few
+    size_t shared = ngrams > (size_t) (KB_GRAM * limit) ? ngrams - KB_GRAM * limit : 1;
+    size_t rarest = ngrams + 1 - shared;
+    size_t cursors[MAX_ENTITY] = {0};
+    const EntityNode *best = NULL;
+    size_t bestrow = 0;
+    int distance = limit;
+    while (ngrams > 0 && (best == NULL || distance > 0)) {
+        // merge the rarest lists, taking each entity in them once, in order of id
+        uint32_t id = UINT32_MAX;
+        for (size_t g = 0; g < rarest; g++) {
+            if (cursors[g] < lists[g]->nids && lists[g]->ids[cursors[g]] < id) {
+                id = lists[g]->ids[cursors[g]];
+            }
+        }
+        if (id == UINT32_MAX) {
+            break;
+        }
+        size_t count = 0;
+        for (size_t g = 0; g < rarest; g++) {
+            if (cursors[g] < lists[g]->nids && lists[g]->ids[cursors[g]] == id) {
+                cursors[g]++;
+                count++;
+            }
+        }
+        // count the rest of the shared trigrams, giving up once too few are left
+        for (size_t g = rarest; g < ngrams && count + (ngrams - g) >= shared; g++) {
+            count += knowledge_gram_seek(lists[g], &cursors[g], id);
+        }
+        const EntityNode *node = kb->nodes[id];
+        if (count < shared || node->keylen + limit < len || node->keylen > len + limit) {
+            continue;
+        }
+        // the first entity found at a distance beats later ones at the same distance
+        int within = best == NULL ? distance : distance - 1;
+        int d = knowledge_distance(node->key, node->keylen, key, len, within);
+        if (d > within) {
+            continue;
+        }
+        size_t row = knowledge_row(column, node->id);
+        if (row < column->nrows && column->responses[row] != NULL) {
+            distance = d;
+            best = node;
+            bestrow = row;
+        }
+    }
+    if (best != NULL) {
+        snprintf(nearest, MAX_ENTITY, "%s", best->entity);
+        snprintf(response, n, "%s", column->responses[bestrow]);
+        result = KB_OK;
+    }
+    knowledge_release(ctx, kb);
+    trace_span("knowledge_get_near", entity, traced);
+    return result;
+}
+
+
+/*
+ * Answer a question about the entity nearest to an unknown one from the
+ * chatbot's knowledge base, as knowledge_get_near_ctx().
+ */
+int knowledge_get_near(const char *intent, const char *entity, char *nearest, char *response, int n) {
+    return knowledge_get_near_ctx(&defaults, intent, entity, nearest, response, n);
+}
+
+
+/*
+ * Insert a new response to a question. If a response already exists for the
+ * given intent and entity, it will be overwritten. Otherwise, it will be added
+ * to the knowledge base. A question word the knowledge base has not seen
+ * before becomes a question.
+ *
+ * Only the chatbot's own knowledge base is journaled (see journal.c).
+ *
+ * Input:
+ *   ctx       - the knowledge base
+ *   intent    - the question word
+ *   entity    - the entity
+ *   response  - the response for this question and entity
+ *
+ * Returns:
+ *   KB_FOUND, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent cannot be a question word (see knowledge_question_word())
+ *   F_INVALID, if the response was stored but could not be journaled
+ */
+int knowledge_put_ctx(KBContext *ctx, const char *intent, const char *entity, const char *response) {
+	Knowledge *kb = knowledge_lock(ctx);
+	if (kb == NULL) {
+	    return KB_NOMEM;
+	}
+	int result = knowledge_put_span(kb, intent, entity, MAX_ENTITY, response, MAX_RESPONSE);
+	// record the fact in the journal, if one is attached, in the same order
+	// as it was applied
+	int journaled = ctx == &defaults;
+	if (result == KB_OK && journaled) {
+	    result = journal_append(intent, entity, response);
+	}
+	knowledge_unlock(ctx, kb);
+	// fsync outside the lock so readers never wait on the disk
+	if (result == KB_OK && journaled) {
+	    result = journal_commit();
+	}
+	return result;
+}
+
+
+/*
+ * Insert a new response to a question into the chatbot's knowledge base, as
+ * knowledge_put_ctx().
+ */
+int knowledge_put(const char *intent, const char *entity, const char *response) {
+	return knowledge_put_ctx(&defaults, intent, entity, response);
+}
+
+
+/*
+ * Insert a new response to a question, as knowledge_put(), taking the entity
+ * and response as character spans that need not be null-terminated. This lets
+ * knowledge_read() insert straight from the file buffer without copying lines.
+ *
+ * Input:
+ *   kb        - the version of the knowledge base
+ *   intent    - the question word
+ *   entity    - the entity
+ *   elen      - the maximum number of characters to read from entity
+ *   response  - the response for this question and entity
+ *   rlen      - the maximum number of characters to read from response
+ *
+ * Returns: as knowledge_put()
+ */
+static int knowledge_put_span(Knowledge *kb, const char *intent, const char *entity, size_t elen,
+                              const char *response, size_t rlen) {
+	// invalid question word, or a new one that gets a column of its own
+	Column *column;
+	int result = knowledge_question_word(intent);
+	if (result == KB_OK) {
+	    result = knowledge_column_add(kb, intent, &column);
+	}
+	if (result != KB_OK) {
+	    return result;
+	}
+	return knowledge_insert(kb, column, entity, elen, response, rlen, 0);
+}
+
+
+/*
+ * Insert a new response into a column, as knowledge_put_span(), once the
+ * column has been found.
+ *
+ * Input:
+ *   kb        - the version of the knowledge base
+ *   column    - the column for the question word
+ *   entity    - the entity
+ *   elen      - the maximum number of characters to read from entity
+ *   response  - the response for this question and entity
+ *   rlen      - the maximum number of characters to read from response
+ *   bulk      - 1 to append the response for knowledge_column_index(), in
+ *               which case room must have been reserved for the entity and
+ *               the row; 0 to set it at once
+ *
+ * Returns: as knowledge_put()
+ */
+static int knowledge_insert(Knowledge *kb, Column *column, const char *entity, size_t elen,
+                            const char *response, size_t rlen, int bulk) {
+	// fold the entity once and look it up in the hash index
+	char key[MAX_ENTITY];
+	size_t len;
+	unsigned long hash = knowledge_fold(entity, elen, key, &len);
+	EntityNode *current = knowledge_find(kb, key, len, hash);
+    // copy the response first so a failure leaves the knowledge base untouched,
+    // an empty response is stored as NULL so it reads back as not found
+    const char *copy = NULL;
+    if (rlen > 0 && response[0] != '\0'){
+        copy = knowledge_store(kb, response, rlen);
+        if (copy == NULL){
+            return KB_NOMEM;
+        }
+    }
+    // target entity does not exist, create one and add to linked-list
+    if (current == NULL){
+        // grow the index before linking so a failure leaves the list untouched
+        if (knowledge_reserve(kb, 1) != KB_OK){
+            return KB_NOMEM;
+        }
+        EntityNode *target = arena_alloc(&kb->arena, sizeof(EntityNode));
+        if (target == NULL){
+            return KB_NOMEM;
+        }
+        target->entity = arena_strndup(&kb->arena, entity, len);
+        if (target->entity == NULL){
+            return KB_NOMEM;
+        }
+        // share the name with the key when it is already folded
+        if (memcmp(target->entity, key, len) == 0){
+            target->key = target->entity;
+        }
+        else{
+            target->key = arena_strndup(&kb->arena, key, len);
+            if (target->key == NULL){
+                return KB_NOMEM;
+            }
+        }
+        target->keylen = len;
+        target->hash = hash;
+        knowledge_link(kb, target);
+        current = target;
+    }
+    // set response, an overwritten response stays in the arena until reset
+    if (bulk) {
+        knowledge_column_append(column, current->id, copy);
+        return KB_OK;
+    }
+    // a bulk load indexes the names once it is done (see knowledge_search_index())
+    int result = knowledge_column_set(column, current->id, copy);
+    return result == KB_OK ? knowledge_gram_index(kb) : result;
+}
+
+
+/*
+ * Find the end of a line of a file held in memory.
+ *
+ * Input:
+ *   line - the start of the line
+ *   end  - the end of the buffer
+ *   eol  - receives the end of the line, before any "\r\n" or "\n"
+ *
+ * Returns: the start of the next line
+ */
+static const char *knowledge_line(const char *line, const char *end, const char **eol) {
+    // find the end of the line without copying it
+    const char *nl = memchr(line, '\n', end - line);
+    const char *next = nl == NULL ? end : nl + 1;
+    *eol = nl == NULL ? end : nl;
+    if (*eol > line && (*eol)[-1] == '\r') {
+        (*eol)--;
+    }
+    return next;
+}
+
+
+/*
+ * Copy the question word out of a section heading.
+ *
+ * Input:
+ *   line      - the heading, starting with '['
+ *   eol       - the end of the line
+ *   intentkey - a buffer of MAX_INTENT characters to receive the word
+ *
+ * Returns:
+ *   KB_OK, if the word was copied
+ *   F_INVALID, if the heading has no closing ']' or names no word
+ */
+static int knowledge_heading(const char *line, const char *eol, char *intentkey) {
+    const char *tmp = memchr(line, ']', eol - line);
+    if (tmp == NULL || tmp == line + 1) {
+        return F_INVALID;
+    }
+    size_t length = tmp - line - 1;
+    if (length >= MAX_INTENT) {
+        length = MAX_INTENT - 1;
+    }
+    memcpy(intentkey, line + 1, length);
+    intentkey[length] = '\0';
+    return KB_OK;
+}
+
+
+/* a section of an INI file, counted before it is loaded */
+typedef struct {
+    char intent[MAX_INTENT];
+    size_t count;               /* the number of entity/response pairs under the heading */
+} ParsedSection;
+
+
+/*
+ * Parse a knowledge base held in memory, inserting each entity/response pair
+ * directly from the buffer. Lines may be of any length and may end in "\n" or
+ * "\r\n".
+ *
+ * The buffer is read twice. The first pass checks every line and counts the
+ * pairs in each section, without changing anything, so a file with a bad
+ * line is rejected before any of it is loaded. The entities and
+ * the rows of each column are then given room up front, and the second pass
+ * appends the pairs in the order they appear without indexing them; each
+ * column's index is built once at the end, and a later pair for the same
+ * question and entity replaces an earlier one, as if they had been put one at
+ * a time. Apart from what is loaded, the parse needs memory only for a count
+ * of each section.
+ *
+ * Input:
+ *   kb  - the version of the knowledge base
+ *   buf - the contents of the file
+ *   len - the number of characters in buf
+ *
+ * Returns: as knowledge_read()
+ */
+static int knowledge_parse(Knowledge *kb, const char *buf, size_t len) {
+    const char *end = buf + len;
+    const char *eol;
+    ParsedSection *sections = NULL;
+    size_t nsections = 0;
+    size_t total = 0;           /* the number of pairs in every section */
+    int result = KB_OK;
+
+    // first pass: check and count
+    for (const char *line = buf, *next; line < end && result == KB_OK; line = next) {
+        next = knowledge_line(line, end, &eol);
+        if (line[0] == '[') {
+            // process section heading
+            ParsedSection *grown = realloc(sections, (nsections + 1) * sizeof(ParsedSection));
+            if (grown == NULL) {
+                result = KB_NOMEM;
+                break;
+            }
+            sections = grown;
+            result = knowledge_heading(line, eol, sections[nsections].intent);
+            sections[nsections++].count = 0;
+        }
+        // skip blank lines
+        else if (eol > line && !isspace((unsigned char) line[0])) {
+            if (memchr(line, '=', eol - line) == NULL) {
+                result = F_INVALID;
+            }
+            else if (nsections == 0) {
+                // a pair before any heading has no question word
+                result = KB_INVALID;
+            }
+            else {
+                total++;
+                sections[nsections - 1].count++;
+            }
+        }
+    }
+
+    // each pair adds at most one entity
+    if (result == KB_OK) {
+        result = knowledge_reserve(kb, total);
+    }
+    for (size_t i = 0; i < nsections && result == KB_OK; i++) {
+        Column *column;
+        if (sections[i].count > 0) {
+            result = knowledge_column_add(kb, sections[i].intent, &column);
+        }
+    }
+    // only once every column is added, since adding one may move the others;
+    // a heading may appear more than once, in any case, so each column makes
+    // room for the pairs of every section that shares it
+    for (size_t i = 0; i < nsections && result == KB_OK; i++) {
+        Column *column = sections[i].count == 0 ? NULL : knowledge_column(kb, sections[i].intent);
+        size_t rows = 0;
+        for (size_t j = 0; j < nsections && column != NULL; j++) {
+            Column *shared = sections[j].count == 0 ? NULL : knowledge_column(kb, sections[j].intent);
+            if (shared == column && j < i) {
+                // already reserved along with an earlier section
+                column = NULL;
+            }
+            else if (shared == column) {
+                rows += sections[j].count;
+            }
+        }
+        if (column != NULL) {
+            result = knowledge_column_reserve(column, rows);
+        }
+    }
+    free(sections);
+    if (result != KB_OK) {
+        return result;
+    }
+
+    // second pass: insert, leaving the columns to be indexed at the end
+    int count = 0;
+    char intentkey[MAX_INTENT];
+    Column *column = NULL;
+    for (const char *line = buf, *next; line < end && count >= 0; line = next) {
+        next = knowledge_line(line, end, &eol);
+        if (line[0] == '[') {
+            // every heading was checked in the first pass
+            knowledge_heading(line, eol, intentkey);
+            column = knowledge_column(kb, intentkey);
+        }
+        else if (eol > line && !isspace((unsigned char) line[0])) {
+            const char *eq = memchr(line, '=', eol - line);
+            // the response is everything after the first =
+            int success = knowledge_insert(kb, column, line, eq - line, eq + 1, eol - eq - 1, 1);
+            count = success == KB_OK ? count + 1 : success;
+        }
+    }
+    // index what was inserted, even after a failure, so every row is found
+    for (size_t i = 0; i < kb->ncolumns; i++) {
+        if (knowledge_column_index(&kb->columns[i]) != KB_OK) {
+            count = KB_NOMEM;
+        }
+    }
+    return count;
+}
+
+
+/*
+ * Add a block of memory to a running snapshot checksum (FNV-1a over 64-bit
+ * words). Blocks may be of any length; the result only depends on the
+ * concatenated bytes.
+ *
+ * Input:
+ *   ck  - the checksum state
+ *   buf - the memory
+ *   len - the number of bytes in buf
+ */
+static void knowledge_checksum(Checksum *ck, const char *buf, size_t len) {
+    // top up a partial word left over from the previous block
+    while (ck->npending > 0 && ck->npending < 8 && len > 0) {
+        ck->pending[ck->npending++] = *buf++;
+        len--;
+    }
+    if (ck->npending == 8) {
+        uint64_t word;
+        memcpy(&word, ck->pending, 8);
+        ck->sum = (ck->sum ^ word) * 1099511628211ULL;
+        ck->npending = 0;
+    }
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        ck->sum = (ck->sum ^ word) * 1099511628211ULL;
+    }
+    memcpy(ck->pending + ck->npending, buf, len);
+    ck->npending += len;
+}
+
+
+/*
+ * Finish a snapshot checksum.
+ *
+ * Input:
+ *   ck - the checksum state
+ *
+ * Returns: the checksum
+ */
+static uint64_t knowledge_checksum_final(Checksum *ck) {
+    for (size_t i = 0; i < ck->npending; i++) {
+        ck->sum = (ck->sum ^ ck->pending[i]) * 1099511628211ULL;
+    }
+    ck->npending = 0;
+    return ck->sum;
+}
+
+
+/*
+ * Find the node for an entity from a snapshot, adding one that points into
+ * the snapshot if the knowledge base does not have the entity yet.
+ *
+ * Input:
+ *   kb     - the version of the knowledge base
+ *   entity - the entity's name, in the snapshot
+ *   key    - the folded name, in the snapshot
+ *   keylen - the length of the folded name
+ *   hash   - the hash of the folded name
+ *
+ * Returns: the node, or NULL if there was a memory allocation failure
+ */
+static EntityNode *knowledge_merge(Knowledge *kb, const char *entity, const char *key, size_t keylen,
+                                   unsigned long hash) {
+    EntityNode *current = knowledge_find(kb, key, keylen, hash);
+    if (current != NULL) {
+        return current;
+    }
+    if (knowledge_reserve(kb, 1) != KB_OK) {
+        return NULL;
+    }
+    current = arena_alloc(&kb->arena, sizeof(EntityNode));
+    if (current == NULL) {
+        return NULL;
+    }
+    current->entity = entity;
+    current->key = key;
+    current->keylen = keylen;
+    current->hash = hash;
+    knowledge_link(kb, current);
+    return current;
+}
+
+
+/*
+ * Check a string in a snapshot before the knowledge base points at it. The
+ * checksum only guards against damage, so a file crafted to pass it must
+ * still not send a lookup outside the snapshot.
+ *
+ * Input:
+ *   strings - the snapshot's strings
+ *   ns      - the number of bytes in strings
+ *   offset  - the offset of the string
+ *   max     - the size of the buffer the string must fit in, with its null
+ *
+ * Returns: the length of the string, or -1 if it does not start and end
+ *          within the strings or is too long
+ */
+static long knowledge_snapshot_string(const char *strings, uint64_t ns, uint64_t offset, size_t max) {
+    if (offset >= ns) {
+        return -1;
+    }
+    size_t room = ns - offset < max ? (size_t) (ns - offset) : max;
+    size_t len = strnlen(strings + offset, room);
+    return len == room ? -1 : (long) len;
+}
+
+
+/*
+ * Check an entity record of a snapshot: its name, and its folded name, which
+ * must be keylen characters long.
+ */
+static int knowledge_snapshot_entity(const char *strings, uint64_t ns, uint64_t entity, uint64_t key,
+                                     uint64_t keylen) {
+    return knowledge_snapshot_string(strings, ns, entity, MAX_ENTITY) >= 0
+           && knowledge_snapshot_string(strings, ns, key, MAX_ENTITY) == (long) keylen;
+}
+
+
+/*
+ * Load a version 1 snapshot, whose entities hold their own what, where and
+ * who responses, by merging each entity into the knowledge base. The caller
+ * has checked the header and the checksum.
+ *
+ * Input:
+ *   kb  - the version of the knowledge base
+ *   buf - the contents of the file, aligned to 8 bytes
+ *   len - the number of bytes in buf
+ *
+ * Returns: as knowledge_read()
+ */
+static int knowledge_parse_snapshot_v1(Knowledge *kb, const char *buf, size_t len) {
+    static const char *intents[] = {"what", "where", "who"};
+    const SnapshotHeader *header = (const SnapshotHeader *) buf;
+    uint64_t n = header->nentities;
+    uint64_t nb = header->nbuckets;
+    uint64_t ns = header->nstrings;
+    if (n > len / sizeof(SnapshotEntityV1) || nb > len / sizeof(uint32_t)
+            || sizeof(SnapshotHeader) + n * sizeof(SnapshotEntityV1) + nb * sizeof(uint32_t) + ns != len) {
+        return F_INVALID;
+    }
+    const SnapshotEntityV1 *records = (const SnapshotEntityV1 *) (buf + sizeof(SnapshotHeader));
+    const char *strings = (const char *) records + n * sizeof(SnapshotEntityV1) + nb * sizeof(uint32_t);
+    for (uint64_t i = 0; i < n; i++) {
+        const SnapshotEntityV1 *r = &records[i];
+        if (!knowledge_snapshot_entity(strings, ns, r->entity, r->key, r->keylen)
+                || (r->what != SNAPSHOT_NOSTR && knowledge_snapshot_string(strings, ns, r->what, MAX_RESPONSE) < 0)
+                || (r->where != SNAPSHOT_NOSTR && knowledge_snapshot_string(strings, ns, r->where, MAX_RESPONSE) < 0)
+                || (r->who != SNAPSHOT_NOSTR && knowledge_snapshot_string(strings, ns, r->who, MAX_RESPONSE) < 0)) {
+            return F_INVALID;
+        }
+    }
+    Column *columns[3];
+    for (int j = 0; j < 3; j++) {
+        int result = knowledge_column_add(kb, intents[j], &columns[j]);
+        if (result != KB_OK) {
+            return result;
+        }
+    }
+    // adding a column may move the others
+    for (int j = 0; j < 3; j++) {
+        columns[j] = knowledge_column(kb, intents[j]);
+    }
+    if (knowledge_reserve(kb, n) != KB_OK) {
+        return KB_NOMEM;
+    }
+
+    int count = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        const SnapshotEntityV1 *r = &records[i];
+        EntityNode *current = knowledge_merge(kb, strings + r->entity, strings + r->key, r->keylen,
+                                              (unsigned long) r->hash);
+        if (current == NULL) {
+            return KB_NOMEM;
+        }
+        const uint64_t responses[] = {r->what, r->where, r->who};
+        for (int j = 0; j < 3; j++) {
+            if (responses[j] == SNAPSHOT_NOSTR) {
+                continue;
+            }
+            if (knowledge_column_set(columns[j], current->id, strings + responses[j]) != KB_OK) {
+                return KB_NOMEM;
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+
+/*
+ * Load a binary snapshot held in memory. The knowledge base points straight
+ * into the buffer, so the caller must keep it until knowledge_reset().
+ *
+ * When the knowledge base is empty, the snapshot's prebuilt hash index is
+ * adopted as-is. Otherwise each entity is merged using its stored hash, with
+ * the snapshot's responses replacing existing ones.
+ *
+ * Input:
+ *   kb  - the version of the knowledge base
+ *   buf - the contents of the file, aligned to 8 bytes
+ *   len - the number of bytes in buf
+ *
+ * Returns: as knowledge_read()
+ */
+static int knowledge_parse_snapshot(Knowledge *kb, const char *buf, size_t len) {
+    const SnapshotHeader *header = (const SnapshotHeader *) buf;
+    if (len < sizeof(SnapshotHeader) || (header->version != SNAPSHOT_VERSION && header->version != 1)) {
+        return F_INVALID;
+    }
+    uint64_t ns = header->nstrings;
+    if (ns > len || (ns > 0 && buf[len - 1] != '\0') || (header->nbuckets & (header->nbuckets - 1)) != 0) {
+        return F_INVALID;
+    }
+    Checksum ck = {14695981039346656037ULL};
+    knowledge_checksum(&ck, buf + sizeof(SnapshotHeader), len - sizeof(SnapshotHeader));
+    if (knowledge_checksum_final(&ck) != header->checksum) {
+        return F_INVALID;
+    }
+    if (header->version == 1) {
+        return knowledge_parse_snapshot_v1(kb, buf, len);
+    }
+
+    // check the sections add up to the file size before touching them
+    uint64_t n = header->nentities;
+    uint64_t nb = header->nbuckets;
+    uint64_t nc = header->ncolumns;
+    uint64_t nr = header->nrows;
+    if (n > len / sizeof(SnapshotEntity) || nb > len / sizeof(uint32_t) || nc > len / sizeof(SnapshotColumn)
+            || nr > len / sizeof(SnapshotRow)
+            || sizeof(SnapshotHeader) + n * sizeof(SnapshotEntity) + nb * sizeof(uint32_t)
+               + nc * sizeof(SnapshotColumn) + nr * sizeof(SnapshotRow) + ns != len) {
+        return F_INVALID;
+    }
+    const SnapshotEntity *records = (const SnapshotEntity *) (buf + sizeof(SnapshotHeader));
+    const uint32_t *heads = (const uint32_t *) (records + n);
+    const SnapshotColumn *columns = (const SnapshotColumn *) (heads + nb);
+    const SnapshotRow *rows = (const SnapshotRow *) (columns + nc);
+    const char *strings = (const char *) (rows + nr);
+    // check everything before the knowledge base is changed; a chain only
+    // leads to entities written before, so it cannot loop
+    for (uint64_t i = 0; i < n; i++) {
+        const SnapshotEntity *r = &records[i];
+        if (!knowledge_snapshot_entity(strings, ns, r->entity, r->key, r->keylen)
+                || (r->chain != SNAPSHOT_NONE && r->chain >= i)) {
+            return F_INVALID;
+        }
+    }
+    for (uint64_t i = 0; i < nr; i++) {
+        if (rows[i].entity >= n || knowledge_snapshot_string(strings, ns, rows[i].response, MAX_RESPONSE) < 0) {
+            return F_INVALID;
+        }
+    }
+    for (uint64_t c = 0; c < nc; c++) {
+        if (columns[c].first > nr || columns[c].nrows > nr - columns[c].first
+                || knowledge_snapshot_string(strings, ns, columns[c].name, MAX_INTENT) < 0) {
+            return F_INVALID;
+        }
+    }
+
+    int adopt = kb->nentities == 0 && nb >= KB_MIN_BUCKETS && n * 4 <= nb * 3;
+    EntityNode **map;
+    if (adopt) {
+        // reuse the stored chains, nothing needs to be hashed or searched
+        EntityNode **table = calloc(nb, sizeof(EntityNode *));
+        EntityNode **list = malloc((n > KB_MIN_BUCKETS ? n : KB_MIN_BUCKETS) * sizeof(EntityNode *));
+        EntityNode *nodes = arena_alloc(&kb->arena, n * sizeof(EntityNode) + 1);
+        if (table == NULL || list == NULL || nodes == NULL) {
+            free(table);
+            free(list);
+            return KB_NOMEM;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            const SnapshotEntity *r = &records[i];
+            EntityNode *current = &nodes[i];
+            current->entity = strings + r->entity;
+            current->key = strings + r->key;
+            current->keylen = r->keylen;
+            current->hash = (unsigned long) r->hash;
+            current->id = (uint32_t) i;
+            current->chain = r->chain == SNAPSHOT_NONE ? NULL : &nodes[r->chain];
+            list[i] = current;
+        }
+        for (uint64_t i = 0; i < nb; i++) {
+            table[i] = heads[i] == SNAPSHOT_NONE || heads[i] >= n ? NULL : &nodes[heads[i]];
+        }
+        free(kb->nodes);
+        free(kb->buckets);
+        kb->nodes = list;
+        kb->size = n > KB_MIN_BUCKETS ? n : KB_MIN_BUCKETS;
+        kb->nentities = n;
+        kb->buckets = table;
+        kb->nbuckets = nb;
+        map = list;
+    }
+    else {
+        // merge each entity, noting which node it became
+        map = malloc(n * sizeof(EntityNode *) + 1);
+        if (map == NULL || knowledge_reserve(kb, n) != KB_OK) {
+            free(map);
+            return KB_NOMEM;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            const SnapshotEntity *r = &records[i];
+            map[i] = knowledge_merge(kb, strings + r->entity, strings + r->key, r->keylen, (unsigned long) r->hash);
+            if (map[i] == NULL) {
+                free(map);
+                return KB_NOMEM;
+            }
+        }
+    }
+
+    int count = KB_OK;
+    for (uint64_t c = 0; c < nc && count >= 0; c++) {
+        Column *column;
+        if (knowledge_column_add(kb, strings + columns[c].name, &column) != KB_OK
+                || knowledge_column_reserve(column, columns[c].nrows) != KB_OK) {
+            count = KB_NOMEM;
+            break;
+        }
+        const SnapshotRow *row = &rows[columns[c].first];
+        for (uint64_t i = 0; i < columns[c].nrows; i++, row++) {
+            knowledge_column_append(column, map[row->entity]->id, strings + row->response);
+        }
+        count = knowledge_column_index(column) == KB_OK ? count + (int) columns[c].nrows : KB_NOMEM;
+    }
+    if (!adopt) {
+        free(map);
+    }
+    return count;
+}
+
+
+/*
+ * Read a knowledge base from a file. The file may be in INI format or a binary
+ * snapshot written by knowledge_write_snapshot(); snapshots are recognised by
+ * their magic number.
+ *
+ * Regular files are memory-mapped and parsed in place. Anything that cannot be
+ * mapped (e.g. a pipe) is read into memory first.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ *   f   - the file
+ *
+ * Returns: the number of entity/response pairs successful read from the file
+ */
+int knowledge_read_ctx(KBContext *ctx, FILE *f) {
+    uint64_t traced = trace_start();
+    uint64_t start = metrics_now();
+    int count = knowledge_read_file(ctx, f);
+    metrics_time(METRIC_READ, metrics_now() - start);
+    trace_span("knowledge_read", NULL, traced);
+    return count;
+}
+
+
+/*
+ * Read the chatbot's knowledge base from a file, as knowledge_read_ctx().
+ */
+int knowledge_read(FILE *f) {
+    return knowledge_read_ctx(&defaults, f);
+}
+
+
+/*
+ * Get the contents of a file in memory, for knowledge_read_ctx().
+ *
+ * Input:
+ *   f     - the file
+ *   count - receives 0 if the file is empty, or an error code if the file
+ *           could not be read
+ *
+ * Returns: the contents, or NULL if the file is empty or could not be read
+ */
+static Mapping *knowledge_map(FILE *f, int *count) {
+    *count = 0;
+    if(f == NULL){
+        *count = F_INVALID;
+        return NULL;
+    }
+    Mapping *m = malloc(sizeof(Mapping));
+    if (m == NULL) {
+        *count = KB_NOMEM;
+        return NULL;
+    }
+    m->addr = NULL;
+    struct stat st;
+    long offset = ftell(f);
+    if (offset == 0 && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            free(m);
+            return NULL;
+        }
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (map != MAP_FAILED) {
+            m->addr = map;
+            m->size = st.st_size;
+            m->mapped = 1;
+            fseek(f, 0, SEEK_END);
+        }
+    }
+    if (m->addr == NULL) {
+        // fall back to reading the whole stream into a growing buffer
+        size_t size = 0;
+        size_t capacity = 64 * 1024;
+        char *buf = malloc(capacity);
+        if (buf == NULL) {
+            free(m);
+            *count = KB_NOMEM;
+            return NULL;
+        }
+        size_t got;
+        while ((got = fread(buf + size, 1, capacity - size, f)) > 0) {
+            size += got;
+            if (size == capacity) {
+                char *bigger = realloc(buf, capacity * 2);
+                if (bigger == NULL) {
+                    free(buf);
+                    free(m);
+                    *count = KB_NOMEM;
+                    return NULL;
+                }
+                buf = bigger;
+                capacity *= 2;
+            }
+        }
+        m->addr = buf;
+        m->size = size;
+        m->mapped = 0;
+    }
+    return m;
+}
+
+
+/*
+ * Release the contents of a file got by knowledge_map().
+ */
+static void knowledge_unmap(Mapping *m) {
+    if (m->mapped) {
+        munmap(m->addr, m->size);
+    }
+    else {
+        free(m->addr);
+    }
+    free(m);
+}
+
+
+/*
+ * Load the contents of a file into a version of the knowledge base. A
+ * snapshot is kept for as long as the knowledge base points into it; an INI
+ * file is released once it has been parsed.
+ *
+ * Input:
+ *   kb - the version of the knowledge base, locked for a change
+ *   m  - the contents, from knowledge_map()
+ *
+ * Returns: as knowledge_read()
+ */
+static int knowledge_load(Knowledge *kb, Mapping *m) {
+    int count;
+    int snapshot = m->size >= sizeof(SnapshotHeader) && memcmp(m->addr, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC) == 0;
+    if (snapshot) {
+        count = knowledge_parse_snapshot(kb, m->addr, m->size);
+        // the knowledge base now points into the snapshot, keep it until
+        // reset; only F_INVALID is sure to come before anything points into
+        // it, e.g. a load that runs out of memory part way is kept as far as
+        // it got
+        if (count != F_INVALID) {
+            m->next = kb->mappings;
+            kb->mappings = m;
+            return count;
+        }
+    }
+    else {
+        if (m->mapped) {
+            madvise(m->addr, m->size, MADV_SEQUENTIAL);
+        }
+        count = knowledge_parse(kb, m->addr, m->size);
+    }
+    knowledge_unmap(m);
+    return count;
+}
+
+
+/*
+ * Bring the inverted index of every column, and the trigram index of the
+ * entity names, up to date after a bulk load.
+ *
+ * Input:
+ *   kb - the version of the knowledge base, locked for a change
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+static int knowledge_search_index(Knowledge *kb) {
+    int result = knowledge_gram_index(kb);
+    for (size_t c = 0; c < kb->ncolumns; c++) {
+        if (knowledge_column_search(&kb->columns[c]) != KB_OK) {
+            result = KB_NOMEM;
+        }
+    }
+    return result;
+}
+
+
+/*
+ * Read a knowledge base from a file, for knowledge_read_ctx().
+ */
+static int knowledge_read_file(KBContext *ctx, FILE *f) {
+    int count;
+    Mapping *m = knowledge_map(f, &count);
+    if (m == NULL) {
+        return count;
+    }
+    Knowledge *kb = knowledge_lock(ctx);
+    if (kb == NULL) {
+        knowledge_unmap(m);
+        return KB_NOMEM;
+    }
+    count = knowledge_load(kb, m);
+    if (count >= 0 && knowledge_search_index(kb) != KB_OK) {
+        count = KB_NOMEM;
+    }
+    knowledge_unlock(ctx, kb);
+    return count;
+}
+
+
+/*
+ * Move everything in one version of the knowledge base into another, as if
+ * the file it was loaded from had been loaded into the other: an entity the
+ * other already has keeps its number, and the responses moved in replace any
+ * it already had. Nothing is copied; the memory holding the nodes and
+ * strings changes hands, and the first version moved into an empty one is
+ * taken over whole.
+ *
+ * Input:
+ *   kb  - the version to move everything into, locked for a change
+ *   src - the version to take it from, left to be freed
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+static int knowledge_absorb(Knowledge *kb, Knowledge *src) {
+    // the nodes stay where they are, so take over what holds them first
+    arena_adopt(&kb->arena, &src->arena);
+    Mapping **link = &src->mappings;
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+    *link = kb->mappings;
+    kb->mappings = src->mappings;
+    src->mappings = NULL;
+
+    if (kb->nentities == 0 && kb->ncolumns == 0) {
+        // nothing to merge with, swap the index and columns
+        EntityNode **nodes = kb->nodes;
+        EntityNode **buckets = kb->buckets;
+        Column *columns = kb->columns;
+        Gram *grams = kb->grams;
+        size_t ngramslots = kb->ngramslots;
+        kb->nodes = src->nodes;
+        kb->size = src->size;
+        kb->nentities = src->nentities;
+        kb->buckets = src->buckets;
+        kb->nbuckets = src->nbuckets;
+        kb->columns = src->columns;
+        kb->ncolumns = src->ncolumns;
+        kb->grams = src->grams;
+        kb->ngrams = src->ngrams;
+        kb->ngramslots = src->ngramslots;
+        kb->grammed = src->grammed;
+        src->nodes = nodes;
+        src->buckets = buckets;
+        src->columns = columns;
+        src->ncolumns = 0;
+        src->grams = grams;
+        src->ngramslots = ngramslots;
+        return KB_OK;
+    }
+
+    // merge each entity using its cached hash, noting the number it gets
+    uint32_t *ids = malloc(src->nentities * sizeof(uint32_t) + 1);
+    if (ids == NULL || knowledge_reserve(kb, src->nentities) != KB_OK) {
+        free(ids);
+        return KB_NOMEM;
+    }
+    for (size_t i = 0; i < src->nentities; i++) {
+        EntityNode *node = src->nodes[i];
+        EntityNode *current = knowledge_find(kb, node->key, node->keylen, node->hash);
+        if (current == NULL) {
+            // a new entity, the node itself can be linked
+            knowledge_link(kb, node);
+            current = node;
+        }
+        ids[i] = current->id;
+    }
+    int result = KB_OK;
+    for (size_t c = 0; c < src->ncolumns && result == KB_OK; c++) {
+        const Column *from = &src->columns[c];
+        Column *column;
+        result = knowledge_column_add(kb, from->name, &column);
+        if (result == KB_OK) {
+            result = knowledge_column_reserve(column, from->nrows);
+        }
+        if (result == KB_OK) {
+            for (size_t i = 0; i < from->nrows; i++) {
+                knowledge_column_append(column, ids[from->entities[i]], from->responses[i]);
+            }
+            result = knowledge_column_index(column);
+        }
+    }
+    free(ids);
+    return result;
+}
+
+
+/* a file being read by knowledge_read_files() */
+typedef struct {
+    const char *filename;
+    Knowledge *kb;              /* the file's contents on their own */
+    int count;                  /* as knowledge_read() */
+} LoadJob;
+
+/* the files being read by knowledge_read_files(), shared by its workers */
+typedef struct {
+    LoadJob *jobs;
+    size_t njobs;
+    atomic_size_t next;         /* the next file for a worker to take */
+} LoadQueue;
+
+
+/*
+ * Read files into versions of their own for knowledge_read_files(), taking
+ * the next file in the queue until there are none left.
+ */
+static void *knowledge_read_worker(void *arg) {
+    LoadQueue *queue = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&queue->next, 1)) < queue->njobs) {
+        LoadJob *job = &queue->jobs[i];
+        uint64_t traced = trace_start();
+        job->kb = knowledge_new();
+        FILE *f = fopen(job->filename, "r");
+        if (job->kb == NULL) {
+            job->count = KB_NOMEM;
+        }
+        else if (f == NULL) {
+            job->count = KB_NOTFOUND;
+        }
+        else {
+            // no other thread can see the version, so it needs no lock
+            Mapping *m = knowledge_map(f, &job->count);
+            if (m != NULL) {
+                job->count = knowledge_load(job->kb, m);
+            }
+        }
+        if (f != NULL) {
+            fclose(f);
+        }
+        trace_span("knowledge_read_file", job->filename, traced);
+    }
+    return NULL;
+}
+
+
+/*
+ * Read a knowledge base from several files at once. The files are parsed in
+ * parallel and then merged in the order given, so the result is the same as
+ * reading them one after another with knowledge_read(): where two files
+ * answer the same question about the same entity, the later one wins.
+ * Nothing is merged unless every file could be read.
+ *
+ * Each file is parsed into a version of its own by one of up to nthreads
+ * workers (this thread being one), which take the files in turn, so a big
+ * file holds up only the worker reading it. Merging reuses everything the
+ * workers built, and costs a hash lookup for each entity and a copy of each
+ * row; the knowledge base is locked only while merging.
+ *
+ * Input:
+ *   ctx       - the knowledge base
+ *   filenames - the files, each in INI format or a snapshot
+ *   nfiles    - the number of files
+ *   nthreads  - the most threads to read with
+ *   failed    - receives the index of the first file that could not be
+ *               read, or -1
+ *
+ * Returns: the number of entity/response pairs read from all of the files,
+ *          or for the first file that could not be read, KB_NOTFOUND if it
+ *          could not be opened and otherwise as knowledge_read()
+ */
+int knowledge_read_files_ctx(KBContext *ctx, char *const filenames[], int nfiles, int nthreads, int *failed) {
+    uint64_t traced = trace_start();
+    uint64_t start = metrics_now();
+    *failed = -1;
+    LoadQueue queue = {calloc(nfiles > 0 ? nfiles : 1, sizeof(LoadJob)), nfiles};
+    pthread_t *threads = malloc((nthreads > 1 ? nthreads : 1) * sizeof(pthread_t));
+    if (queue.jobs == NULL || threads == NULL) {
+        free(queue.jobs);
+        free(threads);
+        return KB_NOMEM;
+    }
+    for (int i = 0; i < nfiles; i++) {
+        queue.jobs[i].filename = filenames[i];
+    }
+    atomic_init(&queue.next, 0);
+
+    // no more workers than files; if a thread cannot be started, the others
+    // take its share
+    int nstarted = 0;
+    while (nstarted + 1 < nthreads && nstarted + 1 < nfiles
+            && pthread_create(&threads[nstarted], NULL, knowledge_read_worker, &queue) == 0) {
+        nstarted++;
+    }
+    knowledge_read_worker(&queue);
+    for (int i = 0; i < nstarted; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    int count = 0;
+    for (int i = 0; i < nfiles && count >= 0; i++) {
+        if (queue.jobs[i].count < 0) {
+            *failed = i;
+            count = queue.jobs[i].count;
+        }
+        else {
+            count += queue.jobs[i].count;
+        }
+    }
+    if (count >= 0) {
+        Knowledge *kb = knowledge_lock(ctx);
+        if (kb == NULL) {
+            count = KB_NOMEM;
+        }
+        for (int i = 0; i < nfiles && kb != NULL; i++) {
+            if (knowledge_absorb(kb, queue.jobs[i].kb) != KB_OK) {
+                count = KB_NOMEM;
+                break;
+            }
+        }
+        // the files are searched together, once they are merged
+        if (kb != NULL && count >= 0 && knowledge_search_index(kb) != KB_OK) {
+            count = KB_NOMEM;
+        }
+        if (kb != NULL) {
+            knowledge_unlock(ctx, kb);
+        }
+    }
+    for (int i = 0; i < nfiles; i++) {
+        if (queue.jobs[i].kb != NULL) {
+            knowledge_free(queue.jobs[i].kb);
+        }
+    }
+    free(queue.jobs);
+    metrics_time(METRIC_READ, metrics_now() - start);
+    trace_span("knowledge_read_files", NULL, traced);
+    return count;
+}
+
+
+/*
+ * Read the chatbot's knowledge base from several files at once, as
+ * knowledge_read_files_ctx().
+ */
+int knowledge_read_files(char *const filenames[], int nfiles, int nthreads, int *failed) {
+    return knowledge_read_files_ctx(&defaults, filenames, nfiles, nthreads, failed);
+}
+
+
+/*
+ * Reset the knowledge base, removing all know entitities from all intents.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ */
+void knowledge_reset_ctx(KBContext *ctx) {
+	// swap in an empty version, the old one is freed once lookups finish with it
+	Knowledge *kb = knowledge_new();
+	if (kb == NULL) {
+	    return;
+	}
+	pthread_mutex_lock(&ctx->update);
+	knowledge_publish(ctx, kb);
+	pthread_mutex_unlock(&ctx->update);
+}
+
+
+/*
+ * Reset the chatbot's knowledge base, as knowledge_reset_ctx().
+ */
+void knowledge_reset() {
+	knowledge_reset_ctx(&defaults);
+}
+
+
+/*
+ * Start building a new version of the knowledge base off to the side. Until
+ * knowledge_end_ctx(), everything this thread loads or puts goes into the new
+ * version, which starts out empty. Lookups carry on with the current version
+ * and are never held up; changes from other threads wait, so none is lost in
+ * the swap. A thread builds one version at a time.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ *
+ * Returns:
+ *   KB_OK, if the new version was started
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_begin_ctx(KBContext *ctx) {
+    Knowledge *kb = knowledge_new();
+    if (kb == NULL) {
+        return KB_NOMEM;
+    }
+    pthread_mutex_lock(&ctx->update);
+    staging = kb;
+    staged = ctx;
+    return KB_OK;
+}
+
+
+/*
+ * Start building a new version of the chatbot's knowledge base, as
+ * knowledge_begin_ctx().
+ */
+int knowledge_begin() {
+    return knowledge_begin_ctx(&defaults);
+}
+
+
+/*
+ * Finish building a new version of the knowledge base started by
+ * knowledge_begin_ctx().
+ *
+ * Input:
+ *   ctx     - the knowledge base
+ *   publish - 1 to replace the current version with the new one in a single
+ *             step, 0 to throw the new version away
+ */
+void knowledge_end_ctx(KBContext *ctx, int publish) {
+    Knowledge *kb = staging;
+    staging = NULL;
+    staged = NULL;
+    if (publish) {
+        knowledge_publish(ctx, kb);
+    }
+    else {
+        knowledge_free(kb);
+    }
+    pthread_mutex_unlock(&ctx->update);
+}
+
+
+/*
+ * Finish building a new version of the chatbot's knowledge base, as
+ * knowledge_end_ctx().
+ */
+void knowledge_end(int publish) {
+    knowledge_end_ctx(&defaults, publish);
+}
+
+
+/*
+ * Write the knowledge base to a file, one section for each column, in the
+ * order the question words were first seen.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ *   f   - the file
+ */
+void knowledge_write_ctx(KBContext *ctx, FILE *f) {
+    uint64_t traced = trace_start();
+    uint64_t start = metrics_now();
+    Knowledge *kb = knowledge_acquire(ctx);
+    if (kb == NULL) {
+        return;
+    }
+    knowledge_write_file(kb, f, 0, kb->nentities);
+    knowledge_release(ctx, kb);
+    metrics_time(METRIC_WRITE, metrics_now() - start);
+    trace_span("knowledge_write", NULL, traced);
+}
+
+
+/*
+ * Write the chatbot's knowledge base to a file, as knowledge_write_ctx().
+ */
+void knowledge_write(FILE *f) {
+    knowledge_write_ctx(&defaults, f);
+}
+
+
+/*
+ * Write a version of the knowledge base to a file in INI format, for
+ * knowledge_write_ctx() and knowledge_write_shards_ctx(). Every section is written,
+ * with the responses for a range of the entities.
+ *
+ * Input:
+ *   kb    - the version of the knowledge base
+ *   f     - the file
+ *   first - the first entity to write, by id
+ *   last  - the entity after the last one to write
+ */
+static void knowledge_write_file(const Knowledge *kb, FILE *f, size_t first, size_t last) {
+    for (size_t c = 0; c < kb->ncolumns; c++) {
+        const Column *column = &kb->columns[c];
+        // \n before all but the first to create visual spacing between sections
+        fputs(c == 0 ? "[" : "\n[", f);
+        fputs(column->name, f);
+        fputs("]\n", f);
+        for (size_t i = 0; i < column->nrows; i++) {
+            if (column->responses[i] != NULL && column->entities[i] >= first && column->entities[i] < last) {
+                fputs(kb->nodes[column->entities[i]]->entity, f);
+                fputc('=', f);
+                fputs(column->responses[i], f);
+                fputc('\n', f);
+            }
+        }
+    }
+    // fclose to be handled by caller function
+}
+
+
+/* a shard being written by knowledge_write_shards() */
+typedef struct {
+    const Knowledge *kb;
+    FILE *f;
+    size_t first;               /* the entities in the shard, by id */
+    size_t last;
+    int started;                /* 1 if a thread of its own is writing it */
+} WriteShard;
+
+
+/*
+ * Write a shard for knowledge_write_shards().
+ */
+static void *knowledge_write_worker(void *arg) {
+    WriteShard *shard = arg;
+    uint64_t traced = trace_start();
+    knowledge_write_file(shard->kb, shard->f, shard->first, shard->last);
+    trace_span("knowledge_write_shard", NULL, traced);
+    return NULL;
+}
+
+
+/*
+ * Write the knowledge base to several files at once in INI format, one
+ * thread for each. Each file (a shard) has every section, with the responses
+ * for its share of the entities, taken in the order the entities were added;
+ * reading the shards back in order with knowledge_read_files() gives the
+ * same knowledge.
+ *
+ * Input:
+ *   ctx     - the knowledge base
+ *   files   - the files
+ *   nshards - the number of files
+ */
+void knowledge_write_shards_ctx(KBContext *ctx, FILE *files[], int nshards) {
+    uint64_t traced = trace_start();
+    uint64_t start = metrics_now();
+    WriteShard *shards = malloc(nshards * sizeof(WriteShard) + 1);
+    pthread_t *threads = malloc(nshards * sizeof(pthread_t) + 1);
+    Knowledge *kb = shards == NULL || threads == NULL ? NULL : knowledge_acquire(ctx);
+    if (kb == NULL) {
+        free(shards);
+        free(threads);
+        return;
+    }
+    // the workers read under this thread's lock, which is held until they finish
+    for (int i = 0; i < nshards; i++) {
+        shards[i].kb = kb;
+        shards[i].f = files[i];
+        shards[i].first = kb->nentities * i / nshards;
+        shards[i].last = kb->nentities * (i + 1) / nshards;
+    }
+    // this thread writes the first shard, and any a thread cannot be started for
+    for (int i = 1; i < nshards; i++) {
+        shards[i].started = pthread_create(&threads[i], NULL, knowledge_write_worker, &shards[i]) == 0;
+        if (!shards[i].started) {
+            knowledge_write_worker(&shards[i]);
+        }
+    }
+    knowledge_write_worker(&shards[0]);
+    for (int i = 1; i < nshards; i++) {
+        if (shards[i].started) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    knowledge_release(ctx, kb);
+    free(shards);
+    free(threads);
+    metrics_time(METRIC_WRITE, metrics_now() - start);
+    trace_span("knowledge_write_shards", NULL, traced);
+}
+
+
+/*
+ * Write the chatbot's knowledge base to several files at once, as
+ * knowledge_write_shards_ctx().
+ */
+void knowledge_write_shards(FILE *files[], int nshards) {
+    knowledge_write_shards_ctx(&defaults, files, nshards);
+}
+
+
+/*
+ * Reserve space for a string in a snapshot's string table.
+ *
+ * Input:
+ *   s      - the string, or NULL
+ *   offset - the offset of the next string, advanced past s
+ *
+ * Returns: the offset of s in the string table, or SNAPSHOT_NOSTR if s is NULL
+ */
+static uint64_t knowledge_offset(const char *s, uint64_t *offset) {
+    if (s == NULL) {
+        return SNAPSHOT_NOSTR;
+    }
+    uint64_t at = *offset;
+    *offset += strlen(s) + 1;
+    return at;
+}
+
+
+/*
+ * Visit the strings of a snapshot's string table in order, either adding
+ * them to its checksum or writing them.
+ *
+ * Input:
+ *   kb - the version of the knowledge base
+ *   ck - the checksum to add them to, or NULL
+ *   f  - the file to write them to, or NULL
+ *
+ * Returns: 1, or 0 if a string could not be written
+ */
+static int knowledge_snapshot_strings(const Knowledge *kb, Checksum *ck, FILE *f) {
+    int ok = 1;
+    for (size_t i = 0; ok && i < kb->nentities; i++) {
+        const EntityNode *current = kb->nodes[i];
+        const char *strs[] = {current->entity, current->key == current->entity ? NULL : current->key};
+        for (int j = 0; j < 2; j++) {
+            if (strs[j] == NULL) {
+                continue;
+            }
+            if (ck != NULL) {
+                knowledge_checksum(ck, strs[j], strlen(strs[j]) + 1);
+            }
+            if (f != NULL && fwrite(strs[j], strlen(strs[j]) + 1, 1, f) != 1) {
+                ok = 0;
+            }
+        }
+    }
+    for (size_t c = 0; ok && c < kb->ncolumns; c++) {
+        const Column *column = &kb->columns[c];
+        for (size_t i = 0; ok && i <= column->nrows; i++) {
+            // the name first, then the responses
+            const char *s = i == 0 ? column->name : column->responses[i - 1];
+            if (s == NULL) {
+                continue;
+            }
+            if (ck != NULL) {
+                knowledge_checksum(ck, s, strlen(s) + 1);
+            }
+            if (f != NULL && fwrite(s, strlen(s) + 1, 1, f) != 1) {
+                ok = 0;
+            }
+        }
+    }
+    return ok;
+}
+
+
+/*
+ * Write the knowledge base to a file as a binary snapshot, which
+ * knowledge_read() can map and use without parsing.
+ *
+ * Input:
+ *   ctx - the knowledge base
+ *   f   - the file, opened for writing in binary mode
+ *
+ * Returns:
+ *   KB_OK, if the snapshot was written
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   F_INVALID, if the file could not be written
+ */
+int knowledge_write_snapshot_ctx(KBContext *ctx, FILE *f) {
+    uint64_t traced = trace_start();
+    uint64_t start = metrics_now();
+    Knowledge *kb = knowledge_acquire(ctx);
+    if (kb == NULL) {
+        return KB_NOMEM;
+    }
+    int result = knowledge_write_snapshot_locked(kb, f);
+    knowledge_release(ctx, kb);
+    metrics_time(METRIC_WRITE, metrics_now() - start);
+    trace_span("knowledge_write_snapshot", NULL, traced);
+    return result;
+}
+
+
+/*
+ * Write the chatbot's knowledge base as a binary snapshot, as
+ * knowledge_write_snapshot_ctx().
+ */
+int knowledge_write_snapshot(FILE *f) {
+    return knowledge_write_snapshot_ctx(&defaults, f);
+}
+
+
+/*
+ * Measure the knowledge base, for STATS.
+ *
+ * Input:
+ *   ctx      - the knowledge base
+ *   entities - receives the number of entities
+ *   bytes    - receives the number of bytes of memory (or mapped snapshots)
+ *              holding them
+ */
+void knowledge_stats_ctx(KBContext *ctx, size_t *entities, size_t *bytes) {
+    *entities = 0;
+    *bytes = 0;
+    Knowledge *kb = knowledge_acquire(ctx);
+    if (kb == NULL) {
+        return;
+    }
+    *entities = kb->nentities;
+    *bytes = sizeof(Knowledge) + arena_reserved(&kb->arena) + (kb->size + kb->nbuckets) * sizeof(EntityNode *)
+             + kb->ncolumns * sizeof(Column);
+    for (size_t c = 0; c < kb->ncolumns; c++) {
+        const Column *column = &kb->columns[c];
+        *bytes += column->size * (sizeof(uint32_t) + sizeof(const char *) + sizeof(uint16_t))
+                  + column->nslots * sizeof(ColumnSlot) + column->termsize * sizeof(Term)
+                  + column->ntermslots * sizeof(uint32_t) + column->npostings * sizeof(Posting);
+    }
+    *bytes += kb->ngramslots * sizeof(Gram);
+    for (size_t i = 0; i < kb->ngramslots; i++) {
+        *bytes += kb->grams[i].size * sizeof(uint32_t);
+    }
+    for (Mapping *m = kb->mappings; m != NULL; m = m->next) {
+        *bytes += m->size;
+    }
+    knowledge_release(ctx, kb);
+}
+
+
+/*
+ * Measure the chatbot's knowledge base, as knowledge_stats_ctx().
+ */
+void knowledge_stats(size_t *entities, size_t *bytes) {
+    knowledge_stats_ctx(&defaults, entities, bytes);
+}
+
+
+/*
+ * Write a binary snapshot, as knowledge_write_snapshot(), with the knowledge
+ * base already locked.
+ */
+static int knowledge_write_snapshot_locked(Knowledge *kb, FILE *f) {
+    size_t nentities = kb->nentities;
+    size_t ncolumns = kb->ncolumns;
+    size_t nrows = 0;
+    for (size_t c = 0; c < ncolumns; c++) {
+        nrows += kb->columns[c].nrows;
+    }
+    // size the index for the current load factor so the loader can adopt it
+    uint64_t nb = KB_MIN_BUCKETS;
+    while (nentities * 4 > nb * 3) {
+        nb *= 2;
+    }
+    uint32_t *heads = malloc(nb * sizeof(uint32_t));
+    SnapshotEntity *records = malloc(nentities * sizeof(SnapshotEntity) + 1);
+    SnapshotColumn *columns = malloc(ncolumns * sizeof(SnapshotColumn) + 1);
+    SnapshotRow *rows = malloc(nrows * sizeof(SnapshotRow) + 1);
+    if (heads == NULL || records == NULL || columns == NULL || rows == NULL) {
+        free(heads);
+        free(records);
+        free(columns);
+        free(rows);
+        return KB_NOMEM;
+    }
+    memset(heads, 0xff, nb * sizeof(uint32_t));
+
+    // lay out the records and string offsets, in the order
+    // knowledge_snapshot_strings() visits the strings
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < nentities; i++) {
+        const EntityNode *current = kb->nodes[i];
+        SnapshotEntity *r = &records[i];
+        memset(r, 0, sizeof(SnapshotEntity));
+        r->hash = current->hash;
+        r->entity = knowledge_offset(current->entity, &offset);
+        r->key = current->key == current->entity ? r->entity : knowledge_offset(current->key, &offset);
+        r->keylen = (uint32_t) current->keylen;
+        size_t slot = current->hash & (nb - 1);
+        r->chain = heads[slot];
+        heads[slot] = i;
+    }
+    // rows without a response are left out
+    nrows = 0;
+    for (size_t c = 0; c < ncolumns; c++) {
+        const Column *column = &kb->columns[c];
+        columns[c].name = knowledge_offset(column->name, &offset);
+        columns[c].first = nrows;
+        for (size_t i = 0; i < column->nrows; i++) {
+            if (column->responses[i] != NULL) {
+                rows[nrows].response = knowledge_offset(column->responses[i], &offset);
+                rows[nrows].entity = column->entities[i];
+                rows[nrows].reserved = 0;
+                nrows++;
+            }
+        }
+        columns[c].nrows = nrows - columns[c].first;
+    }
+
+    // checksum the sections in the order they will be written, so the file
+    // can be written front to back without seeking
+    Checksum ck = {14695981039346656037ULL};
+    knowledge_checksum(&ck, (const char *) records, nentities * sizeof(SnapshotEntity));
+    knowledge_checksum(&ck, (const char *) heads, nb * sizeof(uint32_t));
+    knowledge_checksum(&ck, (const char *) columns, ncolumns * sizeof(SnapshotColumn));
+    knowledge_checksum(&ck, (const char *) rows, nrows * sizeof(SnapshotRow));
+    knowledge_snapshot_strings(kb, &ck, NULL);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC);
+    header.version = SNAPSHOT_VERSION;
+    header.nentities = nentities;
+    header.nbuckets = nb;
+    header.nstrings = offset;
+    header.ncolumns = ncolumns;
+    header.nrows = nrows;
+    header.checksum = knowledge_checksum_final(&ck);
+    int ok = fwrite(&header, sizeof header, 1, f) == 1
+            && fwrite(records, sizeof(SnapshotEntity), nentities, f) == nentities
+            && fwrite(heads, sizeof(uint32_t), nb, f) == nb
+            && fwrite(columns, sizeof(SnapshotColumn), ncolumns, f) == ncolumns
+            && fwrite(rows, sizeof(SnapshotRow), nrows, f) == nrows
+            && knowledge_snapshot_strings(kb, NULL, f);
+    free(records);
+    free(heads);
+    free(columns);
+    free(rows);
+    if (!ok || fflush(f) != 0) {
+        return F_INVALID;
+    }
+    return KB_OK;
 }
@@ -1,39 +1,169 @@
 /*
  * ICT1002 (C Language) Group Project.
  *
- * This file implements the main loop, including dividing input into words.
+ * This file implements the command line and the main loop.
  *
- * You should not need to modify this file. You may invoke its functions if you like, however.
+ * By default the chatbot talks to the user on the terminal. The options
+ * parsed by main() can instead answer a file or standard input in batch, or
+ * serve clients on a socket with a thread each (server.c) or from one event
+ * loop (event.c); and can turn on the journal, a transcript, tracing, periodic
+ * metrics and the number of worker threads used to load and save.
+ *
+ * On exit it closes the journal, transcript, metrics and trace files and
+ * waits for any background SAVE to finish.
  */
 
-#include <ctype.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "chat1002.h"
 
-/* word delimiters */
-const char *delimiters = " ?\t\n";
+/*
+ * Batch loop: answer newline-delimited input without prompting or printing
+ * any names, writing one line of output per line of input. Lines may be of
+ * any length. Questions the chatbot cannot answer get the default answer
+ * instead of starting a conversation.
+ *
+ * Input:
+ *   filename - the file to read, or NULL to read standard input
+ *
+ * Returns: 0, or 1 if the file could not be opened
+ */
+static int main_batch(const char *filename) {
+
+	static char outbuf[1 << 20];  /* buffer for standard output */
+	char *line = NULL;            /* the line being answered */
+	size_t size = 0;              /* the size of the line buffer */
+	char *inv[MAX_INPUT];         /* pointers to the beginning of each word of input */
+	char output[MAX_RESPONSE];    /* the chatbot's output */
+	int done = 0;                 /* set to 1 when the input asks to exit */
+
+	FILE *in = filename == NULL ? stdin : fopen(filename, "r");
+	if (in == NULL) {
+		perror(filename);
+		return 1;
+	}
+	chatbot_set_interactive(0);
+	setvbuf(stdout, outbuf, _IOFBF, sizeof outbuf);
+
+	uint64_t traced = trace_start();
+	while (!done && getline(&line, &size, in) != -1) {
+		trace_span("read", NULL, traced);
+		transcript_record(0, '>', line);
+		traced = trace_start();
+		int inc = split_words(line, inv, MAX_INPUT);
+		trace_span("tokenize", NULL, traced);
+		done = chatbot_main(inc, inv, output, MAX_RESPONSE);
+		transcript_record(0, '<', output);
+		fputs(output, stdout);
+		putchar('\n');
+		traced = trace_start();
+	}
+
+	free(line);
+	if (in != stdin)
+		fclose(in);
+	fflush(stdout);
+	return 0;
+}
 
 
 /*
  * Main loop.
+ *
+ * Options:
+ *   -j, --journal       journal taught facts next to each loaded file (see journal.c)
+ *   -b, --batch         answer lines from standard input without prompting
+ *   -f, --file FILE     answer lines from FILE without prompting
+ *   -d, --default TEXT  the answer given in batch mode to unknown questions
+ *   -s, --server PATH   serve clients on the Unix domain socket PATH (see server.c)
+ *   -e, --events PATH   serve clients on PATH from a single thread (see event.c)
+ *   -r, --record FILE   record the conversation in FILE (see transcript.c)
+ *   -m, --metrics FILE  append the metrics to FILE periodically (see metrics.c)
+ *   -M, --metrics-interval SECONDS  how often to write the metrics (default 10)
+ *   -t, --trace FILE    write a trace of every request to FILE (see trace.c)
+ *   -w, --workers N     load and save directories with N threads (default: one per CPU)
  */
 int main(int argc, char *argv[]) {
 
-	char input[MAX_INPUT];      /* buffer for holding the user input */
+	char *input = NULL;         /* buffer for holding the user input */
+	size_t size = 0;            /* the size of the input buffer */
 	int inc;                    /* the number of words in the user input */
 	char *inv[MAX_INPUT];       /* pointers to the beginning of each word of input */
 	char output[MAX_RESPONSE];  /* the chatbot's output */
-	int len;                    /* length of a word */
 	int done = 0;               /* set to 1 to end the main loop */
+	int batch = 0;              /* set to 1 to run the batch loop */
+	const char *batchfile = NULL;   /* the file for the batch loop, or NULL for stdin */
+	const char *socketpath = NULL;  /* the socket to serve clients on, or NULL */
+	int events = 0;             /* set to 1 to serve clients from the event loop */
+	const char *metricsfile = NULL; /* the file to write metrics to, or NULL */
+	int interval = 10;          /* the number of seconds between writes to metricsfile */
+
+	/* parse the command line */
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--journal") == 0) {
+			journal_enable(1);
+		} else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) {
+			batch = 1;
+		} else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) && i + 1 < argc) {
+			batch = 1;
+			batchfile = argv[++i];
+		} else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--server") == 0) && i + 1 < argc) {
+			socketpath = argv[++i];
+		} else if ((strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--events") == 0) && i + 1 < argc) {
+			socketpath = argv[++i];
+			events = 1;
+		} else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--default") == 0) && i + 1 < argc) {
+			chatbot_set_default_answer(argv[++i]);
+		} else if ((strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--record") == 0) && i + 1 < argc) {
+			if (transcript_open(argv[++i]) != KB_OK) {
+				perror(argv[i]);
+				return 1;
+			}
+		} else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--trace") == 0) && i + 1 < argc) {
+			if (trace_open(argv[++i]) != KB_OK) {
+				perror(argv[i]);
+				return 1;
+			}
+		} else if ((strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--workers") == 0) && i + 1 < argc
+				&& atoi(argv[i + 1]) > 0) {
+			chatbot_set_workers(atoi(argv[++i]));
+		} else if ((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--metrics") == 0) && i + 1 < argc) {
+			metricsfile = argv[++i];
+		} else if ((strcmp(argv[i], "-M") == 0 || strcmp(argv[i], "--metrics-interval") == 0) && i + 1 < argc
+				&& (interval = atoi(argv[i + 1])) > 0) {
+			i++;
+		} else {
+			fprintf(stderr, "Usage: %s [-j|--journal] [-b|--batch] [-f|--file FILE] [-d|--default TEXT] [-s|--server PATH] [-e|--events PATH] [-r|--record FILE] [-t|--trace FILE] [-w|--workers N] [-m|--metrics FILE] [-M|--metrics-interval SECONDS]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* write the metrics periodically */
+	if (metricsfile != NULL && metrics_dump_start(metricsfile, interval) != KB_OK) {
+		perror(metricsfile);
+		return 1;
+	}
 
 	/* initialise the chatbot */
 	inv[0] = "reset";
 	inv[1] = NULL;
 	chatbot_do_reset(1, inv, output, MAX_RESPONSE);
 
+	if (batch || socketpath != NULL) {
+		int status;
+		if (socketpath != NULL)
+			status = events ? event_run(socketpath) : server_run(socketpath);
+		else
+			status = main_batch(batchfile);
+		journal_close();
+		transcript_close();
+		metrics_dump_stop();
+		chatbot_bgsave_poll(1);
+		trace_close();
+		return status;
+	}
+
 	/* print a welcome message */
 	printf("%s: Hello, I'm %s.\n", chatbot_botname(), chatbot_botname());
 
@@ -41,103 +171,39 @@ int main(int argc, char *argv[]) {
 	do {
 
 		do {
-			/* read the line */
+			/* read the line, stopping at the end of the input */
 			printf("%s: ", chatbot_username());
-			fgets(input, MAX_INPUT, stdin);
-
-			char *nl = strchr(input, '\n');
-            if (nl == NULL){
-                int ch;
-                while ((ch = getchar()) != EOF && ch != '\n');/* do nothing*/
-            }
+			uint64_t traced = trace_start();
+			if (getline(&input, &size, stdin) == -1) {
+				printf("\n");
+				inc = -1;
+				break;
+			}
+			trace_span("read", NULL, traced);
 
 			/* split it into words */
-			inc = 0;
-			inv[inc] = strtok(input, delimiters);
-			while (inv[inc] != NULL) {
-
-				/* remove trailing punctuation */
-				len = strlen(inv[inc]);
-				while (len > 0 && ispunct(inv[inc][len - 1])) {
-					inv[inc][len - 1] = '\0';
-					len--;
-				}
-
-				/* go to the next word */
-				inc++;
-				inv[inc] = strtok(NULL, delimiters);
-			}
+			transcript_record(0, '>', input);
+			traced = trace_start();
+			inc = split_words(input, inv, MAX_INPUT);
+			trace_span("tokenize", NULL, traced);
 		} while (inc < 1);
+		if (inc < 0)
+			break;
 
 		/* invoke the chatbot */
 		done = chatbot_main(inc, inv, output, MAX_RESPONSE);
+		transcript_record(0, '<', output);
 		printf("%s: %s\n", chatbot_botname(), output);
 
 	} while (!done);
+	free(input);
 
-	return 0;
-}
-
-
-/*
- * Utility function for comparing string case-insensitively.
- *
- * Input:
- *   token1 - the first token
- *   token2 - the second token
- *
- * Returns:
- *   as strcmp()
- */
-int compare_token(const char *token1, const char *token2) {
-
-	int i = 0;
-	while (token1[i] != '\0' && token2[i] != '\0') {
-		if (toupper(token1[i]) < toupper(token2[i]))
-			return -1;
-		else if (toupper(token1[i]) > toupper(token2[i]))
-			return 1;
-		i++;
-	}
-
-	if (token1[i] == '\0' && token2[i] == '\0')
-		return 0;
-	else if (token1[i] == '\0')
-		return -1;
-	else
-		return 1;
-
-}
-
+	/* make sure everything taught or saved is on disk */
+	journal_close();
+	transcript_close();
+	metrics_dump_stop();
+	chatbot_bgsave_poll(1);
+	trace_close();
 
-/*
- * Prompt the user.
- *
- * Input:
- *   buf    - a buffer into which to store the answer
- *   n      - the maximum number of characters to write to the buffer
- *   format - format string, as printf
- *   ...    - as printf
- */
-void prompt_user(char *buf, int n, const char *format, ...) {
-
-	/* print the prompt */
-	va_list args;
-	va_start(args, format);
-	printf("%s: ", chatbot_botname());
-	vprintf(format, args);
-	printf(" ");
-	va_end(args);
-	printf("\n%s: ", chatbot_username());
-
-	/* get the response from the user */
-	fgets(buf, n, stdin);
-	char *nl = strchr(buf, '\n');
-	if (nl != NULL){
-		*nl = '\0';
-		return;
-	}
-    // flush stdin to prevent input from overflowing
-    int ch;
-    while ((ch = getchar()) != EOF && ch != '\n');/* do nothing*/
+	return 0;
 }
@@ -0,0 +1,467 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the chatbot's metrics: how often each intent is used
+ * and how long it takes, how often lookups find an answer, and how long the
+ * knowledge base takes to read and write. STATS reports them (see
+ * metrics_format()), and metrics_dump_start() writes them to a file
+ * periodically as JSON, one object per line.
+ *
+ * Each thread counts into a shard of its own, so recording never locks and
+ * never shares a cache line with another thread; only reading the metrics
+ * visits every shard. Shards are reused once their thread exits, in the same
+ * way as epoch slots (see epoch.c), and keep what they counted.
+ *
+ * Times are kept in histograms with a bucket for each power of two: bucket 0
+ * counts times under 512ns, bucket b times from 2^(b+8) to 2^(b+9)ns, and the
+ * last bucket everything from about 2s. Percentiles are estimated from the
+ * buckets, so they are accurate to within a bucket.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chat1002.h"
+
+/* the number of buckets in a histogram */
+#define METRICS_BUCKETS 24
+
+/* the shift that takes a time in nanoseconds to its bucket */
+#define METRICS_SHIFT 8
+
+/* the size of a cache line */
+#define METRICS_LINE 64
+
+/* a histogram of the times taken by one operation */
+typedef struct {
+    atomic_ullong count;
+    atomic_ullong total;                /* the sum of the times, in nanoseconds */
+    atomic_ullong buckets[METRICS_BUCKETS];
+} MetricsTimer;
+
+/* the sum of every shard */
+typedef struct {
+    unsigned long long counters[METRIC_COUNTERS];
+    unsigned long long count[METRIC_TIMERS];
+    unsigned long long total[METRIC_TIMERS];
+    unsigned long long buckets[METRIC_TIMERS][METRICS_BUCKETS];
+} MetricsTotals;
+
+/* the metrics counted by one thread */
+typedef struct metrics_shard {
+    atomic_ullong counters[METRIC_COUNTERS];
+    _Atomic(MetricsTimer *) timers[METRIC_TIMERS];  /* allocated when first used */
+    MetricsTotals *totals;              /* the owner's room for metrics_format(), allocated when first used */
+    atomic_int used;                    /* 1 while owned by a thread */
+    struct metrics_shard *next;
+} MetricsShard;
+
+// every shard ever created
+static _Atomic(MetricsShard *) shards;
+
+// this thread's shard, released when the thread exits
+static _Thread_local MetricsShard *mine;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+
+// when the metrics started, for the rates
+static uint64_t started;
+
+// the periodic dump, if any
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t dump_thread;
+static FILE *dump_file;
+static int dump_seconds;
+static int dump_stopping;
+
+// the names of the timers that are not intents
+static const char *timer_names[METRIC_INTENT] = {"read", "write", "unknown", "other"};
+
+
+/*
+ * Release a thread's shard for reuse when the thread exits.
+ */
+static void metrics_release(void *arg) {
+    MetricsShard *shard = arg;
+    atomic_store(&shard->used, 0);
+}
+
+static void metrics_init() {
+    pthread_key_create(&shard_key, metrics_release);
+    started = metrics_now();
+}
+
+
+/*
+ * Get this thread's shard, claiming a free one or creating one on first use.
+ *
+ * Returns: the shard, or NULL if there was a memory allocation failure
+ */
+static MetricsShard *metrics_shard() {
+    if (mine != NULL) {
+        return mine;
+    }
+    pthread_once(&shard_once, metrics_init);
+    MetricsShard *shard;
+    for (shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&shard->used, &unused, 1)) {
+            break;
+        }
+    }
+    if (shard == NULL) {
+        // a whole number of cache lines, so no two threads write to the same one
+        size_t size = (sizeof(MetricsShard) + METRICS_LINE - 1) / METRICS_LINE * METRICS_LINE;
+        shard = aligned_alloc(METRICS_LINE, size);
+        if (shard == NULL) {
+            return NULL;
+        }
+        memset(shard, 0, size);
+        atomic_init(&shard->used, 1);
+        shard->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &shard->next, shard));
+    }
+    pthread_setspecific(shard_key, shard);
+    mine = shard;
+    return shard;
+}
+
+
+/*
+ * Add to a value that only this thread changes. Other threads may read it
+ * at any time, so it is atomic, but it needs no locked instruction.
+ */
+static void metrics_add(atomic_ullong *value, unsigned long long n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+
+/*
+ * Get the time, for measuring how long something takes.
+ *
+ * Returns: the time in nanoseconds since an arbitrary point
+ */
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Count an event.
+ *
+ * Input:
+ *   counter - one of the METRIC_* counters
+ */
+void metrics_count(int counter) {
+    MetricsShard *shard = metrics_shard();
+    if (shard != NULL) {
+        metrics_add(&shard->counters[counter], 1);
+    }
+}
+
+
+/*
+ * Record how long an operation took.
+ *
+ * Input:
+ *   timer - one of the METRIC_* timers, or METRIC_INTENT plus an intent's id;
+ *           intents beyond the last timer share METRIC_OTHER (e.g. question
+ *           words from the sections of many files)
+ *   ns    - the time taken, in nanoseconds
+ */
+void metrics_time(int timer, uint64_t ns) {
+    MetricsShard *shard = metrics_shard();
+    if (shard == NULL || timer < 0) {
+        return;
+    }
+    if (timer >= METRIC_TIMERS) {
+        timer = METRIC_OTHER;
+    }
+    MetricsTimer *t = atomic_load_explicit(&shard->timers[timer], memory_order_relaxed);
+    if (t == NULL) {
+        size_t size = (sizeof(MetricsTimer) + METRICS_LINE - 1) / METRICS_LINE * METRICS_LINE;
+        t = aligned_alloc(METRICS_LINE, size);
+        if (t == NULL) {
+            return;
+        }
+        memset(t, 0, size);
+        atomic_store_explicit(&shard->timers[timer], t, memory_order_release);
+    }
+    int bucket = 0;
+    if (ns >> (METRICS_SHIFT + 1) != 0) {
+        bucket = 63 - __builtin_clzll(ns) - METRICS_SHIFT;
+        if (bucket >= METRICS_BUCKETS) {
+            bucket = METRICS_BUCKETS - 1;
+        }
+    }
+    metrics_add(&t->count, 1);
+    metrics_add(&t->total, ns);
+    metrics_add(&t->buckets[bucket], 1);
+}
+
+
+/*
+ * Add up every shard.
+ */
+static void metrics_collect(MetricsTotals *totals) {
+    memset(totals, 0, sizeof *totals);
+    for (MetricsShard *shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+        for (int c = 0; c < METRIC_COUNTERS; c++) {
+            totals->counters[c] += atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+        }
+        for (int i = 0; i < METRIC_TIMERS; i++) {
+            MetricsTimer *t = atomic_load_explicit(&shard->timers[i], memory_order_acquire);
+            if (t == NULL) {
+                continue;
+            }
+            totals->count[i] += atomic_load_explicit(&t->count, memory_order_relaxed);
+            totals->total[i] += atomic_load_explicit(&t->total, memory_order_relaxed);
+            for (int b = 0; b < METRICS_BUCKETS; b++) {
+                totals->buckets[i][b] += atomic_load_explicit(&t->buckets[b], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+
+/*
+ * Estimate a percentile from a histogram, assuming that the times in a
+ * bucket are spread evenly across it.
+ *
+ * Input:
+ *   buckets - the histogram
+ *   q       - the percentile, from 0 to 1
+ *
+ * Returns: the estimate, in nanoseconds
+ */
+static double metrics_percentile(const unsigned long long *buckets, double q) {
+    unsigned long long count = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        count += buckets[b];
+    }
+    double rank = q * count;
+    double seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        if (buckets[b] > 0 && seen + buckets[b] >= rank) {
+            double lo = b == 0 ? 0 : (double) (1ULL << (b + METRICS_SHIFT));
+            double hi = (double) (1ULL << (b + METRICS_SHIFT + 1));
+            return lo + (hi - lo) * (rank - seen) / buckets[b];
+        }
+        seen += buckets[b];
+    }
+    return 0;
+}
+
+
+/*
+ * Get the name of a timer.
+ *
+ * Returns: the name, or NULL if the timer is an intent that does not exist
+ */
+static const char *metrics_name(int timer) {
+    if (timer < METRIC_INTENT) {
+        return timer_names[timer];
+    }
+    const Intent *intent = intent_get(timer - METRIC_INTENT);
+    return intent == NULL ? NULL : intent->word;
+}
+
+
+/*
+ * Format a time for people to read.
+ */
+static const char *metrics_time_text(double ns, char *buf, size_t n) {
+    if (ns < 1e3) {
+        snprintf(buf, n, "%.0fns", ns);
+    }
+    else if (ns < 1e6) {
+        snprintf(buf, n, "%.1fus", ns / 1e3);
+    }
+    else if (ns < 1e9) {
+        snprintf(buf, n, "%.1fms", ns / 1e6);
+    }
+    else {
+        snprintf(buf, n, "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+
+/*
+ * Describe the metrics in a line of text, for STATS.
+ *
+ * Input:
+ *   name - the intent (or "read", "write", "unknown" or "other") to describe, or NULL
+ *          for an overview of every request and the knowledge base
+ *   buf  - a buffer to receive the description
+ *   n    - the size of buf
+ *
+ * The totals are collected into room kept in the thread's shard, so only
+ * a thread's first call allocates.
+ *
+ * Returns: KB_OK, KB_NOTFOUND if there is nothing called name, or KB_NOMEM
+ *   if there was a memory allocation failure
+ */
+int metrics_format(const char *name, char *buf, int n) {
+    // too big for the stack of a session thread, too frequent for malloc()
+    MetricsShard *shard = metrics_shard();
+    if (shard != NULL && shard->totals == NULL) {
+        shard->totals = malloc(sizeof(MetricsTotals));
+    }
+    if (shard == NULL || shard->totals == NULL) {
+        return KB_NOMEM;
+    }
+    MetricsTotals *totals = shard->totals;
+    metrics_collect(totals);
+    char p50[16], p90[16], p99[16], mean[16];
+
+    if (name != NULL) {
+        int timer;
+        for (timer = 0; timer < METRIC_TIMERS; timer++) {
+            const char *tname = metrics_name(timer);
+            if (tname != NULL && compare_token(tname, name) == 0) {
+                break;
+            }
+        }
+        if (timer == METRIC_TIMERS) {
+            return KB_NOTFOUND;
+        }
+        unsigned long long count = totals->count[timer];
+        snprintf(buf, n, "%s: %llu calls, mean %s, p50 %s, p90 %s, p99 %s", metrics_name(timer), count,
+                 metrics_time_text(count == 0 ? 0 : (double) totals->total[timer] / count, mean, sizeof mean),
+                 metrics_time_text(metrics_percentile(totals->buckets[timer], 0.50), p50, sizeof p50),
+                 metrics_time_text(metrics_percentile(totals->buckets[timer], 0.90), p90, sizeof p90),
+                 metrics_time_text(metrics_percentile(totals->buckets[timer], 0.99), p99, sizeof p99));
+        return KB_OK;
+    }
+
+    // every request, whatever its intent
+    unsigned long long requests = totals->count[METRIC_UNKNOWN];
+    unsigned long long all[METRICS_BUCKETS];
+    memcpy(all, totals->buckets[METRIC_UNKNOWN], sizeof all);
+    for (int i = METRIC_OTHER; i < METRIC_TIMERS; i++) {
+        requests += totals->count[i];
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            all[b] += totals->buckets[i][b];
+        }
+    }
+    unsigned long long hits = totals->counters[METRIC_HITS];
+    unsigned long long lookups = hits + totals->counters[METRIC_MISSES];
+    size_t entities, bytes;
+    knowledge_stats(&entities, &bytes);
+    double seconds = (metrics_now() - started) / 1e9;
+    snprintf(buf, n, "%llu requests (%.1f/s), p50 %s, p99 %s; %llu lookups, %.1f%% answered; "
+             "%zu entities in %zu KB",
+             requests, seconds > 0 ? requests / seconds : 0,
+             metrics_time_text(metrics_percentile(all, 0.50), p50, sizeof p50),
+             metrics_time_text(metrics_percentile(all, 0.99), p99, sizeof p99),
+             lookups, lookups == 0 ? 0 : 100.0 * hits / lookups, entities, (bytes + 1023) / 1024);
+    return KB_OK;
+}
+
+
+/*
+ * Write every metric as one line of JSON.
+ */
+static void metrics_dump(FILE *f) {
+    MetricsTotals *totals = malloc(sizeof(MetricsTotals));
+    if (totals == NULL) {
+        return;
+    }
+    metrics_collect(totals);
+    size_t entities, bytes;
+    knowledge_stats(&entities, &bytes);
+    fprintf(f, "{\"time\":%ld,\"uptime_ns\":%llu,\"entities\":%zu,\"memory_bytes\":%zu,"
+            "\"kb_hits\":%llu,\"kb_misses\":%llu,\"timers\":{",
+            (long) time(NULL), (unsigned long long) (metrics_now() - started), entities, bytes,
+            totals->counters[METRIC_HITS], totals->counters[METRIC_MISSES]);
+    int first = 1;
+    for (int i = 0; i < METRIC_TIMERS; i++) {
+        const char *name = metrics_name(i);
+        if (name == NULL || totals->count[i] == 0) {
+            continue;
+        }
+        fprintf(f, "%s\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"buckets\":[", first ? "" : ",",
+                name, totals->count[i], totals->total[i]);
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            fprintf(f, "%s%llu", b == 0 ? "" : ",", totals->buckets[i][b]);
+        }
+        fputs("]}", f);
+        first = 0;
+    }
+    fputs("}}\n", f);
+    fflush(f);
+    free(totals);
+}
+
+
+/*
+ * Write the metrics every few seconds until told to stop.
+ */
+static void *metrics_dump_loop(void *arg) {
+    pthread_mutex_lock(&dump_lock);
+    int stopping;
+    do {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += dump_seconds;
+        while (!dump_stopping && pthread_cond_timedwait(&dump_wake, &dump_lock, &until) == 0);
+        // the last dump is written even if told to stop before the first
+        stopping = dump_stopping;
+        metrics_dump(dump_file);
+    } while (!stopping);
+    pthread_mutex_unlock(&dump_lock);
+    return NULL;
+}
+
+
+/*
+ * Start writing the metrics to a file periodically, as one line of JSON each
+ * time. Bucket b of a timer's "buckets" counts the times below 2^(b+9)ns
+ * that are not counted by an earlier bucket.
+ *
+ * Input:
+ *   filename - the file, which is appended to
+ *   seconds  - how often to write
+ *
+ * Returns: KB_OK, or F_INVALID if the file could not be opened
+ */
+int metrics_dump_start(const char *filename, int seconds) {
+    pthread_once(&shard_once, metrics_init);
+    FILE *f = fopen(filename, "a");
+    if (f == NULL) {
+        return F_INVALID;
+    }
+    dump_file = f;
+    dump_seconds = seconds > 0 ? seconds : 1;
+    dump_stopping = 0;
+    if (pthread_create(&dump_thread, NULL, metrics_dump_loop, NULL) != 0) {
+        fclose(f);
+        dump_file = NULL;
+        return F_INVALID;
+    }
+    return KB_OK;
+}
+
+
+/*
+ * Stop the periodic dump, writing the metrics one last time.
+ */
+void metrics_dump_stop() {
+    if (dump_file == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dump_lock);
+    dump_stopping = 1;
+    pthread_cond_signal(&dump_wake);
+    pthread_mutex_unlock(&dump_lock);
+    pthread_join(dump_thread, NULL);
+    fclose(dump_file);
+    dump_file = NULL;
+}
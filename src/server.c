@@ -0,0 +1,194 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the query server.
+ *
+ * server_run() listens on a Unix domain socket and serves each client from a
+ * thread of its own, so one chatbot process can serve many front-ends. The
+ * protocol is the same as the batch loop: each line a client sends is passed
+ * to chatbot_main(), and the answer is sent back as one line. EXIT (or
+ * goodbye) ends that client's session only.
+ *
+ * All sessions share the knowledge base. Lookups run in parallel, while
+ * teaching, LOAD and RESET are serialised by the knowledge base's lock.
+ * Sessions never prompt: a question the chatbot cannot answer is asked back,
+ * and the client's next line is taken as the answer (see chatbot_session()).
+ *
+ * event.c serves the same protocol from a single thread.
+ *
+ * The server runs until it receives SIGINT or SIGTERM.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+// set by the signal handler to stop accepting clients
+static volatile sig_atomic_t stopping;
+
+
+/*
+ * Signal handler for SIGINT and SIGTERM.
+ */
+static void server_stop(int sig) {
+    stopping = 1;
+}
+
+
+/*
+ * Send a whole buffer to a client.
+ *
+ * Input:
+ *   fd  - the client's socket
+ *   buf - the data
+ *   len - the number of bytes in buf
+ *
+ * Returns: 0 on success, -1 if the client has gone away
+ */
+static int server_send(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t sent = write(fd, buf, len);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+
+/*
+ * Serve one client until it disconnects or exits.
+ *
+ * Input:
+ *   arg - the client's socket, cast to a pointer
+ */
+static void *server_session(void *arg) {
+
+    int fd = (int) (intptr_t) arg;
+    char *line = NULL;          /* the line being answered */
+    size_t size = 0;            /* the size of the line buffer */
+    ChatSession chat = {0};     /* the state of the conversation */
+    char output[MAX_RESPONSE];  /* the chatbot's output, plus a newline */
+    int done = 0;               /* set to 1 when the client asks to exit */
+
+    FILE *in = fdopen(fd, "r");
+    if (in == NULL) {
+        close(fd);
+        return NULL;
+    }
+    while (!done && getline(&line, &size, in) != -1) {
+        done = chatbot_session(&chat, line, output, MAX_RESPONSE - 1);
+        size_t len = strlen(output);
+        output[len++] = '\n';
+        if (server_send(fd, output, len) != 0) {
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+    return NULL;
+}
+
+
+/*
+ * Create the listening socket for a server.
+ *
+ * Input:
+ *   path - the path of the Unix domain socket to listen on; any existing
+ *          file at this path is replaced
+ *
+ * Returns: the socket, or -1 if it could not be set up
+ */
+int server_listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *) &addr, sizeof addr) != 0 || listen(lfd, SOMAXCONN) != 0) {
+        perror(path);
+        close(lfd);
+        return -1;
+    }
+    return lfd;
+}
+
+
+/*
+ * Run the query server.
+ *
+ * Input:
+ *   path - the path of the Unix domain socket to listen on; any existing
+ *          file at this path is replaced
+ *
+ * Returns: 0 when stopped by a signal, 1 if the socket could not be set up
+ */
+int server_run(const char *path) {
+    int lfd = server_listen(path);
+    if (lfd < 0) {
+        return 1;
+    }
+
+    // no SA_RESTART, so a signal interrupts accept()
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = server_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // sessions run detached and never see the stop signals
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    sigset_t stop, old;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+
+    chatbot_set_interactive(0);
+    while (!stopping) {
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        pthread_t thread;
+        pthread_sigmask(SIG_BLOCK, &stop, &old);
+        if (pthread_create(&thread, &attr, server_session, (void *) (intptr_t) cfd) != 0) {
+            close(cfd);
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+
+    pthread_attr_destroy(&attr);
+    close(lfd);
+    unlink(path);
+    return 0;
+}
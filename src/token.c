@@ -0,0 +1,312 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements dividing a line of input into words.
+ *
+ * token_next() and token_split() describe each word as a span (a pointer
+ * and a length) into the original line, which is neither copied nor
+ * modified, so lines may be of any length and any number of threads may
+ * split lines at once. split_words() null-terminates each word in place for
+ * chatbot_main(). Words are separated by spaces, tabs, line breaks and
+ * question marks, and trailing punctuation is not part of a word.
+ *
+ * compare_token() and compare_token_n() compare words without regard to case.
+ *
+ * Where SSE2 is available, delimiters are found and ASCII words are compared
+ * 16 bytes at a time. Anything else goes through the scalar path, one
+ * character at a time.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "chat1002.h"
+
+// compare_token() may load a few bytes past the end of a string, though
+// never past the end of its page, which AddressSanitizer would report; the
+// loads are made by token_compare_block()
+#if defined(__GNUC__)
+#define TOKEN_NO_ASAN __attribute__((no_sanitize_address))
+#else
+#define TOKEN_NO_ASAN
+#endif
+
+
+/*
+ * Determine whether a character separates words.
+ */
+static int token_is_delimiter(unsigned char c) {
+    return c == ' ' || c == '?' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+/*
+ * Find the first character in a span that is (or is not) a delimiter.
+ *
+ * Input:
+ *   p     - the start of the span
+ *   end   - the end of the span
+ *   delim - 1 to find a delimiter, 0 to find anything else
+ *
+ * Returns: the character, or end if there is none
+ */
+static const char *token_scan(const char *p, const char *end, int delim) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i question = _mm_set1_epi8('?');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const unsigned flip = delim ? 0 : 0xffff;
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) p);
+        __m128i found = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(block, space), _mm_cmpeq_epi8(block, question)),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, tab), _mm_cmpeq_epi8(block, newline)),
+                             _mm_cmpeq_epi8(block, cr)));
+        unsigned mask = ((unsigned) _mm_movemask_epi8(found)) ^ flip;
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (p < end && token_is_delimiter((unsigned char) *p) != delim) {
+        p++;
+    }
+    return p;
+}
+
+
+/*
+ * Find the next word in a line.
+ *
+ * Input:
+ *   cursor - the position to start looking from; advanced past the word
+ *   end    - the end of the line
+ *   word   - receives the word, without trailing punctuation
+ *
+ * Returns: 1 if a word was found, 0 at the end of the line
+ */
+int token_next(const char **cursor, const char *end, Token *word) {
+    const char *start = token_scan(*cursor, end, 0);
+    if (start == end) {
+        *cursor = end;
+        return 0;
+    }
+    const char *stop = token_scan(start, end, 1);
+    size_t len = stop - start;
+    while (len > 0 && ispunct((unsigned char) start[len - 1])) {
+        len--;
+    }
+    word->start = start;
+    word->len = len;
+    *cursor = stop;
+    return 1;
+}
+
+
+/*
+ * Split a line into words.
+ *
+ * Input:
+ *   line  - the line, which need not be null-terminated
+ *   len   - the number of characters in line
+ *   words - an array to receive the words
+ *   max   - the number of elements in words
+ *
+ * Returns: the number of words in the line, which may be more than max; only
+ *   the first max are stored
+ */
+size_t token_split(const char *line, size_t len, Token *words, size_t max) {
+    const char *cursor = line;
+    const char *end = line + len;
+    size_t count = 0;
+    Token word;
+    while (token_next(&cursor, end, &word)) {
+        if (count < max) {
+            words[count] = word;
+        }
+        count++;
+    }
+    return count;
+}
+
+
+/*
+ * Split a line of input into words, removing trailing punctuation. Each word
+ * is null-terminated in place, so chatbot_main() can use it as a string; see
+ * token_split() to split a line without modifying it.
+ *
+ * Input:
+ *   input - the line, which is modified in place
+ *   inv   - an array to receive pointers to the beginning of each word
+ *   max   - the number of elements in inv; at most max - 1 words are kept
+ *
+ * Returns: the number of words
+ */
+int split_words(char *input, char *inv[], int max) {
+    const char *cursor = input;
+    const char *end = input + strlen(input);
+    Token word;
+    int inc = 0;
+    while (inc < max - 1 && token_next(&cursor, end, &word)) {
+        inv[inc] = (char *) word.start;
+        char *stop = inv[inc] + word.len;
+        // don't let the next search start on the terminator
+        if (stop == cursor && cursor < end) {
+            cursor++;
+        }
+        *stop = '\0';
+        inc++;
+    }
+    inv[inc] = NULL;
+    return inc;
+}
+
+
+#ifdef __SSE2__
+/*
+ * Fold the lower-case ASCII letters in a block to upper case.
+ */
+static __m128i token_upper(__m128i block) {
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(block, _mm_set1_epi8('z' + 1)));
+    return _mm_sub_epi8(block, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+}
+
+
+/*
+ * Compare two 16-byte blocks without regard to case.
+ *
+ * Input:
+ *   p1, p2 - the blocks
+ *   diff   - receives a mask of the positions where the blocks differ
+ *   end    - receives a mask of the positions of null characters in p1
+ *
+ * Returns: 1 if the blocks were compared, 0 if either holds a non-ASCII
+ *   character and must be compared by the scalar path
+ */
+TOKEN_NO_ASAN
+static int token_compare_block(const char *p1, const char *p2, unsigned *diff, unsigned *end) {
+    __m128i a = _mm_loadu_si128((const __m128i *) p1);
+    __m128i b = _mm_loadu_si128((const __m128i *) p2);
+    if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0) {
+        return 0;
+    }
+    unsigned same = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(token_upper(a), token_upper(b)));
+    *diff = ~same & 0xffff;
+    *end = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128()));
+    return 1;
+}
+
+
+/*
+ * Determine whether 16 bytes can be loaded from p without crossing into the
+ * next page.
+ */
+static int token_can_load(const char *p) {
+    return ((uintptr_t) p & 4095) <= 4096 - 16;
+}
+#endif
+
+
+/*
+ * Order two characters without regard to case.
+ */
+static int token_order(char c1, char c2) {
+    int u1 = toupper((unsigned char) c1);
+    int u2 = toupper((unsigned char) c2);
+    return u1 < u2 ? -1 : u1 > u2;
+}
+
+
+/*
+ * Utility function for comparing string case-insensitively.
+ *
+ * Input:
+ *   token1 - the first token
+ *   token2 - the second token
+ *
+ * Returns:
+ *   as strcmp()
+ */
+int compare_token(const char *token1, const char *token2) {
+    size_t i = 0;
+    for (;;) {
+#ifdef __SSE2__
+        unsigned diff, end;
+        if (token_can_load(token1 + i) && token_can_load(token2 + i)
+                && token_compare_block(token1 + i, token2 + i, &diff, &end)) {
+            // stop at the first difference or the end of both
+            unsigned stop = diff | end;
+            if (stop != 0) {
+                i += __builtin_ctz(stop);
+                return token_order(token1[i], token2[i]);
+            }
+            i += 16;
+            continue;
+        }
+#endif
+        // one character at a time up to the next block
+        for (size_t next = i + 16; i < next; i++) {
+            int order = token_order(token1[i], token2[i]);
+            if (order != 0 || token1[i] == '\0') {
+                return order;
+            }
+        }
+    }
+}
+
+
+/*
+ * Compare two words of known length case-insensitively, without looking for
+ * the end of either.
+ *
+ * Input:
+ *   token1 - the first word, which need not be null-terminated
+ *   len1   - the number of characters in token1
+ *   token2 - the second word, which need not be null-terminated
+ *   len2   - the number of characters in token2
+ *
+ * Returns:
+ *   as strcmp()
+ */
+int compare_token_n(const char *token1, size_t len1, const char *token2, size_t len2) {
+    size_t len = len1 < len2 ? len1 : len2;
+    size_t i = 0;
+#ifdef __SSE2__
+    unsigned diff, end;
+    // a null character in a span is compared like any other
+    while (i + 16 <= len && token_compare_block(token1 + i, token2 + i, &diff, &end)) {
+        if (diff != 0) {
+            i += __builtin_ctz(diff);
+            return token_order(token1[i], token2[i]);
+        }
+        i += 16;
+    }
+#endif
+    for (; i < len; i++) {
+        int order = token_order(token1[i], token2[i]);
+        if (order != 0) {
+            return order;
+        }
+    }
+    return len1 < len2 ? -1 : len1 > len2;
+}
+
+
+/*
+ * Determine whether two words of known length are the same, ignoring case.
+ * Words of different lengths are rejected without reading them.
+ *
+ * Input:
+ *   token1, len1, token2, len2 - as compare_token_n()
+ *
+ * Returns: 1 if the words are the same, 0 otherwise
+ */
+int token_equal(const char *token1, size_t len1, const char *token2, size_t len2) {
+    return len1 == len2 && compare_token_n(token1, len1, token2, len2) == 0;
+}
@@ -0,0 +1,323 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements tracing: recording how long each stage of each
+ * request takes, as trace events that chrome://tracing or Perfetto can show
+ * on a timeline. Stages are recorded as spans (see trace_span()), and a span
+ * that starts and ends inside another is shown nested under it.
+ *
+ * The trace is a JSON array of complete ("X") events, one per line:
+ *
+ *   {"name":"knowledge_get","ph":"X","ts":1234.567,"dur":1.250,"pid":42,"tid":1,"args":{"detail":"ICT1002"}}
+ *
+ * Times are in microseconds since the trace was opened. tid numbers the
+ * buffer the span was recorded in, which is the thread's unless a thread
+ * that has exited left it to another.
+ *
+ * Each thread records into a ring buffer of its own, without locking, and a
+ * writer thread empties the rings into the file every TRACE_FLUSH_MS, so
+ * recording never waits for the disk. If a ring fills before the writer
+ * empties it, spans are dropped and counted; the count is written at the
+ * end of the trace. When not tracing, a span costs one atomic load.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+/* the number of spans each thread's ring holds */
+#define TRACE_RING 4096
+
+/* how often the writer empties the rings, in milliseconds */
+#define TRACE_FLUSH_MS 100
+
+/* the longest detail kept with a span */
+#define TRACE_DETAIL 48
+
+/* the size of a cache line */
+#define TRACE_LINE 64
+
+/* a span waiting to be written */
+typedef struct {
+    const char *name;           /* a string literal, so never freed */
+    char detail[TRACE_DETAIL];
+    uint64_t start;             /* nanoseconds, by metrics_now() */
+    uint64_t duration;
+} TraceEvent;
+
+/* the spans recorded by one thread */
+typedef struct trace_ring {
+    _Alignas(TRACE_LINE) atomic_size_t head;   /* the next slot to record in; only the owner changes it */
+    _Alignas(TRACE_LINE) atomic_size_t tail;   /* the next slot to write; only the writer changes it */
+    _Alignas(TRACE_LINE) atomic_int used;      /* 1 while owned by a thread */
+    int tid;
+    struct trace_ring *next;
+    TraceEvent events[TRACE_RING];
+} TraceRing;
+
+// every ring ever created, and how many there are
+static _Atomic(TraceRing *) rings;
+static atomic_int nrings;
+
+// this thread's ring, released when the thread exits
+static _Thread_local TraceRing *mine;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+// set while a trace is open, so that not tracing costs one load
+static atomic_int tracing;
+
+// the spans dropped because a ring was full
+static atomic_ullong dropped;
+
+// the trace being written, and the writer; the writer alone uses the file
+// while it runs
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static FILE *trace;
+static uint64_t opened;
+static int pid;
+static int stopping;
+static int written;
+
+
+/*
+ * Release a thread's ring for reuse when the thread exits. Spans still in it
+ * are written as usual.
+ */
+static void trace_release(void *arg) {
+    TraceRing *ring = arg;
+    atomic_store(&ring->used, 0);
+}
+
+static void trace_init() {
+    pthread_key_create(&ring_key, trace_release);
+}
+
+
+/*
+ * Get this thread's ring, claiming a free one or creating one on first use.
+ *
+ * Returns: the ring, or NULL if there was a memory allocation failure
+ */
+static TraceRing *trace_ring() {
+    if (mine != NULL) {
+        return mine;
+    }
+    pthread_once(&ring_once, trace_init);
+    TraceRing *ring;
+    for (ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&ring->used, &unused, 1)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = aligned_alloc(TRACE_LINE, sizeof(TraceRing));
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->used, 1);
+        ring->tid = atomic_fetch_add(&nrings, 1) + 1;
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+    }
+    pthread_setspecific(ring_key, ring);
+    mine = ring;
+    return ring;
+}
+
+
+/*
+ * Write a string as the contents of a JSON string.
+ */
+static void trace_escape(FILE *f, const char *s) {
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+}
+
+
+/*
+ * Write every span waiting in the rings to the trace.
+ */
+static void trace_drain() {
+    for (TraceRing *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (; tail != head; tail++) {
+            const TraceEvent *event = &ring->events[tail % TRACE_RING];
+            // spans recorded before the trace was opened have no place on its timeline
+            if (event->start < opened) {
+                continue;
+            }
+            fprintf(trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                    written ? ",\n" : "", event->name, (event->start - opened) / 1000.0,
+                    event->duration / 1000.0, pid, ring->tid);
+            if (event->detail[0] != '\0') {
+                fputs(",\"args\":{\"detail\":\"", trace);
+                trace_escape(trace, event->detail);
+                fputs("\"}", trace);
+            }
+            fputc('}', trace);
+            written = 1;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    fflush(trace);
+}
+
+
+/*
+ * Empty the rings every TRACE_FLUSH_MS until told to stop, then once more.
+ */
+static void *trace_writer(void *arg) {
+    pthread_mutex_lock(&lock);
+    int stop;
+    do {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (!stopping && pthread_cond_timedwait(&wake, &lock, &until) == 0);
+        stop = stopping;
+        // write without the lock, so that closing the trace need not wait
+        pthread_mutex_unlock(&lock);
+        trace_drain();
+        pthread_mutex_lock(&lock);
+    } while (!stop);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+
+/*
+ * Start tracing to a file. Any existing file is replaced.
+ *
+ * Input:
+ *   filename - the file to write the trace to
+ *
+ * Returns: KB_OK, or F_INVALID if the file could not be created or a trace
+ *          is already open
+ */
+int trace_open(const char *filename) {
+    pthread_once(&ring_once, trace_init);
+    if (trace != NULL) {
+        return F_INVALID;
+    }
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        return F_INVALID;
+    }
+    fputs("[\n", f);
+    trace = f;
+    opened = metrics_now();
+    pid = (int) getpid();
+    stopping = 0;
+    written = 0;
+    atomic_store(&dropped, 0);
+    if (pthread_create(&writer, NULL, trace_writer, NULL) != 0) {
+        fclose(f);
+        trace = NULL;
+        return F_INVALID;
+    }
+    atomic_store(&tracing, 1);
+    return KB_OK;
+}
+
+
+/*
+ * Stop tracing, writing every span recorded so far and ending the trace.
+ */
+void trace_close() {
+    if (trace == NULL) {
+        return;
+    }
+    atomic_store(&tracing, 0);
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+
+    // the number of spans lost, as a counter on the timeline
+    unsigned long long lost = atomic_load(&dropped);
+    if (lost > 0) {
+        fprintf(trace, "%s{\"name\":\"dropped\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"args\":{\"spans\":%llu}}",
+                written ? ",\n" : "", (metrics_now() - opened) / 1000.0, pid, lost);
+    }
+    fputs("\n]\n", trace);
+    fclose(trace);
+    trace = NULL;
+}
+
+
+/*
+ * Start timing a span.
+ *
+ * Returns: the time the span started, to pass to trace_span(), or 0 if not
+ *          tracing
+ */
+uint64_t trace_start() {
+    if (!atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        return 0;
+    }
+    return metrics_now();
+}
+
+
+/*
+ * Record a span that ends now.
+ *
+ * Input:
+ *   name   - the stage; must be a string literal (or otherwise never freed)
+ *   detail - what the stage worked on (e.g. the entity looked up), or NULL;
+ *            only the first TRACE_DETAIL - 1 characters are kept
+ *   start  - the time the span started, from trace_start(); if 0, nothing is
+ *            recorded
+ */
+void trace_span(const char *name, const char *detail, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    uint64_t end = metrics_now();
+    TraceRing *ring = trace_ring();
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RING) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    TraceEvent *event = &ring->events[head % TRACE_RING];
+    event->name = name;
+    if (detail == NULL) {
+        event->detail[0] = '\0';
+    } else {
+        snprintf(event->detail, sizeof event->detail, "%s", detail);
+    }
+    event->start = start;
+    event->duration = end - start;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,115 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements recording conversations to a transcript, which
+ * bench/replay.c can play back to measure the chatbot under real traffic.
+ *
+ * A transcript is a text file. Lines starting with # are comments; every
+ * other line is one record:
+ *
+ *   SESSION KIND TEXT
+ *
+ * SESSION numbers the conversation: 0 for the user at the terminal (or the
+ * batch input), and 1, 2, ... for the sessions served by server.c and
+ * event.c, in the order they first spoke. KIND is one of
+ *
+ *   >   a line of input
+ *   +   an answer to a question the chatbot asked (e.g. while teaching)
+ *   <   the chatbot's reply
+ *
+ * and TEXT runs to the end of the line. Records from different sessions are
+ * interleaved in the order they happened.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "chat1002.h"
+
+// the transcript being written, if any, protected by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *transcript;
+
+// set while a transcript is open, so that not recording costs one load
+static atomic_int recording;
+
+// the number of the next session to speak
+static atomic_ulong next_session = 1;
+
+
+/*
+ * Start recording to a transcript. Any existing file is replaced.
+ *
+ * Input:
+ *   filename - the name of the transcript
+ *
+ * Returns: KB_OK, or F_INVALID if the file could not be created
+ */
+int transcript_open(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        return F_INVALID;
+    }
+    fprintf(f, "# chat1002 transcript\n");
+    pthread_mutex_lock(&lock);
+    if (transcript != NULL) {
+        fclose(transcript);
+    }
+    transcript = f;
+    atomic_store(&recording, 1);
+    pthread_mutex_unlock(&lock);
+    return KB_OK;
+}
+
+
+/*
+ * Stop recording, writing out anything still buffered.
+ */
+void transcript_close() {
+    pthread_mutex_lock(&lock);
+    atomic_store(&recording, 0);
+    if (transcript != NULL) {
+        fclose(transcript);
+        transcript = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Determine whether a transcript is being recorded.
+ */
+int transcript_recording() {
+    return atomic_load_explicit(&recording, memory_order_relaxed);
+}
+
+
+/*
+ * Number a new session.
+ *
+ * Returns: a number not used by any other session
+ */
+unsigned long transcript_session() {
+    return atomic_fetch_add(&next_session, 1);
+}
+
+
+/*
+ * Record a line of a conversation, if a transcript is being recorded.
+ *
+ * Input:
+ *   session - the number of the session
+ *   kind    - '>', '+' or '<', as described above
+ *   text    - the line; anything after a line break is not recorded
+ */
+void transcript_record(unsigned long session, char kind, const char *text) {
+    if (!transcript_recording()) {
+        return;
+    }
+    int len = (int) strcspn(text, "\r\n");
+    pthread_mutex_lock(&lock);
+    if (transcript != NULL) {
+        fprintf(transcript, "%lu %c %.*s\n", session, kind, len, text);
+    }
+    pthread_mutex_unlock(&lock);
+}
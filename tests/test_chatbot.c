@@ -0,0 +1,784 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file holds regression tests for the chatbot library, run by ctest.
+ * Each test loads what it needs into a knowledge base of its own (see
+ * knowledge_create()) and reports every check that fails.
+ *
+ * Usage: test_chatbot
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+/* the number of checks that have failed */
+static int failures = 0;
+
+/* report a check that fails, and carry on */
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+
+/*
+ * Load the contents of an INI file into a knowledge base.
+ *
+ * Returns: as knowledge_read()
+ */
+static int test_read(KBContext *ctx, const char *contents) {
+    FILE *f = tmpfile();
+    if (f == NULL) {
+        return F_INVALID;
+    }
+    fputs(contents, f);
+    rewind(f);
+    int result = knowledge_read_ctx(ctx, f);
+    fclose(f);
+    return result;
+}
+
+
+/*
+ * A line before any section heading is rejected, whether or not it is a pair.
+ */
+static void test_read_before_heading() {
+    KBContext *ctx = knowledge_create();
+    CHECK(test_read(ctx, "no equals sign\n[what]\nx=y\n") == F_INVALID);
+    CHECK(test_read(ctx, "a=b\n[what]\nx=y\n") == KB_INVALID);
+    size_t entities, bytes;
+    knowledge_stats_ctx(ctx, &entities, &bytes);
+    CHECK(entities == 0);
+    knowledge_destroy(ctx);
+}
+
+
+/*
+ * A heading without its closing bracket, or without a word, is rejected
+ * rather than loaded as a question with no name.
+ */
+static void test_read_bad_heading() {
+    KBContext *ctx = knowledge_create();
+    CHECK(test_read(ctx, "[what\nx=y\n") == F_INVALID);
+    CHECK(test_read(ctx, "[]\nx=y\n") == F_INVALID);
+    CHECK(test_read(ctx, "[what]\nx=y\n[who\n") == F_INVALID);
+    size_t entities, bytes;
+    knowledge_stats_ctx(ctx, &entities, &bytes);
+    CHECK(entities == 0);
+    CHECK(test_read(ctx, "[what] \nx=y\n") == 1);
+    knowledge_destroy(ctx);
+}
+
+
+/*
+ * Sections with the same heading, in any case, load into one question.
+ */
+static void test_read_repeated_heading() {
+    char contents[4096] = "[what]\n";
+    size_t len = strlen(contents);
+    for (int i = 0; i < 20; i++) {
+        len += snprintf(contents + len, sizeof contents - len, "first %d=one %d\n", i, i);
+    }
+    len += snprintf(contents + len, sizeof contents - len, "[What]\n");
+    for (int i = 0; i < 20; i++) {
+        len += snprintf(contents + len, sizeof contents - len, "second %d=two %d\n", i, i);
+    }
+    KBContext *ctx = knowledge_create();
+    CHECK(test_read(ctx, contents) == 40);
+    char response[MAX_RESPONSE];
+    CHECK(knowledge_get_ctx(ctx, "what", "first 19", response, MAX_RESPONSE) == KB_OK && strcmp(response, "one 19") == 0);
+    CHECK(knowledge_get_ctx(ctx, "what", "second 19", response, MAX_RESPONSE) == KB_OK && strcmp(response, "two 19") == 0);
+    knowledge_destroy(ctx);
+}
+
+
+/*
+ * A section heading is a question only in the knowledge base it was loaded
+ * into, and only until that knowledge base is reset or destroyed.
+ */
+static void test_heading_scoped() {
+    char input[MAX_INPUT];
+    char response[MAX_RESPONSE];
+    char *inv[MAX_INPUT];
+    KBContext *ctx = knowledge_create();
+    CHECK(test_read(ctx, "[zzz]\na=b\n") == 1);
+    CHECK(knowledge_is_question_ctx(ctx, "ZZZ"));
+    CHECK(!knowledge_is_question_ctx(knowledge_default(), "zzz"));
+    CHECK(!chatbot_is_question("zzz"));
+    snprintf(input, sizeof input, "zzz a");
+    int inc = split_words(input, inv, MAX_INPUT);
+    chatbot_main_ctx(ctx, inc, inv, response, MAX_RESPONSE);
+    CHECK(strcmp(response, "b") == 0);
+    chatbot_main(inc, inv, response, MAX_RESPONSE);
+    CHECK(strcmp(response, "I don't understand \"zzz\".") == 0);
+    CHECK(knowledge_get("zzz", "a", response, MAX_RESPONSE) == KB_INVALID);
+    CHECK(knowledge_put_ctx(ctx, "zzz", "c", "d") == KB_OK);
+    knowledge_reset_ctx(ctx);
+    CHECK(!knowledge_is_question_ctx(ctx, "zzz"));
+    knowledge_destroy(ctx);
+}
+
+
+/*
+ * Batched lookups answer each question as knowledge_get() would, across
+ * batches, and terminate responses cut short by a small buffer.
+ */
+static void test_get_many() {
+    KBContext *ctx = knowledge_create();
+    char entity[40][16];
+    char response[40][MAX_RESPONSE];
+    KBQuery queries[40];
+    for (int i = 0; i < 40; i++) {
+        snprintf(entity[i], sizeof entity[i], "thing %d", i);
+        if (i % 4 != 3) {
+            CHECK(knowledge_put_ctx(ctx, "what", entity[i], entity[i]) == KB_OK);
+        }
+        queries[i] = (KBQuery) {"WHAT", entity[i], response[i], MAX_RESPONSE, 0};
+    }
+    queries[5].intent = "exit";
+    queries[6].n = 4;
+    CHECK(knowledge_get_many_ctx(ctx, queries, 40) == 29);
+    CHECK(queries[0].result == KB_OK && strcmp(response[0], "thing 0") == 0);
+    CHECK(queries[3].result == KB_NOTFOUND);
+    CHECK(queries[5].result == KB_INVALID);
+    CHECK(queries[6].result == KB_OK && strcmp(response[6], "thi") == 0);
+    CHECK(queries[38].result == KB_OK && strcmp(response[38], "thing 38") == 0);
+    CHECK(queries[39].result == KB_NOTFOUND);
+    knowledge_destroy(ctx);
+}
+
+
+/*
+ * Searching ranks the entities whose responses use the words, in any case,
+ * best first, and follows responses as they are replaced.
+ */
+static void test_search() {
+    KBContext *ctx = knowledge_create();
+    CHECK(test_read(ctx, "[what]\napple=a red fruit\npear=a green fruit that is a fruit\n"
+                         "car=a red machine\n[where]\napple=in an orchard of fruit\n") == 4);
+    KBHit hits[4];
+    CHECK(knowledge_search_ctx(ctx, "FRUIT", hits, 4) == 2);
+    CHECK(strcmp(hits[0].entity, "apple") == 0 && strcmp(hits[1].entity, "pear") == 0);
+    CHECK(hits[0].score >= hits[1].score && hits[1].score > 0);
+    CHECK(knowledge_search_ctx(ctx, "red machine", hits, 4) == 2 && strcmp(hits[0].entity, "car") == 0);
+    CHECK(knowledge_search_ctx(ctx, "red", hits, 1) == 1);
+    CHECK(knowledge_search_ctx(ctx, "banana", hits, 4) == 0);
+    CHECK(knowledge_search_ctx(ctx, "", hits, 4) == 0);
+    CHECK(knowledge_put_ctx(ctx, "what", "car", "a vehicle") == KB_OK);
+    CHECK(knowledge_search_ctx(ctx, "machine", hits, 4) == 0);
+    CHECK(knowledge_search_ctx(ctx, "vehicle", hits, 4) == 1 && strcmp(hits[0].entity, "car") == 0);
+    knowledge_destroy(ctx);
+}
+
+
+/*
+ * Put a line to a session and check the reply.
+ *
+ * Returns: 1 if the reply is the one expected, 0 otherwise
+ */
+static int test_say(ChatSession *s, const char *line, const char *expected) {
+    char input[MAX_INPUT];
+    char response[MAX_RESPONSE];
+    snprintf(input, sizeof input, "%s", line);
+    chatbot_session(s, input, response, MAX_RESPONSE);
+    if (strcmp(response, expected) != 0) {
+        fprintf(stderr, "said \"%s\", expected \"%s\", got \"%s\"\n", line, expected, response);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * A question about an entity near a known one suggests it, but the entity
+ * can still be taught; a blank answer takes the suggestion.
+ */
+static void test_near_miss_taught() {
+    ChatSession s = {0};
+    char response[MAX_RESPONSE];
+    CHECK(knowledge_put("what", "ICT1002", "A course.") == KB_OK);
+    char nearest[MAX_ENTITY];
+    memset(response, 'x', sizeof response);
+    CHECK(knowledge_get_near("what", "ICT1003", nearest, response, 4) == KB_OK);
+    CHECK(strcmp(nearest, "ICT1002") == 0 && strcmp(response, "A c") == 0);
+    CHECK(test_say(&s, "what is ICT1003", "Did you mean ICT1002? A course. If not, what is ICT1003?"));
+    CHECK(s.teaching);
+    CHECK(test_say(&s, "Another course.", "Thank you."));
+    CHECK(knowledge_get("what", "ICT1003", response, MAX_RESPONSE) == KB_OK && strcmp(response, "Another course.") == 0);
+    CHECK(test_say(&s, "what is ICT1003", "Another course."));
+    CHECK(test_say(&s, "what is ICT1004", "Did you mean ICT1002? A course. If not, what is ICT1004?"));
+    CHECK(test_say(&s, "", "OK."));
+    CHECK(!s.teaching);
+    CHECK(knowledge_get("what", "ICT1004", response, MAX_RESPONSE) == KB_NOTFOUND);
+    knowledge_reset();
+}
+
+
+/*
+ * A taught answer that fills the response buffer is still answered whole,
+ * and terminated, in the buffer the servers pass to chatbot_session().
+ */
+static void test_long_answer() {
+    ChatSession s = {0};
+    char input[MAX_INPUT];
+    char response[MAX_RESPONSE];
+    char answer[MAX_RESPONSE];
+    memset(answer, 'a', MAX_RESPONSE - 1);
+    answer[MAX_RESPONSE - 1] = '\0';
+    CHECK(test_say(&s, "what is long", "I don't know. what is long?"));
+    snprintf(input, sizeof input, "%s", answer);
+    chatbot_session(&s, input, response, MAX_RESPONSE - 1);
+    snprintf(input, sizeof input, "what is long");
+    memset(response, 'x', sizeof response);
+    chatbot_session(&s, input, response, MAX_RESPONSE - 1);
+    CHECK(memchr(response, '\0', MAX_RESPONSE - 1) != NULL);
+    CHECK(strncmp(response, answer, MAX_RESPONSE - 2) == 0 && strlen(response) == MAX_RESPONSE - 2);
+    CHECK(knowledge_get("what", "long", response, MAX_RESPONSE - 1) == KB_OK && strlen(response) == MAX_RESPONSE - 2);
+    knowledge_reset();
+}
+
+
+/*
+ * Many question words stay quick to find, and are timed even past the
+ * last timer of their own.
+ */
+static void test_many_questions() {
+    char word[MAX_INTENT];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(word, sizeof word, "ask%d", i);
+        CHECK(chatbot_add_question(word) == KB_OK);
+    }
+    int found = 0;
+    for (int i = 0; i < 2000; i++) {
+        snprintf(word, sizeof word, "ASK%d", i);
+        found += chatbot_is_question(word);
+    }
+    CHECK(found == 2000);
+    CHECK(chatbot_is_question("what"));
+    CHECK(!chatbot_is_question("exit"));
+    CHECK(!chatbot_is_question("ask2000"));
+    const Intent *last = intent_find("ask1999");
+    CHECK(last != NULL && intent_get(last->id) == last);
+
+    char stats[MAX_RESPONSE];
+    long before = 0, after = 0;
+    CHECK(metrics_format("other", stats, sizeof stats) == KB_OK && sscanf(stats, "other: %ld calls", &before) == 1);
+    metrics_time(METRIC_INTENT + last->id, 1000);
+    CHECK(metrics_format("other", stats, sizeof stats) == KB_OK && sscanf(stats, "other: %ld calls", &after) == 1);
+    CHECK(after == before + 1);
+}
+
+
+/*
+ * A section whose heading already selects small talk or a command is loaded
+ * and saved again, but is not a question, and the rest of the file loads.
+ */
+static void test_read_taken_heading() {
+    KBContext *ctx = knowledge_create();
+    CHECK(test_read(ctx, "[how]\nfoo=bar\n[what]\nx=y\n") == 2);
+    CHECK(!chatbot_is_question("how"));
+    char response[MAX_RESPONSE];
+    CHECK(knowledge_get_ctx(ctx, "what", "x", response, MAX_RESPONSE) == KB_OK);
+    CHECK(knowledge_get_ctx(ctx, "how", "foo", response, MAX_RESPONSE) == KB_INVALID);
+    CHECK(knowledge_put_ctx(ctx, "how", "baz", "no") == KB_INVALID);
+
+    char saved[256] = "";
+    FILE *f = tmpfile();
+    if (f != NULL) {
+        knowledge_write_ctx(ctx, f);
+        rewind(f);
+        saved[fread(saved, 1, sizeof saved - 1, f)] = '\0';
+        fclose(f);
+    }
+    CHECK(strstr(saved, "[how]") != NULL && strstr(saved, "foo=bar") != NULL);
+    knowledge_destroy(ctx);
+}
+
+
+/*
+ * Load a knowledge base file held in memory.
+ *
+ * Returns: as knowledge_read()
+ */
+static int test_read_bytes(KBContext *ctx, const char *buf, size_t len) {
+    FILE *f = tmpfile();
+    if (f == NULL) {
+        return F_INVALID;
+    }
+    fwrite(buf, 1, len, f);
+    rewind(f);
+    int result = knowledge_read_ctx(ctx, f);
+    fclose(f);
+    return result;
+}
+
+
+/*
+ * Checksum a snapshot and store the sum in its header, as
+ * knowledge_write_snapshot() does, so that a test can load a snapshot it has
+ * changed. The header is 64 bytes, with the checksum at offset 40.
+ */
+static void test_snapshot_sum(char *buf, size_t len) {
+    uint64_t sum = 14695981039346656037ULL;
+    size_t i = 64;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, buf + i, 8);
+        sum = (sum ^ word) * 1099511628211ULL;
+    }
+    for (; i < len; i++) {
+        sum = (sum ^ (unsigned char) buf[i]) * 1099511628211ULL;
+    }
+    memcpy(buf + 40, &sum, 8);
+}
+
+
+/*
+ * A snapshot loads back what was saved, and one that is cut short, damaged,
+ * or crafted to pass its checksum with records pointing outside it is
+ * rejected without loading anything.
+ */
+static void test_snapshot() {
+    KBContext *ctx = knowledge_create();
+    CHECK(test_read(ctx, "[what]\nApple=A fruit.\nPear=Another fruit.\n[where]\nApple=Cupertino\n[when]\nlunch=noon\n") == 4);
+    static char buf[4096];
+    size_t len = 0;
+    FILE *f = tmpfile();
+    if (f != NULL) {
+        CHECK(knowledge_write_snapshot_ctx(ctx, f) == KB_OK);
+        rewind(f);
+        len = fread(buf, 1, sizeof buf, f);
+        fclose(f);
+    }
+    knowledge_destroy(ctx);
+    CHECK(len > 64 && len < sizeof buf);
+
+    // round trip
+    char response[MAX_RESPONSE];
+    ctx = knowledge_create();
+    CHECK(test_read_bytes(ctx, buf, len) == 4);
+    CHECK(knowledge_get_ctx(ctx, "what", "apple", response, MAX_RESPONSE) == KB_OK && strcmp(response, "A fruit.") == 0);
+    CHECK(knowledge_get_ctx(ctx, "where", "APPLE", response, MAX_RESPONSE) == KB_OK && strcmp(response, "Cupertino") == 0);
+    CHECK(knowledge_get_ctx(ctx, "when", "lunch", response, MAX_RESPONSE) == KB_OK && strcmp(response, "noon") == 0);
+    CHECK(knowledge_get_ctx(ctx, "who", "apple", response, MAX_RESPONSE) == KB_NOTFOUND);
+    knowledge_destroy(ctx);
+
+    // cut short, or damaged
+    size_t cuts[] = {8, 64, 64 + 32, len / 2, len - 1};
+    for (size_t i = 0; i < sizeof cuts / sizeof cuts[0]; i++) {
+        ctx = knowledge_create();
+        CHECK(test_read_bytes(ctx, buf, cuts[i]) == F_INVALID);
+        CHECK(knowledge_get_ctx(ctx, "what", "apple", response, MAX_RESPONSE) != KB_OK);
+        knowledge_destroy(ctx);
+    }
+    static char bad[4096];
+    memcpy(bad, buf, len);
+    bad[len - 3] ^= 1;
+    ctx = knowledge_create();
+    CHECK(test_read_bytes(ctx, bad, len) == F_INVALID);
+    knowledge_destroy(ctx);
+
+    // crafted, with a good checksum: the first entity, straight after the
+    // header, claims a longer key (its length is at offset 24) or a key
+    // past the end of the strings (its offset is at offset 16)
+    uint32_t keylen;
+    memcpy(bad, buf, len);
+    test_snapshot_sum(bad, len);
+    CHECK(memcmp(bad, buf, len) == 0);
+    memcpy(&keylen, bad + 64 + 24, 4);
+    keylen++;
+    memcpy(bad + 64 + 24, &keylen, 4);
+    test_snapshot_sum(bad, len);
+    ctx = knowledge_create();
+    CHECK(test_read_bytes(ctx, bad, len) == F_INVALID);
+    knowledge_destroy(ctx);
+    memcpy(bad, buf, len);
+    uint64_t key = len;
+    memcpy(bad + 64 + 16, &key, 8);
+    test_snapshot_sum(bad, len);
+    ctx = knowledge_create();
+    CHECK(test_read_bytes(ctx, bad, len) == F_INVALID);
+    knowledge_destroy(ctx);
+}
+
+
+/*
+ * A version 1 snapshot, whose entities held their own what, where and who
+ * responses, still loads; one whose response lies outside it does not.
+ */
+static void test_snapshot_v1() {
+    // the header (magic, version, flags, then the number of entities at
+    // offset 16, buckets at 24 and bytes of strings at 32), then entities of
+    // hash, entity, key, what, where and who (64 bits each), keylen and
+    // chain (32 bits), then the strings
+    static const char strings[] = "Apple\0apple\0A fruit.\0Cupertino";
+    uint64_t none = UINT64_MAX;
+    static char buf[64 + 56 + sizeof strings];
+    uint32_t version = 1;
+    uint64_t nentities = 1, nstrings = sizeof strings;
+    memcpy(buf, "C1002KB", 8);
+    memcpy(buf + 8, &version, 4);
+    memcpy(buf + 16, &nentities, 8);
+    memcpy(buf + 32, &nstrings, 8);
+    unsigned long hash = 2166136261UL;
+    for (const char *c = "apple"; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619UL;
+    }
+    uint64_t fields[] = {hash, 0, 6, 12, 21, none};
+    memcpy(buf + 64, fields, sizeof fields);
+    uint32_t keylen = 5, chain = UINT32_MAX;
+    memcpy(buf + 64 + 48, &keylen, 4);
+    memcpy(buf + 64 + 52, &chain, 4);
+    memcpy(buf + 64 + 56, strings, sizeof strings);
+    test_snapshot_sum(buf, sizeof buf);
+
+    char response[MAX_RESPONSE];
+    KBContext *ctx = knowledge_create();
+    CHECK(test_read_bytes(ctx, buf, sizeof buf) == 2);
+    CHECK(knowledge_get_ctx(ctx, "what", "APPLE", response, MAX_RESPONSE) == KB_OK && strcmp(response, "A fruit.") == 0);
+    CHECK(knowledge_get_ctx(ctx, "where", "apple", response, MAX_RESPONSE) == KB_OK && strcmp(response, "Cupertino") == 0);
+    CHECK(knowledge_get_ctx(ctx, "who", "apple", response, MAX_RESPONSE) == KB_NOTFOUND);
+    knowledge_destroy(ctx);
+
+    fields[4] = sizeof strings;
+    memcpy(buf + 64, fields, sizeof fields);
+    test_snapshot_sum(buf, sizeof buf);
+    ctx = knowledge_create();
+    CHECK(test_read_bytes(ctx, buf, sizeof buf) == F_INVALID);
+    knowledge_destroy(ctx);
+}
+
+
+/*
+ * Make a name for a file of the test's own.
+ *
+ * Input:
+ *   name - a buffer of at least 32 characters to receive the name
+ *
+ * Returns: 1 if a file was created with the name, 0 otherwise
+ */
+static int test_file(char *name) {
+    snprintf(name, 32, "/tmp/test_chatbotXXXXXX");
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+
+/*
+ * Append a journal record, as journal_append() writes it, to a buffer.
+ *
+ * Returns: the new length of the buffer
+ */
+static size_t test_record(char *buf, size_t len, const char *intent, const char *entity, const char *response) {
+    char *payload = buf + len + 8;
+    uint32_t size = 0;
+    const char *fields[] = {intent, entity, response};
+    for (int i = 0; i < 3; i++) {
+        memcpy(payload + size, fields[i], strlen(fields[i]) + 1);
+        size += (uint32_t) strlen(fields[i]) + 1;
+    }
+    uint32_t sum = 2166136261U;
+    for (uint32_t i = 0; i < size; i++) {
+        sum = (sum ^ (unsigned char) payload[i]) * 16777619U;
+    }
+    memcpy(buf + len, &size, 4);
+    memcpy(buf + len + 4, &sum, 4);
+    return len + 8 + size;
+}
+
+
+/*
+ * Write a journal for a file, and attach it.
+ *
+ * Returns: as journal_attach()
+ */
+static int test_attach(const char *name, const char *contents, size_t len) {
+    char journal[48];
+    snprintf(journal, sizeof journal, "%s.journal", name);
+    FILE *f = fopen(journal, "wb");
+    if (f == NULL) {
+        return F_INVALID;
+    }
+    fwrite(contents, 1, len, f);
+    fclose(f);
+    return journal_attach(name);
+}
+
+
+/*
+ * Replaying a journal stops at a record torn by a crash or failing its
+ * checksum, and cuts it off so that new records follow the last good one.
+ */
+static void test_journal_replay() {
+    char name[32], journal[48];
+    if (!test_file(name)) {
+        CHECK(0);
+        return;
+    }
+    snprintf(journal, sizeof journal, "%s.journal", name);
+    char buf[512] = "C1002JNL";
+    char response[MAX_RESPONSE];
+    journal_enable(1);
+
+    // a torn record at the end
+    size_t good = test_record(buf, 8, "what", "one", "1");
+    size_t len = test_record(buf, good, "what", "two", "2");
+    CHECK(test_attach(name, buf, len - 3) == 1);
+    CHECK(knowledge_get("what", "one", response, MAX_RESPONSE) == KB_OK && strcmp(response, "1") == 0);
+    CHECK(knowledge_get("what", "two", response, MAX_RESPONSE) == KB_NOTFOUND);
+    CHECK(knowledge_put("what", "three", "3") == KB_OK);
+    journal_close();
+    knowledge_reset();
+    CHECK(journal_attach(name) == 2);
+    CHECK(knowledge_get("what", "three", response, MAX_RESPONSE) == KB_OK && strcmp(response, "3") == 0);
+    journal_close();
+    knowledge_reset();
+
+    // a record whose checksum fails, and everything after it
+    len = test_record(buf, good, "what", "two", "2");
+    buf[len - 2] ^= 1;
+    len = test_record(buf, len, "what", "four", "4");
+    CHECK(test_attach(name, buf, len) == 1);
+    CHECK(knowledge_get("what", "two", response, MAX_RESPONSE) == KB_NOTFOUND);
+    CHECK(knowledge_get("what", "four", response, MAX_RESPONSE) == KB_NOTFOUND);
+    journal_close();
+    FILE *f = fopen(journal, "rb");
+    CHECK(f != NULL && fseek(f, 0, SEEK_END) == 0 && ftell(f) == (long) good);
+    if (f != NULL) {
+        fclose(f);
+    }
+    knowledge_reset();
+
+    // not a journal at all
+    CHECK(test_attach(name, "NOTAJRNL", 8) == F_INVALID);
+    journal_enable(0);
+    knowledge_reset();
+    remove(journal);
+    remove(name);
+}
+
+
+/*
+ * Compacting the journal keeps the records taught after its mark, and only
+ * those, for the next time it is attached.
+ */
+static void test_journal_truncate() {
+    char name[32], journal[48], tmpname[48];
+    if (!test_file(name)) {
+        CHECK(0);
+        return;
+    }
+    snprintf(journal, sizeof journal, "%s.journal", name);
+    snprintf(tmpname, sizeof tmpname, "%s.tmp", journal);
+    journal_enable(1);
+    CHECK(journal_attach(name) == 0);
+    CHECK(knowledge_put("what", "before", "folded") == KB_OK);
+    long mark = journal_mark();
+    CHECK(knowledge_put("what", "after", "kept") == KB_OK);
+    CHECK(journal_truncate(mark) == KB_OK);
+    CHECK(access(tmpname, F_OK) != 0);
+    CHECK(knowledge_put("what", "later", "appended") == KB_OK);
+    journal_close();
+
+    char response[MAX_RESPONSE];
+    knowledge_reset();
+    CHECK(journal_attach(name) == 2);
+    CHECK(knowledge_get("what", "before", response, MAX_RESPONSE) == KB_NOTFOUND);
+    CHECK(knowledge_get("what", "after", response, MAX_RESPONSE) == KB_OK && strcmp(response, "kept") == 0);
+    CHECK(knowledge_get("what", "later", response, MAX_RESPONSE) == KB_OK);
+    journal_close();
+    journal_enable(0);
+    knowledge_reset();
+    remove(journal);
+    remove(name);
+}
+
+
+/*
+ * Run the event-driven server, for test_event().
+ */
+static void *test_event_run(void *arg) {
+    event_run(arg);
+    return NULL;
+}
+
+
+/*
+ * Connect to a server, giving up on reads that take more than two seconds.
+ *
+ * Returns: the socket, or -1 if it could not connect
+ */
+static int test_connect(const char *path) {
+    struct sockaddr_un addr = {AF_UNIX};
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", path);
+    for (int tries = 0; tries < 200; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == 0) {
+            struct timeval timeout = {2, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+            return fd;
+        }
+        // the server may not be listening yet
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+
+/*
+ * Read a line from a server.
+ *
+ * Returns: 1 if the line, without its newline, is the one expected, 0 otherwise
+ */
+static int test_recv(int fd, const char *expected) {
+    char line[MAX_RESPONSE + 1];
+    size_t len = 0;
+    while (len < sizeof line - 1 && read(fd, line + len, 1) == 1 && line[len] != '\n') {
+        len++;
+    }
+    line[len] = '\0';
+    if (strcmp(line, expected) != 0) {
+        fprintf(stderr, "expected \"%s\", got \"%s\"\n", expected, line);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Send a string to a server.
+ *
+ * Returns: 1 if it was all sent, 0 otherwise
+ */
+static int test_send(int fd, const char *text) {
+    size_t len = strlen(text);
+    return write(fd, text, len) == (ssize_t) len;
+}
+
+
+/* the questions for test_event_flood() */
+#define TEST_FLOOD 4000
+
+/*
+ * Ask a server the same question many times without reading the answers.
+ */
+static void *test_event_flood(void *arg) {
+    int fd = *(int *) arg;
+    for (int i = 0; i < TEST_FLOOD; i++) {
+        if (!test_send(fd, "what is event\n")) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * The event-driven server answers a line sent in pieces, answers a last line
+ * without a newline when the client stops sending, and keeps serving other
+ * clients while one does not read its answers, losing none of them.
+ */
+static void test_event() {
+    char name[32], path[40];
+    if (!test_file(name)) {
+        CHECK(0);
+        return;
+    }
+    snprintf(path, sizeof path, "%s.sock", name);
+    char response[200];
+    memset(response, 'r', sizeof response - 1);
+    response[sizeof response - 1] = '\0';
+    CHECK(knowledge_put("what", "event", response) == KB_OK);
+    pthread_t server;
+    if (pthread_create(&server, NULL, test_event_run, path) != 0) {
+        CHECK(0);
+        return;
+    }
+
+    // a line in pieces
+    int fd = test_connect(path);
+    CHECK(fd >= 0);
+    CHECK(test_send(fd, "what is ev"));
+    usleep(50000);
+    CHECK(test_send(fd, "ent\nwhat"));
+    CHECK(test_recv(fd, response));
+    usleep(50000);
+    CHECK(test_send(fd, " is event\n"));
+    CHECK(test_recv(fd, response));
+
+    // the end of the input, without a newline
+    CHECK(test_send(fd, "what is event"));
+    shutdown(fd, SHUT_WR);
+    CHECK(test_recv(fd, response));
+    char c;
+    CHECK(read(fd, &c, 1) == 0);
+    close(fd);
+
+    // a client that does not read holds up no one else
+    fd = test_connect(path);
+    pthread_t flood;
+    CHECK(fd >= 0 && pthread_create(&flood, NULL, test_event_flood, &fd) == 0);
+    usleep(200000);
+    int other = test_connect(path);
+    CHECK(other >= 0);
+    CHECK(test_send(other, "what is event\n"));
+    CHECK(test_recv(other, response));
+    close(other);
+    int answered = 0;
+    while (answered < TEST_FLOOD && test_recv(fd, response)) {
+        answered++;
+    }
+    CHECK(answered == TEST_FLOOD);
+    pthread_join(flood, NULL);
+    close(fd);
+
+    pthread_kill(server, SIGTERM);
+    pthread_join(server, NULL);
+    CHECK(access(path, F_OK) != 0);
+    remove(name);
+    knowledge_reset();
+}
+
+
+int main() {
+    test_read_before_heading();
+    test_read_bad_heading();
+    test_read_repeated_heading();
+    test_read_taken_heading();
+    test_heading_scoped();
+    test_get_many();
+    test_search();
+    test_near_miss_taught();
+    test_long_answer();
+    test_many_questions();
+    test_journal_truncate();
+    test_journal_replay();
+    test_snapshot();
+    test_snapshot_v1();
+    // last, as the server leaves the chatbot non-interactive
+    test_event();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}